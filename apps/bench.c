@@ -43,8 +43,35 @@ static void bench_spawn2()
         sl_task_yield();
     }
 }
+
+static void bench_spawn_many()
+{
+    atomic_store(&counter, 0);
+    sl_task_spawn_many(null_fn, NULL, ROUNDS2, -1);
+    for (int i = 0; i < ROUNDS2; ++i) {
+        sl_task_yield();
+    }
+}
 #endif
 
+static void *ret_fn(void *arg)
+{
+    return arg;
+}
+
+static void bench_spawn_join()
+{
+    sl_task_t task;
+    void *ret;
+
+    for (int i = 0; i < ROUNDS; ++i) {
+        sl_task_spawn_joinable(&task, ret_fn, (void *)(long)i, 0);
+        sl_task_join(task, &ret);
+        if (ret != (void *)(long)i)
+            printf("spawn_join: bad return value %p\n", ret);
+    }
+}
+
 static void bench_yield()
 {
     atomic_store(&counter, 0);
@@ -57,6 +84,62 @@ static void bench_yield()
     }
 }
 
+#ifdef SKYLOFT_TASK_TLS
+static void bench_yield_tls()
+{
+    atomic_store(&counter, 0);
+
+    /* every switch moves FS between the kthread's TLS and the task's */
+    sl_task_spawn_tls(thread_yield_fn, NULL, 0);
+    thread_yield_fn(NULL);
+
+    while (atomic_load(&counter) < 2) {
+        sl_task_yield();
+    }
+}
+#endif
+
+/*
+ * Yields with the vector registers in their initial state, or with YMM0 in
+ * use. Compare builds with XSAVE=1, FXSAVE=1 and neither (nothing saved) for
+ * the cost of switching vector state.
+ */
+static void thread_yield_xstate_fn(void *arg)
+{
+    bool dirty = arg != NULL;
+
+    asm volatile("vzeroall");
+    for (int i = 0; i < ROUNDS / 2; ++i) {
+        if (dirty)
+            asm volatile("vpcmpeqd %%xmm0, %%xmm0, %%xmm0\n\t"
+                         "vinsertf128 $1, %%xmm0, %%ymm0, %%ymm0" ::: "memory");
+        sl_task_yield();
+    }
+    atomic_fetch_add(&counter, 1);
+}
+
+static void bench_yield_xstate(bool dirty)
+{
+    atomic_store(&counter, 0);
+
+    sl_task_spawn(thread_yield_xstate_fn, (void *)dirty, 0);
+    thread_yield_xstate_fn((void *)dirty);
+
+    while (atomic_load(&counter) < 2) {
+        sl_task_yield();
+    }
+}
+
+static void bench_yield_xclean()
+{
+    bench_yield_xstate(false);
+}
+
+static void bench_yield_avx()
+{
+    bench_yield_xstate(true);
+}
+
 static void bench_task_create()
 {
     for (int i = 0; i < ROUNDS2; i++) task_create(null_fn, NULL);
@@ -65,9 +148,18 @@ static void bench_task_create()
 void app_main(void *arg)
 {
     bench_one("yield", bench_yield, ROUNDS);
+#ifdef SKYLOFT_TASK_TLS
+    bench_one("yield_tls", bench_yield_tls, ROUNDS);
+#endif
+    if (__builtin_cpu_supports("avx")) {
+        bench_one("yield_xclean", bench_yield_xclean, ROUNDS);
+        bench_one("yield_avx", bench_yield_avx, ROUNDS);
+    }
     bench_one("spawn", bench_spawn, ROUNDS);
+    bench_one("spawn_join", bench_spawn_join, ROUNDS);
 #ifndef SKYLOFT_SCHED_SQ
     bench_one("spawn2", bench_spawn2, ROUNDS2);
+    bench_one("spawn_many", bench_spawn_many, ROUNDS2);
 #endif
     bench_one("task_create", bench_task_create, ROUNDS2);
 }
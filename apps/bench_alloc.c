@@ -0,0 +1,168 @@
+/*
+ * bench_alloc.c - smalloc() benchmarks
+ *
+ * Sizes sit just above powers of two, where rounding up to the size class
+ * wastes the most. The slab usage printed at the end shows how much of the
+ * memory behind the live items is fragmented, the tcache usage how often the
+ * per-CPU magazines served an operation.
+ *
+ * smalloc_xcpu allocates on one CPU and frees on another, passing the items
+ * through a ring, like buffers released by another core's completions.
+ *
+ * request_* spawn a task per request that allocates a few dozen small objects,
+ * freeing them one by one (smalloc) or all at once at exit (arena).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <skyloft/mm/slab.h>
+#include <skyloft/mm/smalloc.h>
+#include <skyloft/mm/tcache.h>
+#include <skyloft/sync/sync.h>
+#include <skyloft/uapi/arena.h>
+#include <skyloft/uapi/task.h>
+#include <utils/assert.h>
+#include <utils/atomic.h>
+#include <utils/defs.h>
+
+#include "bench_common.h"
+
+#define ROUNDS        10000000
+#define NR_LIVE       10000
+#define XCPU_ROUNDS   1000000
+#define XCPU_RING     1024
+#define XCPU_PRODUCER 0
+#define XCPU_CONSUMER 1
+#define REQ_ROUNDS    100000
+#define REQ_OBJECTS   32
+
+static const size_t sizes[] = {65, 130, 260, 520, 1040, 2080, 33 * 1024};
+static void *items[NR_LIVE];
+
+static void bench_smalloc_65()
+{
+    void *p;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        p = smalloc(65);
+        BUG_ON(!p);
+        sfree(p);
+    }
+}
+
+static void bench_smalloc_mixed()
+{
+    for (int i = 0; i < NR_LIVE; i++) {
+        items[i] = smalloc(sizes[i % ARRAY_SIZE(sizes)]);
+        BUG_ON(!items[i]);
+    }
+    for (int i = 0; i < NR_LIVE; i++) sfree(items[i]);
+}
+
+static void bench_malloc_mixed()
+{
+    for (int i = 0; i < NR_LIVE; i++) {
+        items[i] = malloc(sizes[i % ARRAY_SIZE(sizes)]);
+        BUG_ON(!items[i]);
+    }
+    for (int i = 0; i < NR_LIVE; i++) free(items[i]);
+}
+
+static void *xcpu_ring[XCPU_RING];
+static unsigned long xcpu_head, xcpu_tail;
+static waitgroup_t xcpu_wg;
+
+static void xcpu_producer(void *arg)
+{
+    void *p;
+
+    for (unsigned long i = 0; i < XCPU_ROUNDS; i++) {
+        p = smalloc(65);
+        BUG_ON(!p);
+        while (i - atomic_load_acq(&xcpu_head) >= XCPU_RING) sl_task_yield();
+        xcpu_ring[i % XCPU_RING] = p;
+        atomic_store_rel(&xcpu_tail, i + 1);
+    }
+    waitgroup_done(&xcpu_wg);
+}
+
+static void xcpu_consumer(void *arg)
+{
+    for (unsigned long i = 0; i < XCPU_ROUNDS; i++) {
+        while (atomic_load_acq(&xcpu_tail) == i) sl_task_yield();
+        sfree(xcpu_ring[i % XCPU_RING]);
+        atomic_store_rel(&xcpu_head, i + 1);
+    }
+    waitgroup_done(&xcpu_wg);
+}
+
+static void bench_smalloc_xcpu()
+{
+    xcpu_head = xcpu_tail = 0;
+    waitgroup_init(&xcpu_wg);
+    waitgroup_add(&xcpu_wg, 2);
+    BUG_ON(sl_task_spawn_oncpu(XCPU_CONSUMER, xcpu_consumer, NULL, 0));
+    BUG_ON(sl_task_spawn_oncpu(XCPU_PRODUCER, xcpu_producer, NULL, 0));
+    waitgroup_wait(&xcpu_wg);
+}
+
+static void *request_smalloc(void *arg)
+{
+    void *objs[REQ_OBJECTS];
+
+    for (int i = 0; i < REQ_OBJECTS; i++) {
+        objs[i] = smalloc(sizes[i % 4]);
+        BUG_ON(!objs[i]);
+    }
+    for (int i = 0; i < REQ_OBJECTS; i++) sfree(objs[i]);
+    return NULL;
+}
+
+static void *request_arena(void *arg)
+{
+    for (int i = 0; i < REQ_OBJECTS; i++) BUG_ON(!sl_arena_alloc(sizes[i % 4]));
+    return NULL;
+}
+
+static void run_requests(void *(*fn)(void *))
+{
+    sl_task_t task;
+
+    for (int i = 0; i < REQ_ROUNDS; i++) {
+        BUG_ON(sl_task_spawn_joinable(&task, fn, NULL, 0));
+        BUG_ON(sl_task_join(task, NULL));
+    }
+}
+
+static void bench_request_smalloc()
+{
+    run_requests(request_smalloc);
+}
+
+static void bench_request_arena()
+{
+    run_requests(request_arena);
+}
+
+static void app_main(void *arg)
+{
+    bench_one("smalloc_65", bench_smalloc_65, ROUNDS);
+    bench_one("smalloc_mixed", bench_smalloc_mixed, NR_LIVE);
+    bench_one("malloc_mixed", bench_malloc_mixed, NR_LIVE);
+    bench_one("smalloc_xcpu", bench_smalloc_xcpu, XCPU_ROUNDS);
+    bench_one("request_smalloc", bench_request_smalloc, REQ_ROUNDS);
+    bench_one("request_arena", bench_request_arena, REQ_ROUNDS);
+
+    /* keep a working set alive while printing the usage */
+    for (int i = 0; i < NR_LIVE; i++) items[i] = smalloc(sizes[i % ARRAY_SIZE(sizes)]);
+    slab_print_usage();
+    tcache_print_usage();
+    for (int i = 0; i < NR_LIVE; i++) sfree(items[i]);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("Skyloft allocator benchmarks\n");
+    sl_libos_start(app_main, NULL);
+}
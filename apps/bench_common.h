@@ -1,13 +1,51 @@
+#include <linux/perf_event.h>
 #include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <utils/time.h>
 
+/* counts the dTLB load misses of the calling kthread, or returns -1 if unsupported */
+static int bench_open_dtlb_misses(void)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HW_CACHE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long bench_read_counter(int fd)
+{
+    long val;
+
+    if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val))
+        return 0;
+    return val;
+}
+
 static void bench_one(const char *name, void(bench_fn)(), int rounds)
 {
+    int fd = bench_open_dtlb_misses();
+    long misses = bench_read_counter(fd);
     __nsec before = now_ns();
     bench_fn();
     __nsec after = now_ns();
     __nsec elapsed = (after - before + rounds / 2) / rounds;
 
-    printf("%s: %ldns (%ld / %d)\n", name, elapsed, after - before, rounds);
+    misses = bench_read_counter(fd) - misses;
+    if (fd < 0) {
+        printf("%s: %ldns (%ld / %d)\n", name, elapsed, after - before, rounds);
+        return;
+    }
+
+    /* only the misses of the kthread running the benchmark are counted */
+    printf("%s: %ldns (%ld / %d), %.3f dTLB misses/op\n", name, elapsed, after - before, rounds,
+           (double)misses / rounds);
+    close(fd);
 }
@@ -0,0 +1,105 @@
+/*
+ * bench_coro.cc - C++20 coroutine benchmarks
+ *
+ * Coroutine frames are allocated by smalloc() and resumed by per-CPU
+ * executors, so many in-flight requests don't each need a task stack.
+ */
+
+#include <stdio.h>
+
+#include <skyloft/uapi/coro.hpp>
+#include <skyloft/uapi/params.h>
+#include <skyloft/uapi/task.h>
+#include <utils/assert.h>
+
+#include "bench_common.h"
+
+#define ROUNDS      1000000
+#define NR_INFLIGHT 100000
+#define SLEEP_US    1000
+#define NR_LOCKERS  64
+
+static skyloft::task<long> add_one(long v)
+{
+    co_return v + 1;
+}
+
+static skyloft::task<long> await_loop()
+{
+    long v = 0;
+
+    for (int i = 0; i < ROUNDS; i++) v = co_await add_one(v);
+    co_return v;
+}
+
+static void bench_await()
+{
+    BUG_ON(skyloft::sync_wait(await_loop()) != ROUNDS);
+}
+
+static skyloft::mutex lock;
+static skyloft::condvar cond;
+static long shared;
+static int nr_running;
+
+static skyloft::task<> finish_one()
+{
+    co_await lock.lock();
+    if (--nr_running == 0)
+        cond.notify_all();
+    lock.unlock();
+}
+
+static skyloft::task<> wait_all()
+{
+    co_await lock.lock();
+    while (nr_running) co_await cond.wait(lock);
+    lock.unlock();
+}
+
+static skyloft::task<> locker(int rounds)
+{
+    for (int i = 0; i < rounds; i++) {
+        co_await lock.lock();
+        shared++;
+        lock.unlock();
+        co_await skyloft::yield{};
+    }
+    co_await finish_one();
+}
+
+static void bench_mutex()
+{
+    shared = 0;
+    nr_running = NR_LOCKERS;
+    for (int i = 0; i < NR_LOCKERS; i++)
+        BUG_ON(skyloft::spawn(locker(ROUNDS / NR_LOCKERS), i % USED_CPUS));
+    skyloft::sync_wait(wait_all());
+    BUG_ON(shared != ROUNDS / NR_LOCKERS * NR_LOCKERS);
+}
+
+static skyloft::task<> sleeper()
+{
+    co_await skyloft::sleep_for(SLEEP_US);
+    co_await finish_one();
+}
+
+static void bench_sleep_fanout()
+{
+    nr_running = NR_INFLIGHT;
+    for (int i = 0; i < NR_INFLIGHT; i++) BUG_ON(skyloft::spawn(sleeper(), i % USED_CPUS));
+    skyloft::sync_wait(wait_all());
+}
+
+static void app_main(void *arg)
+{
+    bench_one("coro_await", bench_await, ROUNDS);
+    bench_one("coro_mutex", bench_mutex, ROUNDS / NR_LOCKERS * NR_LOCKERS);
+    bench_one("coro_sleep_fanout", bench_sleep_fanout, NR_INFLIGHT);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("Skyloft coroutine benchmarks\n");
+    sl_libos_start(app_main, NULL);
+}
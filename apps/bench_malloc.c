@@ -0,0 +1,131 @@
+/*
+ * bench_malloc.c - multithreaded malloc() benchmarks
+ *
+ * One task per CPU keeps a window of live blocks and keeps replacing random
+ * ones with blocks of random sizes. Built twice: bench_malloc uses glibc's
+ * malloc(), bench_malloc_shim is linked with libshim_malloc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <skyloft/sync/sync.h>
+#include <skyloft/uapi/params.h>
+#include <skyloft/uapi/task.h>
+#include <utils/assert.h>
+#include <utils/defs.h>
+
+#include "bench_common.h"
+
+#define ROUNDS_PER_TASK 1000000
+#define NR_SLOTS        1024
+#define HANDOFF_ROUNDS  100000
+
+#ifdef SHIM_MALLOC
+#define ALLOCATOR "shim_malloc"
+#else
+#define ALLOCATOR "glibc"
+#endif
+
+static waitgroup_t wg;
+/* blocks allocated by task i are freed by task i + 1 */
+static void *handoff[USED_CPUS][NR_SLOTS];
+
+static __always_inline uint32_t xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* mostly small blocks, a few up to 4 KB and a rare one of 64 KB */
+static __always_inline size_t random_size(uint32_t *state)
+{
+    uint32_t r = xorshift(state);
+
+    if ((r & 0xff) == 0)
+        return 64 * 1024;
+    if ((r & 0xf) == 0)
+        return 512 + (r >> 20) % 3584;
+    return 16 + (r >> 20) % 496;
+}
+
+static void churn_task(void *arg)
+{
+    void **slots = calloc(NR_SLOTS, sizeof(void *));
+    uint32_t state = (uintptr_t)arg + 1;
+    int i, slot;
+
+    BUG_ON(!slots);
+    for (i = 0; i < ROUNDS_PER_TASK; i++) {
+        slot = xorshift(&state) % NR_SLOTS;
+        free(slots[slot]);
+        slots[slot] = malloc(random_size(&state));
+        BUG_ON(!slots[slot]);
+        *(char *)slots[slot] = i;
+    }
+    for (i = 0; i < NR_SLOTS; i++) free(slots[i]);
+    free(slots);
+    waitgroup_done(&wg);
+}
+
+static void handoff_alloc_task(void *arg)
+{
+    int id = (uintptr_t)arg, i;
+    uint32_t state = id + 1;
+
+    for (i = 0; i < NR_SLOTS; i++) {
+        handoff[id][i] = malloc(random_size(&state));
+        BUG_ON(!handoff[id][i]);
+    }
+    waitgroup_done(&wg);
+}
+
+static void handoff_free_task(void *arg)
+{
+    int id = ((uintptr_t)arg + 1) % USED_CPUS, i;
+
+    for (i = 0; i < NR_SLOTS; i++) free(handoff[id][i]);
+    waitgroup_done(&wg);
+}
+
+static void run_on_all(thread_fn_t fn)
+{
+    int i;
+
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, USED_CPUS);
+    for (i = 0; i < USED_CPUS; i++) BUG_ON(sl_task_spawn_oncpu(i, fn, (void *)(uintptr_t)i, 0));
+    waitgroup_wait(&wg);
+}
+
+static void bench_churn()
+{
+    run_on_all(churn_task);
+}
+
+/* frees blocks on another CPU than the one that allocated them */
+static void bench_handoff()
+{
+    int i;
+
+    for (i = 0; i < HANDOFF_ROUNDS / NR_SLOTS; i++) {
+        run_on_all(handoff_alloc_task);
+        run_on_all(handoff_free_task);
+    }
+}
+
+static void app_main(void *arg)
+{
+    bench_one("malloc_churn", bench_churn, ROUNDS_PER_TASK * USED_CPUS);
+    bench_one("malloc_handoff", bench_handoff, HANDOFF_ROUNDS / NR_SLOTS * NR_SLOTS * USED_CPUS);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("Skyloft malloc benchmarks (%s)\n", ALLOCATOR);
+    sl_libos_start(app_main, NULL);
+}
@@ -0,0 +1,100 @@
+/*
+ * bench_mutex.c - mutex contention micro-benchmark
+ *
+ * N uthreads spread over M cores repeatedly take a shared mutex, hold it for a
+ * fixed critical section, and do some work outside of it.
+ *
+ * Usage: bench_mutex [nr_threads] [nr_cpus]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <skyloft/params.h>
+#include <skyloft/sync/sync.h>
+#include <skyloft/task.h>
+#include <skyloft/uapi/task.h>
+#include <utils/defs.h>
+#include <utils/log.h>
+#include <utils/time.h>
+
+#include "bench_common.h"
+
+#define ROUNDS     1000000
+#define OUTSIDE_NS 200
+
+static const int cs_lengths_ns[] = {0, 100, 1000, 10000};
+
+static int nr_threads = 32;
+static int nr_cpus = 4;
+static int cs_ns;
+
+static mutex_t lock;
+static waitgroup_t wg;
+static volatile unsigned long shared;
+
+static __always_inline void spin_ns(int ns)
+{
+    __nsec end = now_ns() + ns;
+
+    while (now_ns() < end) cpu_relax();
+}
+
+static void worker_fn(void *arg)
+{
+    int rounds = (long)arg;
+
+    for (int i = 0; i < rounds; i++) {
+        mutex_lock(&lock);
+        shared++;
+        if (cs_ns)
+            spin_ns(cs_ns);
+        mutex_unlock(&lock);
+        spin_ns(OUTSIDE_NS);
+    }
+
+    waitgroup_done(&wg);
+}
+
+static void bench_contention()
+{
+    long rounds = ROUNDS / nr_threads;
+    int i, ret;
+
+    shared = 0;
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        ret = sl_task_spawn_oncpu(i % nr_cpus, worker_fn, (void *)rounds, 0);
+        BUG_ON(ret);
+    }
+    waitgroup_wait(&wg);
+    BUG_ON(shared != (unsigned long)rounds * nr_threads);
+}
+
+void app_main(void *arg)
+{
+    char name[64];
+
+    mutex_init(&lock);
+    for (int i = 0; i < (int)ARRAY_SIZE(cs_lengths_ns); i++) {
+        cs_ns = cs_lengths_ns[i];
+        snprintf(name, sizeof(name), "mutex(%dx%d, cs=%dns)", nr_threads, nr_cpus, cs_ns);
+        bench_one(name, bench_contention, ROUNDS / nr_threads * nr_threads);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        nr_threads = atoi(argv[1]);
+    if (argc > 2)
+        nr_cpus = atoi(argv[2]);
+    if (nr_threads <= 0 || nr_cpus <= 0 || nr_cpus > USED_CPUS) {
+        printf("Usage: %s [nr_threads] [nr_cpus <= %d]\n", argv[0], USED_CPUS);
+        return -1;
+    }
+
+    printf("Skyloft mutex contention benchmark\n");
+    sl_libos_start(app_main, NULL);
+}
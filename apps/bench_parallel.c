@@ -0,0 +1,168 @@
+/*
+ * bench_parallel.c - fork-join benchmarks
+ *
+ * Compares sl_parallel_for()/sl_spawn_join() with spawning one task per chunk
+ * and joining through a waitgroup. See bench_pthread for the pthread version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <skyloft/sync/sync.h>
+#include <skyloft/uapi/task.h>
+#include <utils/assert.h>
+#include <utils/defs.h>
+
+#include "bench_common.h"
+
+#define NR_ITEMS    (1 << 22)
+#define GRAIN       (1 << 12)
+#define SORT_ITEMS  (1 << 20)
+#define SORT_CUTOFF (1 << 14)
+
+static long *items;
+static long expected_sum;
+static long sum;
+static int *sort_buf, *sort_tmp;
+
+static void reduce_range(long begin, long end, void *arg)
+{
+    long i, local = 0;
+
+    for (i = begin; i < end; i++) local += items[i];
+    __atomic_fetch_add(&sum, local, __ATOMIC_RELAXED);
+}
+
+static void bench_reduce_pfor()
+{
+    sum = 0;
+    BUG_ON(sl_parallel_for(0, NR_ITEMS, GRAIN, reduce_range, NULL));
+    BUG_ON(sum != expected_sum);
+}
+
+struct chunk {
+    long begin;
+    waitgroup_t *wg;
+};
+
+static void reduce_chunk(void *arg)
+{
+    struct chunk *c = arg;
+
+    reduce_range(c->begin, c->begin + GRAIN, NULL);
+    waitgroup_done(c->wg);
+}
+
+static void bench_reduce_spawn()
+{
+    static struct chunk chunks[NR_ITEMS / GRAIN];
+    waitgroup_t wg;
+    int i;
+
+    sum = 0;
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, NR_ITEMS / GRAIN);
+    for (i = 0; i < NR_ITEMS / GRAIN; i++) {
+        chunks[i].begin = (long)i * GRAIN;
+        chunks[i].wg = &wg;
+        BUG_ON(sl_task_spawn(reduce_chunk, &chunks[i], 0));
+    }
+    waitgroup_wait(&wg);
+    BUG_ON(sum != expected_sum);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void merge(int *a, int *tmp, int n)
+{
+    int i = 0, j = n / 2, k = 0;
+
+    while (i < n / 2 && j < n) tmp[k++] = a[i] <= a[j] ? a[i++] : a[j++];
+    while (i < n / 2) tmp[k++] = a[i++];
+    while (j < n) tmp[k++] = a[j++];
+    memcpy(a, tmp, sizeof(int) * n);
+}
+
+struct sort_arg {
+    int *a, *tmp;
+    int n;
+};
+
+static void merge_sort(void *arg)
+{
+    struct sort_arg *s = arg;
+    struct sort_arg halves[2] = {
+        {.a = s->a, .tmp = s->tmp, .n = s->n / 2},
+        {.a = s->a + s->n / 2, .tmp = s->tmp + s->n / 2, .n = s->n - s->n / 2},
+    };
+    void *args[2] = {&halves[0], &halves[1]};
+
+    if (s->n <= SORT_CUTOFF) {
+        qsort(s->a, s->n, sizeof(int), cmp_int);
+        return;
+    }
+
+    BUG_ON(sl_spawn_join(merge_sort, args, 2));
+    merge(s->a, s->tmp, s->n);
+}
+
+static void prepare_sort()
+{
+    srand(42);
+    for (int i = 0; i < SORT_ITEMS; i++) sort_buf[i] = rand();
+}
+
+static void check_sort()
+{
+    for (int i = 1; i < SORT_ITEMS; i++) BUG_ON(sort_buf[i - 1] > sort_buf[i]);
+}
+
+static void bench_sort_seq()
+{
+    prepare_sort();
+    qsort(sort_buf, SORT_ITEMS, sizeof(int), cmp_int);
+    check_sort();
+}
+
+static void bench_sort_spawn_join()
+{
+    struct sort_arg s = {.a = sort_buf, .tmp = sort_tmp, .n = SORT_ITEMS};
+
+    prepare_sort();
+    merge_sort(&s);
+    check_sort();
+}
+
+void app_main(void *arg)
+{
+    items = malloc(sizeof(long) * NR_ITEMS);
+    sort_buf = malloc(sizeof(int) * SORT_ITEMS);
+    sort_tmp = malloc(sizeof(int) * SORT_ITEMS);
+    BUG_ON(!items || !sort_buf || !sort_tmp);
+
+    for (long i = 0; i < NR_ITEMS; i++) {
+        items[i] = i;
+        expected_sum += i;
+    }
+
+    bench_one("reduce_parallel_for", bench_reduce_pfor, NR_ITEMS);
+    bench_one("reduce_spawn_per_chunk", bench_reduce_spawn, NR_ITEMS);
+    bench_one("sort_seq", bench_sort_seq, SORT_ITEMS);
+    bench_one("sort_spawn_join", bench_sort_spawn_join, SORT_ITEMS);
+
+    free(items);
+    free(sort_buf);
+    free(sort_tmp);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("Skyloft fork-join benchmarks\n");
+    sl_libos_start(app_main, NULL);
+}
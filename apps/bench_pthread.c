@@ -1,11 +1,19 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "bench_common.h"
 
 #define ROUNDS 100000
 
+/* same sizes as bench_parallel */
+#define NR_ITEMS    (1 << 22)
+#define SORT_ITEMS  (1 << 20)
+#define SORT_CUTOFF (1 << 14)
+
 static pthread_t thread;
 
 static void *null_fn(void *)
@@ -35,9 +43,99 @@ static void bench_yield()
     pthread_join(thread, NULL);
 }
 
+static long *items;
+static long expected_sum;
+static atomic_long sum;
+static int nr_threads;
+static int *sort_buf, *sort_tmp;
+
+static void *reduce_fn(void *arg)
+{
+    long id = (long)arg, chunk = NR_ITEMS / nr_threads;
+    long begin = id * chunk, end = id == nr_threads - 1 ? NR_ITEMS : begin + chunk;
+    long i, local = 0;
+
+    for (i = begin; i < end; i++) local += items[i];
+    atomic_fetch_add(&sum, local);
+    return NULL;
+}
+
+static void bench_reduce()
+{
+    pthread_t threads[nr_threads];
+
+    atomic_store(&sum, 0);
+    for (long i = 0; i < nr_threads; i++) pthread_create(&threads[i], NULL, reduce_fn, (void *)i);
+    for (int i = 0; i < nr_threads; i++) pthread_join(threads[i], NULL);
+    if (atomic_load(&sum) != expected_sum)
+        abort();
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+struct sort_arg {
+    int *a, *tmp;
+    int n;
+};
+
+static void *merge_sort(void *arg)
+{
+    struct sort_arg *s = arg;
+    struct sort_arg lo = {.a = s->a, .tmp = s->tmp, .n = s->n / 2};
+    struct sort_arg hi = {.a = s->a + s->n / 2, .tmp = s->tmp + s->n / 2, .n = s->n - s->n / 2};
+    int i = 0, j = s->n / 2, k = 0;
+    pthread_t t;
+
+    if (s->n <= SORT_CUTOFF) {
+        qsort(s->a, s->n, sizeof(int), cmp_int);
+        return NULL;
+    }
+
+    pthread_create(&t, NULL, merge_sort, &lo);
+    merge_sort(&hi);
+    pthread_join(t, NULL);
+
+    while (i < s->n / 2 && j < s->n) s->tmp[k++] = s->a[i] <= s->a[j] ? s->a[i++] : s->a[j++];
+    while (i < s->n / 2) s->tmp[k++] = s->a[i++];
+    while (j < s->n) s->tmp[k++] = s->a[j++];
+    memcpy(s->a, s->tmp, sizeof(int) * s->n);
+    return NULL;
+}
+
+static void bench_sort()
+{
+    struct sort_arg s = {.a = sort_buf, .tmp = sort_tmp, .n = SORT_ITEMS};
+
+    srand(42);
+    for (int i = 0; i < SORT_ITEMS; i++) sort_buf[i] = rand();
+    merge_sort(&s);
+    for (int i = 1; i < SORT_ITEMS; i++)
+        if (sort_buf[i - 1] > sort_buf[i])
+            abort();
+}
+
 int main(int argc, char *argv[])
 {
     printf("PThread micro-benchmarks\n");
     bench_one("yield", bench_yield, ROUNDS);
     bench_one("spawn", bench_spawn, ROUNDS);
+
+    nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    items = malloc(sizeof(long) * NR_ITEMS);
+    sort_buf = malloc(sizeof(int) * SORT_ITEMS);
+    sort_tmp = malloc(sizeof(int) * SORT_ITEMS);
+    if (!items || !sort_buf || !sort_tmp)
+        return -1;
+    for (long i = 0; i < NR_ITEMS; i++) {
+        items[i] = i;
+        expected_sum += i;
+    }
+
+    bench_one("reduce", bench_reduce, NR_ITEMS);
+    bench_one("sort", bench_sort, SORT_ITEMS);
 }
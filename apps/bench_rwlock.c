@@ -0,0 +1,121 @@
+/*
+ * bench_rwlock.c - read-heavy reader-writer lock scaling benchmark
+ *
+ * One uthread per core looks up a shared table under a read lock and updates
+ * it under a write lock once every WRITE_EVERY operations. The same workload
+ * is run with a plain mutex for comparison.
+ *
+ * Usage: bench_rwlock [max_cpus]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <skyloft/params.h>
+#include <skyloft/sync/sync.h>
+#include <skyloft/task.h>
+#include <skyloft/uapi/task.h>
+#include <utils/defs.h>
+#include <utils/log.h>
+#include <utils/time.h>
+
+#include "bench_common.h"
+
+#define ROUNDS      1000000
+#define WRITE_EVERY 1000
+#define TABLE_SIZE  64
+
+static const int nr_cpus_list[] = {1, 2, 4, 8, 16, 24};
+
+static int max_cpus = USED_CPUS;
+static int nr_cpus;
+static bool use_rwmutex;
+
+static rwmutex_t rwlock;
+static mutex_t lock;
+static waitgroup_t wg;
+static volatile unsigned long table[TABLE_SIZE];
+static volatile unsigned long sink;
+
+static void worker_fn(void *arg)
+{
+    int rounds = (long)arg;
+    unsigned long sum = 0;
+
+    for (int i = 0; i < rounds; i++) {
+        bool write = i % WRITE_EVERY == 0;
+
+        if (use_rwmutex) {
+            if (write)
+                rwmutex_wrlock(&rwlock);
+            else
+                rwmutex_rdlock(&rwlock);
+        } else {
+            mutex_lock(&lock);
+        }
+
+        if (write)
+            table[i % TABLE_SIZE]++;
+        else
+            sum += table[i % TABLE_SIZE];
+
+        if (use_rwmutex)
+            rwmutex_unlock(&rwlock);
+        else
+            mutex_unlock(&lock);
+    }
+
+    sink = sum;
+    waitgroup_done(&wg);
+}
+
+static void bench_read_heavy()
+{
+    long rounds = ROUNDS / nr_cpus;
+    int i, ret;
+
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, nr_cpus);
+    for (i = 0; i < nr_cpus; i++) {
+        ret = sl_task_spawn_oncpu(i, worker_fn, (void *)rounds, 0);
+        BUG_ON(ret);
+    }
+    waitgroup_wait(&wg);
+}
+
+void app_main(void *arg)
+{
+    char name[64];
+
+    BUG_ON(rwmutex_init(&rwlock));
+    mutex_init(&lock);
+
+    for (int i = 0; i < (int)ARRAY_SIZE(nr_cpus_list); i++) {
+        nr_cpus = nr_cpus_list[i];
+        if (nr_cpus > max_cpus)
+            break;
+
+        use_rwmutex = true;
+        snprintf(name, sizeof(name), "rwmutex(%d cpus)", nr_cpus);
+        bench_one(name, bench_read_heavy, ROUNDS / nr_cpus * nr_cpus);
+
+        use_rwmutex = false;
+        snprintf(name, sizeof(name), "mutex(%d cpus)", nr_cpus);
+        bench_one(name, bench_read_heavy, ROUNDS / nr_cpus * nr_cpus);
+    }
+
+    rwmutex_destroy(&rwlock);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        max_cpus = atoi(argv[1]);
+    if (max_cpus <= 0 || max_cpus > USED_CPUS) {
+        printf("Usage: %s [max_cpus <= %d]\n", argv[0], USED_CPUS);
+        return -1;
+    }
+
+    printf("Skyloft reader-writer lock benchmark\n");
+    sl_libos_start(app_main, NULL);
+}
@@ -8,6 +8,7 @@
 #include <skyloft/params.h>
 #include <skyloft/sync/rcu.h>
 #include <skyloft/sync/sync.h>
+#include <skyloft/sync/timer.h>
 #include <skyloft/uapi/task.h>
 #include <utils/defs.h>
 #include <utils/log.h>
@@ -69,6 +70,17 @@ static void spawn_rcu_readers(waitgroup_t *wg, int readers)
     sl_task_yield();
 }
 
+static volatile bool spin_stop;
+
+/* never yields, so only a kick can get its CPU through a grace period */
+static void spin_handler(void *arg)
+{
+    waitgroup_t *wg_parent = (waitgroup_t *)arg;
+
+    while (!spin_stop) cpu_relax();
+    waitgroup_done(wg_parent);
+}
+
 static void main_handler(void *arg)
 {
     struct test_obj *o, *o2;
@@ -114,6 +126,16 @@ static void main_handler(void *arg)
     waitgroup_wait(&wg);
     log_info("readers finished.");
 
+    /* test synchronize_rcu_expedited() against a task that never yields */
+    log_info("testing synchronize_rcu_expedited()...");
+    waitgroup_add(&wg, 1);
+    BUG_ON(sl_task_spawn_oncpu(1, spin_handler, &wg, 0));
+    timer_sleep(1000);
+    synchronize_rcu_expedited();
+    spin_stop = true;
+    waitgroup_wait(&wg);
+    log_info("expedited grace period passed.");
+
     exit(0);
 }
 
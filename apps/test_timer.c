@@ -2,8 +2,10 @@
  * test_timer.c - tests task timer
  */
 
+#include <errno.h>
 #include <stdio.h>
 
+#include <skyloft/sched.h>
 #include <skyloft/sync/sync.h>
 #include <skyloft/sync/timer.h>
 #include <skyloft/task.h>
@@ -27,6 +29,27 @@ static void work_handler(void *arg)
     waitgroup_done(wg_parent);
 }
 
+static void noop_timer(unsigned long arg) {}
+
+/* timed waits and cancelled timers must leave preemption as they found it */
+static void check_preempt_balance(void)
+{
+    struct timer_entry e;
+    unsigned int cnt;
+    int val = 0;
+
+    cnt = preempt_cnt;
+    BUG_ON(futex_wait_until(&val, 0, now_us() + 1000) != -ETIMEDOUT);
+    BUG_ON(preempt_cnt != cnt);
+
+    timer_init(&e, noop_timer, 0);
+    timer_start(&e, now_us() + 1000 * 1000);
+    BUG_ON(!timer_cancel(&e));
+    BUG_ON(timer_cancel(&e));
+    BUG_ON(preempt_cnt != cnt);
+    printf("preempt_cnt balanced after timed waits\n");
+}
+
 static void main_handler(void *arg)
 {
     waitgroup_t wg;
@@ -34,6 +57,8 @@ static void main_handler(void *arg)
     uint64_t start_us;
     int i, ret;
 
+    check_preempt_balance();
+
     waitgroup_init(&wg);
     waitgroup_add(&wg, WORKERS);
     start_us = now_us();
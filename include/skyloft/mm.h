@@ -1,7 +1,9 @@
 #pragma once
 
+#include <skyloft/mm/heapprof.h>
 #include <skyloft/mm/mempool.h>
 #include <skyloft/mm/page.h>
+#include <skyloft/mm/reclaim.h>
 #include <skyloft/mm/slab.h>
 #include <skyloft/mm/smalloc.h>
 #include <skyloft/mm/stack.h>
@@ -0,0 +1,65 @@
+/*
+ * heapprof.h - sampling allocation profiler
+ *
+ * Built with HEAP_PROFILE=1 only, otherwise the hooks compile to nothing.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <skyloft/percpu.h>
+
+#include <utils/atomic.h>
+#include <utils/defs.h>
+
+#ifdef SKYLOFT_HEAP_PROFILE
+
+/* buckets of the table of sampled objects that are still live */
+#define HEAP_PROF_OBJ_BUCKETS 16384
+
+struct heap_prof_obj;
+
+DECLARE_PERCPU(long, heap_prof_left);
+extern struct heap_prof_obj *heap_prof_objs[HEAP_PROF_OBJ_BUCKETS];
+
+void __heap_prof_sample(void *item, size_t size, const char *name);
+void __heap_prof_free(void *item);
+int heapprof_init(void);
+int heapprof_init_late_percpu(void);
+
+static __always_inline unsigned int heap_prof_obj_hash(void *item)
+{
+    return ((uintptr_t)item >> 4) * 0x9e3779b1U % HEAP_PROF_OBJ_BUCKETS;
+}
+
+/**
+ * heap_prof_alloc - counts an allocation towards the next sample
+ * @item: the allocated item, or NULL if out of memory
+ * @size: the size of the item
+ * @name: the allocator, reported as a label
+ *
+ * Must be called on a kthread with preemption disabled.
+ */
+static __always_inline void heap_prof_alloc(void *item, size_t size, const char *name)
+{
+    if (unlikely((percpu_get(heap_prof_left) -= size) < 0) && item)
+        __heap_prof_sample(item, size, name);
+}
+
+/**
+ * heap_prof_free - removes an item from the live profile if it was sampled
+ * @item: the item being freed
+ */
+static __always_inline void heap_prof_free(void *item)
+{
+    if (unlikely(ACCESS_ONCE(heap_prof_objs[heap_prof_obj_hash(item)])))
+        __heap_prof_free(item);
+}
+
+#else
+
+static __always_inline void heap_prof_alloc(void *item, size_t size, const char *name) {}
+static __always_inline void heap_prof_free(void *item) {}
+
+#endif
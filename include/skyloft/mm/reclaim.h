@@ -0,0 +1,28 @@
+/*
+ * reclaim.h - returning idle allocator memory to the kernel
+ */
+
+#pragma once
+
+#include <skyloft/percpu.h>
+
+#include <utils/atomic.h>
+#include <utils/defs.h>
+
+extern unsigned int mem_reclaim_gen;
+DECLARE_PERCPU(unsigned int, mem_reclaim_seen);
+
+void __mem_reclaim_percpu(void);
+void mem_reclaim(void);
+int reclaim_init_late_percpu(void);
+
+/**
+ * mem_reclaim_poll - drains this kthread's caches if a reclaim is pending
+ *
+ * Called by the scheduler, which doesn't hold any of the caches.
+ */
+static __always_inline void mem_reclaim_poll(void)
+{
+    if (unlikely(ACCESS_ONCE(mem_reclaim_gen) != percpu_get(mem_reclaim_seen)))
+        __mem_reclaim_percpu();
+}
@@ -41,6 +41,9 @@ struct slab_node {
     struct list_head full_list;
     struct list_head partial_list;
     int nr_pages;
+
+    /* items freed without the page lock, taken by the next allocation */
+    struct slab_hdr *remote_free;
 };
 
 struct slab {
@@ -60,6 +63,7 @@ struct slab {
 extern int slab_create(struct slab *s, const char *name, size_t size, int flags);
 extern void slab_destroy(struct slab *s);
 extern int slab_reclaim(struct slab *s);
+extern void slab_reclaim_all(void);
 extern void *slab_alloc_on_node(struct slab *s, int numa_node) __slab_malloc;
 extern void slab_free(struct slab *s, void *item);
 extern void slab_print_usage(void);
@@ -10,9 +10,15 @@
 
 #define __smalloc_attr __malloc __assume_aligned(16)
 
+/* larger sizes are not served by smalloc() */
+#define SMALLOC_MAX_SIZE (256 * 1024)
+
 void *smalloc(size_t size) __smalloc_attr;
+void *smalloc_aligned(size_t size, size_t align) __malloc;
 void *__szalloc(size_t size) __smalloc_attr;
 void sfree(void *item);
+void sfree_nocache(void *item);
+size_t smalloc_usable_size(void *item);
 int smalloc_init(void);
 int smalloc_init_percpu(void);
 
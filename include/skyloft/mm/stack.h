@@ -5,6 +5,20 @@
 
 DECLARE_PERCPU(struct tcache_percpu, stack_percpu);
 
+#define STACK_BASE_ADDR 0x200000000000UL
+/* the stacks of each NUMA node are mapped in their own range */
+#define STACK_NODE_SPAN    (1UL << 40)
+#define STACK_NODE_BASE(n) (STACK_BASE_ADDR + (n) * STACK_NODE_SPAN)
+
+/**
+ * stack_numa_node - gets the NUMA node a stack belongs to
+ * @s: the stack
+ */
+static inline int stack_numa_node(void *s)
+{
+    return ((uintptr_t)s - STACK_BASE_ADDR) / STACK_NODE_SPAN;
+}
+
 /**
  * stack_alloc - allocates a stack
  *
@@ -23,5 +37,9 @@ static inline void stack_free(struct stack *s)
     tcache_free(&percpu_get(stack_percpu), (void *)s);
 }
 
+void stack_free_remote(struct stack *s);
 int stack_init_percpu();
 int stack_init();
+int stack_init_late_percpu(void);
+void stack_reclaim_all(void);
+void stack_print_stats(void);
@@ -4,22 +4,32 @@
 
 #pragma once
 
+#include <skyloft/mm/heapprof.h>
 #include <skyloft/percpu.h>
 
 #include <utils/atomic.h>
 #include <utils/list.h>
 #include <utils/log.h>
 #include <utils/spinlock.h>
+#include <utils/time.h>
 
 
-#define TCACHE_MAX_MAG_SIZE     64
+#define TCACHE_MIN_MAG_SIZE     2U
+#define TCACHE_MAX_MAG_SIZE     64U
 #define TCACHE_DEFAULT_MAG_SIZE 8
+/* magazines don't grow beyond this many bytes of items */
+#define TCACHE_MAX_MAG_BYTES    (64UL * 1024)
 
 struct tcache;
 
 struct tcache_hdr {
     struct tcache_hdr *next_item;
-    struct tcache_hdr *next_mag;
+    union {
+        /* in the first item of a magazine in the shared pool */
+        struct tcache_hdr *next_mag;
+        /* in the second item, the number of items in the magazine */
+        unsigned long nr_items;
+    };
 };
 
 #define TCACHE_MIN_ITEM_SIZE sizeof(struct tcache_hdr)
@@ -35,18 +45,32 @@ struct tcache_percpu {
     unsigned int capacity;
     struct tcache_hdr *loaded;
     struct tcache_hdr *previous;
+    unsigned int prev_rounds;
+
+    /* operations served by the magazines, and those that took the shared pool */
+    unsigned long hits;
+    unsigned long misses;
+    /* the current sizing window */
+    unsigned long win_ops;
+    unsigned long win_misses;
+    __usec win_start;
+    /* the per-CPU area of the kthread that owns the handle */
+    void *owner;
+    struct list_node link;
 };
 
 struct tcache {
     const char *name;
     const struct tcache_ops *ops;
     size_t item_size;
-    atomic_long mags_allocated;
+    atomic_long items_allocated;
     struct list_node link;
 
     unsigned int mag_size;
+    unsigned int max_mag_size;
     spinlock_t lock;
     struct tcache_hdr *shared_mags;
+    struct list_head percpu_list;
     unsigned long data;
 };
 
@@ -71,11 +95,15 @@ static inline void *tcache_alloc(struct tcache_percpu *ltc)
 {
     void *item = (void *)ltc->loaded;
 
-    if (ltc->rounds == 0)
-        return __tcache_alloc(ltc);
+    if (ltc->rounds == 0) {
+        item = __tcache_alloc(ltc);
+    } else {
+        ltc->hits++;
+        ltc->rounds--;
+        ltc->loaded = ltc->loaded->next_item;
+    }
 
-    ltc->rounds--;
-    ltc->loaded = ltc->loaded->next_item;
+    heap_prof_alloc(item, ltc->tc->item_size, ltc->tc->name);
     return item;
 }
 
@@ -88,9 +116,11 @@ static inline void tcache_free(struct tcache_percpu *ltc, void *item)
 {
     struct tcache_hdr *hdr = (struct tcache_hdr *)item;
 
+    heap_prof_free(item);
     if (ltc->rounds >= ltc->capacity)
         return __tcache_free(ltc, item);
 
+    ltc->hits++;
     ltc->rounds++;
     hdr->next_item = ltc->loaded;
     ltc->loaded = hdr;
@@ -100,4 +130,6 @@ extern struct tcache *tcache_create(const char *name, const struct tcache_ops *o
                                     unsigned int mag_size, size_t item_size);
 extern void tcache_init_percpu(struct tcache *tc, struct tcache_percpu *ltc);
 extern void tcache_reclaim(struct tcache *tc);
+extern void tcache_reclaim_all(void);
+extern void tcache_drain_percpu(void);
 extern void tcache_print_usage(void);
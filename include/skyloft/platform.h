@@ -37,6 +37,15 @@ static inline int cpu_numa_node(int cpu_id)
     return numa_node_of_cpu(hw_cpu_id(cpu_id));
 }
 
+/* the number of NUMA nodes up to the highest one with a used CPU */
+static inline int used_numa_nodes(void)
+{
+    int i, nr = 1;
+
+    for (i = 0; i < USED_CPUS; i++) nr = MAX(nr, cpu_numa_node(i) + 1);
+    return MIN(nr, MAX_NUMA);
+}
+
 static inline pid_t _gettid()
 {
     return syscall(SYS_gettid);
@@ -51,7 +60,11 @@ typedef unsigned int mem_key_t;
 
 void touch_mapping(void *base, size_t len, size_t pgsize);
 void *mem_map_anom(void *base, size_t len, size_t pgsize, int node);
+void *mem_map_anom_huge(void *base, size_t len, int node);
 void *mem_map_shm_file(const char *path, void *base, size_t len, size_t pgsize, int node);
+void *mem_map_shm_file_numa(const char *path, void *base, size_t len, size_t pgsize,
+                            int (*page_node)(void *addr), bool populate);
+int mem_populate(void *addr, size_t len);
 void *mem_map_shm(mem_key_t key, void *base, size_t len, size_t pgsize, bool exclusive);
 int mem_unmap_shm(void *base);
 
@@ -85,6 +98,27 @@ int skyloft_park_on_cpu(int cpu);
 int skyloft_wakeup(pid_t target_tid);
 int skyloft_switch_to(pid_t target_tid);
 
+/* FS base, requires FSGSBASE enabled by the kernel */
+static inline uint64_t rdfsbase()
+{
+    uint64_t val;
+    asm volatile("rdfsbase %0" : "=r"(val));
+    return val;
+}
+
+static inline void wrfsbase(uint64_t val)
+{
+    asm volatile("wrfsbase %0" : : "r"(val) : "memory");
+}
+
+/* extended control registers, 0 is XCR0 and 1 is XINUSE */
+static __always_inline uint64_t xgetbv(uint32_t index)
+{
+    uint32_t eax, edx;
+    asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+    return eax | ((uint64_t)edx << 32);
+}
+
 /* User interrupt */
 #ifdef SKYLOFT_UINTR
 
@@ -98,13 +132,6 @@ static __always_inline __attribute__((target("general-regs-only"))) int uintr_in
     return g_uintr_index;
 }
 
-static inline uint64_t rdfsbase()
-{
-    uint64_t val;
-    asm volatile("rdfsbase %0" : "=r"(val));
-    return val;
-}
-
 #define local_irq_disable _clui
 #define local_irq_enable  _stui
 #define local_irq_enabled _testui
@@ -30,11 +30,14 @@ bool softirq_run(int budget);
 
 /* task APIs */
 int task_spawn(int cpu_id, void (*fn)(void *arg), void *arg, int stack_size);
+int task_spawn_many(int cpu_hint, void (*fn)(void *arg), void **args, int n);
 int task_enqueue(int cpu_id, struct task *task);
 void task_yield();
 void task_wakeup(struct task *);
 void task_block(spinlock_t *lock);
 __noreturn void task_exit(void *code);
+int task_join(struct task *task, void **retval);
+int task_detach(struct task *task);
 
 /* assembly helper routines from switch.S */
 extern void __context_switch(uint64_t *prev_stack, uint64_t next_stack, uint8_t *prev_stack_busy);
@@ -44,6 +47,7 @@ extern void __context_switch_to_idle(uint64_t *prev_stack, uint64_t idle_stack);
 extern void __context_switch_from_idle(uint64_t next_stack);
 extern void __context_switch_from_idle_init(uint64_t next_stack);
 extern void __context_switch_to_fn_nosave(void (*fn)(void), uint64_t idle_stack);
+extern void __task_return(void);
 
 struct kthread {
     /* 1st cacheline */
@@ -54,6 +54,25 @@ static inline int __sched_spawn(struct task *task, int cpu)
     return SCHED_OP(sched_spawn)(task, cpu);
 }
 
+/*
+ * Enqueues new tasks in one go and returns how many were enqueued. Policies
+ * that can batch this define SCHED_HAS_SPAWN_MANY, others (the single-queue
+ * ones) get one sched_spawn per task.
+ */
+static inline int __sched_spawn_many(struct task **tasks, int n, int cpu)
+{
+#ifdef SCHED_HAS_SPAWN_MANY
+    return SCHED_OP(sched_spawn_many)(tasks, n, cpu);
+#else
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (SCHED_OP(sched_spawn)(tasks[i], cpu < 0 ? current_cpu_id() : cpu))
+            break;
+    return i;
+#endif
+}
+
 static inline struct task *__sched_pick_next() { return SCHED_OP(sched_pick_next)(); }
 static inline void __sched_block() { SCHED_OP(sched_block)(); }
 static inline void __sched_wakeup(struct task *task) { SCHED_OP(sched_wakeup)(task); }
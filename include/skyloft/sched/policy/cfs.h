@@ -81,6 +81,8 @@ static inline int cfs_sched_init_percpu(void *percpu_data)
 
 struct task *cfs_sched_pick_next();
 int cfs_sched_spawn(struct task *, int);
+#define SCHED_HAS_SPAWN_MANY
+int cfs_sched_spawn_many(struct task **, int, int);
 void cfs_sched_yield();
 void cfs_sched_wakeup(struct task *);
 void cfs_sched_block();
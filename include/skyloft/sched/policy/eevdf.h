@@ -100,6 +100,8 @@ static inline int eevdf_sched_init_percpu(void *percpu_data)
 
 struct task *eevdf_sched_pick_next();
 int eevdf_sched_spawn(struct task *, int);
+#define SCHED_HAS_SPAWN_MANY
+int eevdf_sched_spawn_many(struct task **, int, int);
 void eevdf_sched_yield();
 void eevdf_sched_wakeup(struct task *);
 void eevdf_sched_block();
@@ -61,6 +61,8 @@ static __always_inline __attribute__((target("general-regs-only"))) bool fifo_sc
 
 int fifo_sched_init_percpu(void *percpu_data);
 int fifo_sched_spawn(struct task *task, int cpu);
+#define SCHED_HAS_SPAWN_MANY
+int fifo_sched_spawn_many(struct task **tasks, int n, int cpu);
 void fifo_sched_yield();
 void fifo_sched_wakeup(struct task *task);
 void fifo_sched_balance();
@@ -32,6 +32,8 @@ DECLARE_PERCPU(struct fifo_rq *, rqs);
 struct task *fifo_sched_pick_next();
 int fifo_sched_init_percpu(void *percpu_data);
 int fifo_sched_spawn(struct task *task, int cpu);
+#define SCHED_HAS_SPAWN_MANY
+int fifo_sched_spawn_many(struct task **tasks, int n, int cpu);
 void fifo_sched_yield();
 void fifo_sched_wakeup(struct task *task);
 bool fifo_sched_preempt();
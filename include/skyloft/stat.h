@@ -23,6 +23,19 @@ enum {
     STAT_ALLOC_CYCLES,
     STAT_RX,
     STAT_TX,
+
+    /* sync counters */
+    STAT_MUTEX_CONTENDED,
+    STAT_MUTEX_PARKS,
+    STAT_MUTEX_HANDOFFS,
+
+    /* memory counters */
+    STAT_STACK_HOT,
+    STAT_STACK_COLD,
+    STAT_STACK_NEW,
+    STAT_STACK_RECLAIMS,
+    STAT_REMOTE_ALLOCS,
+    STAT_REMOTE_FREES,
 #ifdef SKYLOFT_UINTR
     STAT_UINTR,
 #ifdef UTIMER
@@ -38,6 +51,9 @@ enum {
 static const char *STAT_STR[] = {
     "local_spawns",   "switch_to",     "tasks_stolen", "idle", "idle_cycles", "softirqs_local",
     "softirq_cycles", "alloc",         "alloc_cycles", "rx",   "tx",
+    "mutex_contended", "mutex_parks", "mutex_handoffs",
+    "stack_hot",      "stack_cold",    "stack_new",    "stack_reclaims",
+    "remote_allocs",  "remote_frees",
 #ifdef SKYLOFT_UINTR
     "uintr",
 #ifdef UTIMER
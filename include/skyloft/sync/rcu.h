@@ -115,3 +115,5 @@ struct rcu_head {
 
 void rcu_free(struct rcu_head *head, rcu_callback_t func);
 void synchronize_rcu(void);
+void synchronize_rcu_expedited(void);
+int rcu_init(void);
@@ -17,6 +17,7 @@
 typedef struct {
     bool held;
     spinlock_t waiter_lock;
+    struct task *owner;
     struct list_head waiters;
 } mutex_t;
 
@@ -29,7 +30,7 @@ void mutex_init(mutex_t *m);
  * mutex_held - is the mutex currently held?
  * @m: the mutex to check
  */
-static inline bool mutex_held(mutex_t *m) { return m->held; }
+static inline bool mutex_held(mutex_t *m) { return ACCESS_ONCE(m->held); }
 
 /**
  * assert_mutex_held - asserts that a mutex is currently held
@@ -51,6 +52,36 @@ void condvar_signal(condvar_t *cv);
 void condvar_broadcast(condvar_t *cv);
 void condvar_init(condvar_t *cv);
 
+/*
+ * Reader-writer mutex support
+ */
+
+struct rwmutex_percpu {
+    int readers;
+} __aligned_cacheline;
+
+typedef struct {
+    spinlock_t waiter_lock;
+    /* new readers must wait */
+    bool write_pending;
+    bool write_held;
+    /* writer waiting for active readers to leave */
+    struct task *drainer;
+    struct list_head read_waiters;
+    struct list_head write_waiters;
+    struct rwmutex_percpu *percpu;
+} rwmutex_t;
+
+struct rwmutex_percpu *rwmutex_alloc_percpu(void);
+void __rwmutex_init(rwmutex_t *m, struct rwmutex_percpu *percpu);
+int rwmutex_init(rwmutex_t *m);
+void rwmutex_destroy(rwmutex_t *m);
+bool rwmutex_try_rdlock(rwmutex_t *m);
+bool rwmutex_try_wrlock(rwmutex_t *m);
+void rwmutex_rdlock(rwmutex_t *m);
+void rwmutex_wrlock(rwmutex_t *m);
+void rwmutex_unlock(rwmutex_t *m);
+
 /*
  * Barrier support
  */
@@ -139,5 +170,22 @@ void waitgroup_init(waitgroup_t *wg);
  */
 static inline void waitgroup_done(waitgroup_t *wg) { waitgroup_add(wg, -1); }
 
-int futex_wait(int *uaddr, int val);
-int futex_wake(int *uaddr, int val);
+/*
+ * Futex support
+ */
+
+int futex_wait_until(int *uaddr, int val, uint64_t deadline_us);
+int futex_wake(int *uaddr, int nr);
+int futex_requeue(int *uaddr, int nr_wake, int *uaddr2, int nr_requeue, const int *cmpval);
+int futex_wake_op(int *uaddr, int nr_wake, int *uaddr2, int nr_wake2, int encoded_op);
+
+/**
+ * futex_wait - waits on a futex word until woken
+ * @uaddr: the futex word
+ * @val: the expected value of the futex word
+ *
+ * Returns 0 if woken, or -EAGAIN if *@uaddr != @val.
+ */
+static inline int futex_wait(int *uaddr, int val) { return futex_wait_until(uaddr, val, 0); }
+
+int sync_init(void);
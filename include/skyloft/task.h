@@ -4,10 +4,13 @@
 
 #pragma once
 
+#include <errno.h>
+
 #include <skyloft/sched.h>
 
 #include <utils/fxsave.h>
 #include <utils/list.h>
+#include <utils/log.h>
 
 enum task_state {
     TASK_IDLE,
@@ -15,6 +18,16 @@ enum task_state {
     TASK_BLOCKED,
 };
 
+enum task_join_state {
+    /* not joinable, or detached */
+    TASK_JOIN_NONE,
+    TASK_JOIN_JOINABLE,
+    /* a joiner is blocked on the task */
+    TASK_JOIN_WAITING,
+    /* exited but not joined yet */
+    TASK_JOIN_EXITED,
+};
+
 /* callee saved regs */
 struct callee_saved {
     uint64_t rbx;
@@ -38,12 +51,25 @@ struct switch_frame {
 struct stack {
     union {
         void *ptr;
+        /* the lowest word, the first one an overflow overwrites */
+        uint64_t canary;
         uint8_t payload[RUNTIME_STACK_SIZE];
     };
 };
 
 BUILD_ASSERT(sizeof(struct stack) == RUNTIME_STACK_SIZE);
 
+#define STACK_CANARY_MAGIC 0x57ac4ca9a2f1e3d5UL
+
+#if RUNTIME_STACK_CANARY
+static __always_inline void stack_canary_init(struct stack *s)
+{
+    s->canary = STACK_CANARY_MAGIC;
+}
+#else
+static __always_inline void stack_canary_init(struct stack *s) {}
+#endif
+
 static inline uint64_t stack_top(struct stack *stack)
 {
     return (uint64_t)stack + RUNTIME_STACK_SIZE;
@@ -55,18 +81,57 @@ struct task {
     /* cache line 0 */
     struct list_node link;
     struct stack *stack;
-    enum task_state state;
+    uint64_t rsp;
     int id, app_id;
+    /* enum task_state */
+    uint8_t state;
     uint8_t stack_busy;
     bool allow_preempt;
     bool skip_free;
     bool init;
-    uint64_t rsp;
-    uint8_t pad0[16];
+    /* currently running on some CPU */
+    bool on_cpu;
+    /* enum task_join_state */
+    uint8_t join_state;
+    /* the task blocked in sl_task_join() on this one */
+    struct task *joiner;
+    /* the return value once exited, or where to put the joined one's while joining */
+    void *join_retval;
     /* cache line 1~2 */
     uint8_t policy_task_data[POLICY_TASK_DATA_SIZE];
+    /* cache line 3 */
+    /* the objects sl_arena_alloc() handed out, released with the task */
+    struct arena *arena;
+#ifdef SKYLOFT_TASK_TLS
+    /* FS base while running, or 0 to run on the TLS of the kthread */
+    uint64_t tls_base;
+    /* the private TLS block, see task_tls_alloc() */
+    void *tls_mem;
+#endif
+#ifdef SKYLOFT_XSAVE
+    /* the XSAVE area (unaligned), allocated with the task */
+    void *xstate_mem;
+    /* the XSAVE area holds the state to restore */
+    bool xstate_saved;
+#endif
 } __aligned_cacheline;
 
+BUILD_ASSERT(offsetof(struct task, policy_task_data) == 64);
+
+/**
+ * task_stack_check - panics if the task has overflowed its stack
+ *
+ * Only checks the canary if RUNTIME_STACK_CANARY is set, otherwise overflows
+ * are caught by the guard pages (if any).
+ */
+static __always_inline void task_stack_check(struct task *t)
+{
+#if RUNTIME_STACK_CANARY
+    if (unlikely(t->stack->canary != STACK_CANARY_MAGIC))
+        panic("stack: overflow in task %p (stack %p)", t, t->stack);
+#endif
+}
+
 #define task_is_idle(t)     ((t)->state == TASK_IDLE)
 #define task_is_runnable(t) ((t)->state == TASK_RUNNABLE)
 #define task_is_blocked(t)  ((t)->state == TASK_BLOCKED)
@@ -74,10 +139,116 @@ struct task {
 
 struct task *task_create(thread_fn_t fn, void *arg);
 struct task *task_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len);
+struct task *task_create_joinable(void *(*fn)(void *), void *arg);
 struct task *task_create_idle();
 void task_free(struct task *task);
+void __task_arena_free(struct task *task);
+
+/* releases the memory the task allocated with sl_arena_alloc() */
+static __always_inline void task_arena_free(struct task *task)
+{
+    if (unlikely(task->arena))
+        __task_arena_free(task);
+}
+
+#ifdef SKYLOFT_TASK_TLS
+int task_tls_init(void);
+int task_tls_init_percpu(void);
+int task_tls_alloc(struct task *task);
+void task_tls_free(struct task *task);
+void __task_tls_switch(uint64_t prev_base, uint64_t next_base);
+uint64_t task_tls_kthread_enter(void);
+void task_tls_kthread_exit(uint64_t base);
+
+/**
+ * task_tls_switch - switches FS from the TLS of @prev to that of @next
+ *
+ * Tasks without a private TLS block share the kthread's, so switching between
+ * them costs a single comparison.
+ */
+static __always_inline void task_tls_switch(struct task *prev, struct task *next)
+{
+    if (unlikely(prev->tls_base != next->tls_base))
+        __task_tls_switch(prev->tls_base, next->tls_base);
+}
+#else
+static inline int task_tls_init(void)
+{
+    return 0;
+}
+static inline int task_tls_init_percpu(void)
+{
+    return 0;
+}
+static inline int task_tls_alloc(struct task *task)
+{
+    return -EOPNOTSUPP;
+}
+static inline void task_tls_free(struct task *task) {}
+static __always_inline void task_tls_switch(struct task *prev, struct task *next) {}
+static __always_inline uint64_t task_tls_kthread_enter(void)
+{
+    return 0;
+}
+static __always_inline void task_tls_kthread_exit(uint64_t base) {}
+#endif
+
+#ifdef SKYLOFT_XSAVE
+extern uint64_t xstate_mask;
+extern bool xstate_has_xinuse;
+
+int xstate_init(void);
+int task_xstate_alloc(struct task *t);
+void __task_xstate_save(struct task *t);
+void __task_xstate_restore(struct task *t);
+void task_xstate_free(struct task *t);
+
+/* some extended state component isn't in its initial configuration */
+static __always_inline bool xstate_in_use(void)
+{
+    return !xstate_has_xinuse || (xgetbv(1) & xstate_mask);
+}
+
+/**
+ * task_xstate_save - saves the extended state of a task being switched out
+ *
+ * Tasks that haven't touched vector registers since they were last switched
+ * in skip the save entirely.
+ */
+static __always_inline void task_xstate_save(struct task *t)
+{
+    t->xstate_saved = xstate_in_use();
+    if (unlikely(t->xstate_saved))
+        __task_xstate_save(t);
+}
+
+/**
+ * task_xstate_restore - restores the extended state of a task being switched in
+ *
+ * A task without saved state gets the initial state if the previous one left
+ * anything behind.
+ */
+static __always_inline void task_xstate_restore(struct task *t)
+{
+    if (unlikely(t->xstate_saved) || xstate_in_use())
+        __task_xstate_restore(t);
+}
+#else
+static inline int xstate_init(void)
+{
+    return 0;
+}
+static inline int task_xstate_alloc(struct task *t)
+{
+    return 0;
+}
+static inline void task_xstate_free(struct task *t) {}
+static __always_inline void task_xstate_save(struct task *t) {}
+static __always_inline void task_xstate_restore(struct task *t) {}
+#endif
 
 int sched_task_init(void *base);
+int task_area_node(size_t off, int nr_nodes);
 int sched_task_init_percpu(void);
 
 #ifdef SCHED_PERCPU
@@ -22,6 +22,7 @@ void tcp_qclose(tcp_queue_t *q);
 struct netaddr tcp_local_addr(tcp_conn_t *c);
 struct netaddr tcp_remote_addr(tcp_conn_t *c);
 ssize_t tcp_read(tcp_conn_t *c, void *buf, size_t len);
+int tcp_read_notify(tcp_conn_t *c, void (*fn)(unsigned long arg), unsigned long arg);
 ssize_t tcp_write(tcp_conn_t *c, const void *buf, size_t len);
 ssize_t tcp_readv(tcp_conn_t *c, const struct iovec *iov, int iovcnt);
 ssize_t tcp_writev(tcp_conn_t *c, const struct iovec *iov, int iovcnt);
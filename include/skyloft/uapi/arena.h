@@ -0,0 +1,32 @@
+/*
+ * arena.h - per-task arenas for request-scoped allocations
+ *
+ * Memory from sl_arena_alloc() belongs to the calling task and is never freed
+ * on its own: all of it is released at once when the task exits (or when a
+ * joinable task is joined), or earlier with sl_arena_reset(). Arenas can only
+ * be used from skyloft tasks.
+ */
+
+#ifndef _SKYLOFT_UAPI_ARENA_H_
+#define _SKYLOFT_UAPI_ARENA_H_
+
+#include <stddef.h>
+
+#include <skyloft/uapi/task.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* returns 16 bytes aligned memory from the current task's arena, NULL above 256 KB */
+void *__api sl_arena_alloc(size_t size);
+/* @align must be a power of two up to 4096 */
+void *__api sl_arena_alloc_aligned(size_t size, size_t align);
+/* releases everything the current task allocated from its arena */
+void __api sl_arena_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
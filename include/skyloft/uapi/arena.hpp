@@ -0,0 +1,49 @@
+/*
+ * arena.hpp - the per-task arena as a std::pmr::memory_resource
+ *
+ * Containers that take a polymorphic allocator can put their nodes in the
+ * arena of the current task and skip freeing them:
+ *
+ *     skyloft::arena_resource arena;
+ *     std::pmr::vector<std::pmr::string> keys(&arena);
+ *
+ * Deallocation does nothing, the memory goes away with the task (see
+ * skyloft/uapi/arena.h). Every arena_resource allocates from the arena of the
+ * task that calls it, so a container must not outlive the task that filled it
+ * or be handed to another task.
+ */
+
+#pragma once
+
+#ifndef __cplusplus
+#error "arena.hpp requires C++17"
+#endif
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+#include <skyloft/uapi/arena.h>
+
+namespace skyloft {
+
+class arena_resource final : public std::pmr::memory_resource {
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        void *p = sl_arena_alloc_aligned(bytes, align);
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    /* all of them allocate from the current task's arena */
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return dynamic_cast<const arena_resource *>(&other) != nullptr;
+    }
+};
+
+} // namespace skyloft
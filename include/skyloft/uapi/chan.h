@@ -0,0 +1,51 @@
+/*
+ * chan.h - bounded channels for skyloft tasks
+ */
+
+#ifndef _SKYLOFT_UAPI_CHAN_H_
+#define _SKYLOFT_UAPI_CHAN_H_
+
+#include <stdbool.h>
+
+#include <skyloft/uapi/task.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sl_chan sl_chan_t;
+
+enum {
+    SL_CHAN_SEND,
+    SL_CHAN_RECV,
+};
+
+/* max number of cases in a single sl_chan_select() */
+#define SL_CHAN_SELECT_MAX 16
+
+struct sl_chan_case {
+    sl_chan_t *chan;
+    int op;
+    /* the item to send, or the item received */
+    void *item;
+    /* false if the channel was closed */
+    bool ok;
+};
+
+sl_chan_t *__api sl_chan_create(int cap);
+void __api sl_chan_destroy(sl_chan_t *c);
+void __api sl_chan_close(sl_chan_t *c);
+
+int __api sl_chan_send(sl_chan_t *c, void *item);
+int __api sl_chan_recv(sl_chan_t *c, void **item);
+int __api sl_chan_try_send(sl_chan_t *c, void *item);
+int __api sl_chan_try_recv(sl_chan_t *c, void **item);
+int __api sl_chan_send_batch(sl_chan_t *c, void **items, int n);
+int __api sl_chan_recv_batch(sl_chan_t *c, void **items, int n);
+int __api sl_chan_select(struct sl_chan_case *cases, int n, bool block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
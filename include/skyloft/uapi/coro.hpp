@@ -0,0 +1,641 @@
+/*
+ * coro.hpp - C++20 coroutines on skyloft kthreads
+ *
+ * A skyloft::task<T> is a stackless coroutine whose frame (usually a few
+ * hundred bytes) comes from smalloc(). Ready coroutines are queued on a per-CPU
+ * executor, an ordinary skyloft task that the scheduling policy runs like any
+ * other. It resumes queued coroutines one after another on its own stack and
+ * blocks on a futex when the queue is empty.
+ *
+ * Awaitables for timers, mutexes, condition variables and socket reads never
+ * block the executor: they arm a callback that puts the coroutine back on the
+ * queue of the executor it was started on.
+ *
+ * Coroutines must be created from skyloft tasks (smalloc() uses per-CPU caches).
+ */
+
+#pragma once
+
+#ifndef __cplusplus
+#error "coro.hpp requires C++20"
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include <sys/types.h>
+
+#include <skyloft/uapi/params.h>
+#include <skyloft/uapi/task.h>
+#include <utils/time.h>
+
+extern "C" {
+void *smalloc(size_t size);
+void sfree(void *item);
+
+struct netaddr;
+struct udp_conn;
+typedef struct udp_conn udp_conn_t;
+struct tcp_conn;
+typedef struct tcp_conn tcp_conn_t;
+
+ssize_t udp_read_from(udp_conn_t *c, void *buf, size_t len, struct netaddr *raddr);
+int udp_read_notify(udp_conn_t *c, void (*fn)(unsigned long arg), unsigned long arg);
+ssize_t tcp_read(tcp_conn_t *c, void *buf, size_t len);
+int tcp_read_notify(tcp_conn_t *c, void (*fn)(unsigned long arg), unsigned long arg);
+}
+
+namespace skyloft {
+
+template <typename T = void> class task;
+
+namespace detail {
+
+/* a suspended coroutine waiting to be resumed */
+struct coro_node {
+    coro_node *next;
+    std::coroutine_handle<> handle;
+    /* the executor that resumes the coroutine */
+    int cpu;
+};
+
+class executor {
+public:
+    static executor &on(int cpu)
+    {
+        static executor executors[USED_CPUS];
+        return executors[cpu];
+    }
+
+    /* spawns the executor task on @cpu on first use, returns 0 or -ENOMEM */
+    int start(int cpu) noexcept
+    {
+        int ret;
+
+        if (started_.load(std::memory_order_acquire) || started_.exchange(true))
+            return 0;
+        ret = sl_task_spawn_oncpu(cpu, run, this, 0);
+        if (ret)
+            started_.store(false, std::memory_order_release);
+        return ret;
+    }
+
+    /* queues @n, safe to call from any CPU and from softirq context */
+    void schedule(coro_node *n) noexcept
+    {
+        coro_node *head = ready_.load(std::memory_order_relaxed);
+
+        do {
+            n->next = head;
+        } while (!ready_.compare_exchange_weak(head, n, std::memory_order_seq_cst,
+                                               std::memory_order_relaxed));
+
+        if (state_.load(std::memory_order_seq_cst) == SLEEPING &&
+            state_.exchange(RUNNING) == SLEEPING)
+            sl_futex(futex_word(), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+
+private:
+    enum { RUNNING, SLEEPING };
+
+    int *futex_word() noexcept { return reinterpret_cast<int *>(&state_); }
+
+    static void run(void *arg)
+    {
+        executor *e = static_cast<executor *>(arg);
+        coro_node *batch, *fifo, *next;
+
+        while (true) {
+            batch = e->ready_.exchange(nullptr, std::memory_order_acquire);
+            if (!batch) {
+                e->state_.store(SLEEPING, std::memory_order_seq_cst);
+                if (!e->ready_.load(std::memory_order_seq_cst))
+                    sl_futex(e->futex_word(), FUTEX_WAIT_PRIVATE, SLEEPING, nullptr, nullptr, 0);
+                e->state_.store(RUNNING, std::memory_order_relaxed);
+                continue;
+            }
+
+            /* the queue is LIFO, resume in the order coroutines became ready */
+            for (fifo = nullptr; batch; batch = next) {
+                next = batch->next;
+                batch->next = fifo;
+                fifo = batch;
+            }
+            for (; fifo; fifo = next) {
+                next = fifo->next;
+                fifo->handle.resume();
+            }
+        }
+    }
+
+    alignas(64) std::atomic<coro_node *> ready_{nullptr};
+    std::atomic<int> state_{RUNNING};
+    std::atomic<bool> started_{false};
+};
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int));
+
+/* puts a coroutine back on its executor, usable as a C callback */
+inline void wake(unsigned long arg)
+{
+    coro_node *n = reinterpret_cast<coro_node *>(arg);
+
+    executor::on(n->cpu).schedule(n);
+}
+
+struct promise_base {
+    coro_node node{};
+    /* the coroutine awaiting this one, if any */
+    std::coroutine_handle<> continuation;
+    /* started by spawn(), frees itself when done */
+    bool detached = false;
+
+    static void *operator new(std::size_t size) noexcept { return smalloc(size); }
+    static void operator delete(void *ptr) noexcept { sfree(ptr); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            promise_base &p = h.promise();
+
+            if (p.continuation)
+                return p.continuation;
+            if (p.detached)
+                h.destroy();
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename P>
+concept skyloft_promise = std::derived_from<P, promise_base>;
+
+template <typename T> struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object() noexcept;
+    static task<T> get_return_object_on_allocation_failure() noexcept { return {}; }
+
+    template <typename U> void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    T result() { return std::move(*value); }
+};
+
+template <> struct promise<void> : promise_base {
+    task<void> get_return_object() noexcept;
+    static task<void> get_return_object_on_allocation_failure() noexcept;
+
+    void return_void() noexcept {}
+    void result() noexcept {}
+};
+
+/* starts the awaited task on the executor of the awaiting one */
+template <typename T> struct task_awaiter {
+    std::coroutine_handle<promise<T>> h;
+
+    bool await_ready() noexcept { return false; }
+
+    template <skyloft_promise P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> caller) noexcept
+    {
+        h.promise().continuation = caller;
+        h.promise().node.cpu = caller.promise().node.cpu;
+        return h;
+    }
+
+    T await_resume() { return h.promise().result(); }
+};
+
+} // namespace detail
+
+/**
+ * task - a lazily started coroutine returning @T
+ *
+ * Runs when awaited (or passed to spawn()/sync_wait()), on the executor of the
+ * awaiting coroutine. An empty task means the frame couldn't be allocated.
+ */
+template <typename T> class [[nodiscard]] task {
+public:
+    using promise_type = detail::promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    task() noexcept = default;
+    explicit task(handle_type h) noexcept : handle_(h) {}
+    task(task &&t) noexcept : handle_(std::exchange(t.handle_, {})) {}
+    task(const task &) = delete;
+
+    task &operator=(task &&t) noexcept
+    {
+        if (this != &t) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = std::exchange(t.handle_, {});
+        }
+        return *this;
+    }
+
+    ~task()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    explicit operator bool() const noexcept { return bool(handle_); }
+
+    handle_type release() noexcept { return std::exchange(handle_, {}); }
+
+    detail::task_awaiter<T> operator co_await() && noexcept { return {handle_}; }
+
+private:
+    handle_type handle_;
+};
+
+namespace detail {
+
+template <typename T> inline task<T> promise<T>::get_return_object() noexcept
+{
+    auto h = std::coroutine_handle<promise<T>>::from_promise(*this);
+    node.handle = h;
+    return task<T>{h};
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+    auto h = std::coroutine_handle<promise<void>>::from_promise(*this);
+    node.handle = h;
+    return task<void>{h};
+}
+
+inline task<void> promise<void>::get_return_object_on_allocation_failure() noexcept { return {}; }
+
+/* base of the awaitables that queue coroutines themselves */
+struct waiter {
+    waiter *next;
+    coro_node *node;
+};
+
+} // namespace detail
+
+/**
+ * spawn - starts a coroutine without waiting for it
+ * @t: the coroutine, destroyed when it finishes
+ * @cpu: the CPU whose executor runs it
+ *
+ * Returns 0 if successful, or -ENOMEM.
+ */
+inline int spawn(task<void> &&t, int cpu = sl_current_cpu_id())
+{
+    detail::executor &e = detail::executor::on(cpu);
+    task<void>::handle_type h;
+
+    if (!t || e.start(cpu))
+        return -ENOMEM;
+
+    h = t.release();
+    h.promise().detached = true;
+    h.promise().node.cpu = cpu;
+    e.schedule(&h.promise().node);
+    return 0;
+}
+
+namespace detail {
+
+/*
+ * done goes 0 -> SYNC_DONE -> SYNC_WOKEN. The waiter returns, destroying the
+ * state, only once the coroutine is past its FUTEX_WAKE on it.
+ */
+enum { SYNC_DONE = 1, SYNC_WOKEN = 2 };
+
+template <typename T> struct sync_state {
+    std::optional<T> value;
+    int done = 0;
+};
+
+template <> struct sync_state<void> {
+    int done = 0;
+};
+
+template <typename T> task<void> sync_wait_coro(task<T> &t, sync_state<T> &s)
+{
+    if constexpr (std::is_void_v<T>)
+        co_await std::move(t);
+    else
+        s.value.emplace(co_await std::move(t));
+
+    __atomic_store_n(&s.done, SYNC_DONE, __ATOMIC_RELEASE);
+    sl_futex(&s.done, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    /* the last access to s */
+    __atomic_store_n(&s.done, SYNC_WOKEN, __ATOMIC_RELEASE);
+}
+
+} // namespace detail
+
+/**
+ * sync_wait - runs a coroutine and blocks the calling task until it finishes
+ * @t: the coroutine, must not be empty
+ *
+ * Must be called from a regular task, never from a coroutine.
+ */
+template <typename T> T sync_wait(task<T> t)
+{
+    detail::sync_state<T> s;
+    int done;
+
+    while (spawn(detail::sync_wait_coro(t, s))) sl_task_yield();
+    while ((done = __atomic_load_n(&s.done, __ATOMIC_ACQUIRE)) != detail::SYNC_WOKEN) {
+        if (!done)
+            sl_futex(&s.done, FUTEX_WAIT_PRIVATE, 0, nullptr, nullptr, 0);
+        else
+            sl_task_yield();
+    }
+
+    if constexpr (!std::is_void_v<T>)
+        return std::move(*s.value);
+}
+
+/* requeues the coroutine at the tail of its executor */
+struct yield {
+    bool await_ready() noexcept { return false; }
+
+    template <detail::skyloft_promise P> void await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        detail::executor::on(h.promise().node.cpu).schedule(&h.promise().node);
+    }
+
+    void await_resume() noexcept {}
+};
+
+class sleep_until {
+public:
+    explicit sleep_until(uint64_t deadline_us) noexcept : deadline_us_(deadline_us) {}
+
+    bool await_ready() noexcept { return ::now_us() >= deadline_us_; }
+
+    template <detail::skyloft_promise P> void await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        sl_timer_start(&timer_, detail::wake, reinterpret_cast<unsigned long>(&h.promise().node),
+                       deadline_us_);
+    }
+
+    void await_resume() noexcept {}
+
+private:
+    uint64_t deadline_us_;
+    struct sl_timer timer_;
+};
+
+/* the awaitable form of timer_sleep() */
+inline sleep_until sleep_for(uint64_t duration_us) noexcept
+{
+    return sleep_until(::now_us() + duration_us);
+}
+
+/**
+ * mutex - a coroutine mutex
+ *
+ * The lock state and the waiter stack share one word, so lock() and unlock()
+ * are a single CAS without contention. unlock() hands the lock directly to the
+ * oldest waiter and queues it on its executor.
+ */
+class mutex {
+public:
+    class lock_awaiter : public detail::waiter {
+    public:
+        explicit lock_awaiter(mutex &m) noexcept : m_(m) {}
+
+        bool await_ready() noexcept { return m_.try_lock(); }
+
+        template <detail::skyloft_promise P> bool await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            uintptr_t old = m_.state_.load(std::memory_order_acquire);
+
+            node = &h.promise().node;
+            while (true) {
+                if (old == UNLOCKED) {
+                    if (m_.state_.compare_exchange_weak(old, LOCKED, std::memory_order_acquire,
+                                                        std::memory_order_acquire))
+                        return false;
+                    continue;
+                }
+                next = reinterpret_cast<detail::waiter *>(old);
+                if (m_.state_.compare_exchange_weak(old, reinterpret_cast<uintptr_t>(
+                                                             static_cast<detail::waiter *>(this)),
+                                                    std::memory_order_release,
+                                                    std::memory_order_acquire))
+                    return true;
+            }
+        }
+
+        void await_resume() noexcept {}
+
+    private:
+        friend class mutex;
+        mutex &m_;
+    };
+
+    mutex() noexcept = default;
+    mutex(const mutex &) = delete;
+
+    bool try_lock() noexcept
+    {
+        uintptr_t old = UNLOCKED;
+
+        return state_.compare_exchange_strong(old, LOCKED, std::memory_order_acquire,
+                                              std::memory_order_relaxed);
+    }
+
+    /* co_await m.lock() */
+    lock_awaiter lock() noexcept { return lock_awaiter(*this); }
+
+    void unlock() noexcept
+    {
+        detail::waiter *w = head_, *stack, *next;
+        uintptr_t old;
+
+        if (!w) {
+            old = LOCKED;
+            if (state_.compare_exchange_strong(old, UNLOCKED, std::memory_order_release,
+                                               std::memory_order_relaxed))
+                return;
+
+            /* take the waiter stack, the oldest waiter is at the bottom */
+            old = state_.exchange(LOCKED, std::memory_order_acquire);
+            for (stack = reinterpret_cast<detail::waiter *>(old); stack; stack = next) {
+                next = stack->next;
+                stack->next = head_;
+                if (!head_)
+                    tail_ = stack;
+                head_ = stack;
+            }
+            w = head_;
+        }
+
+        head_ = w->next;
+        detail::wake(reinterpret_cast<unsigned long>(w->node));
+    }
+
+private:
+    friend class condvar;
+
+    /* the state is UNLOCKED, LOCKED, or the top of the waiter stack (locked) */
+    static constexpr uintptr_t LOCKED = 0;
+    static constexpr uintptr_t UNLOCKED = 1;
+
+    /* queues @w to get the lock next, the caller must hold the lock */
+    void requeue(detail::waiter *w) noexcept
+    {
+        w->next = nullptr;
+        if (head_)
+            tail_->next = w;
+        else
+            head_ = w;
+        tail_ = w;
+    }
+
+    std::atomic<uintptr_t> state_{UNLOCKED};
+    /* waiters owned by the lock holder, oldest first */
+    detail::waiter *head_ = nullptr, *tail_ = nullptr;
+};
+
+/**
+ * condvar - a condition variable for skyloft::mutex
+ *
+ * wait() and the notify functions must be called with the mutex held. A
+ * notified coroutine is moved onto the mutex, so it resumes holding the lock
+ * without waking up only to block again.
+ */
+class condvar {
+public:
+    class wait_awaiter : public detail::waiter {
+    public:
+        wait_awaiter(condvar &cv, mutex &m) noexcept : cv_(cv), m_(m) {}
+
+        bool await_ready() noexcept { return false; }
+
+        template <detail::skyloft_promise P> void await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            node = &h.promise().node;
+            next = nullptr;
+            if (cv_.head_)
+                cv_.tail_->next = this;
+            else
+                cv_.head_ = this;
+            cv_.tail_ = this;
+            m_.unlock();
+        }
+
+        void await_resume() noexcept {}
+
+    private:
+        friend class condvar;
+        condvar &cv_;
+        mutex &m_;
+    };
+
+    condvar() noexcept = default;
+    condvar(const condvar &) = delete;
+
+    /* co_await cv.wait(m) */
+    wait_awaiter wait(mutex &m) noexcept { return wait_awaiter(*this, m); }
+
+    void notify_one() noexcept
+    {
+        wait_awaiter *w = static_cast<wait_awaiter *>(head_);
+
+        if (w) {
+            head_ = w->next;
+            w->m_.requeue(w);
+        }
+    }
+
+    void notify_all() noexcept
+    {
+        while (head_) notify_one();
+    }
+
+private:
+    detail::waiter *head_ = nullptr, *tail_ = nullptr;
+};
+
+namespace detail {
+
+template <typename Conn> class read_awaiter {
+public:
+    read_awaiter(Conn *c, void *buf, size_t len, struct netaddr *raddr) noexcept
+        : c_(c), buf_(buf), len_(len), raddr_(raddr)
+    {
+    }
+
+    bool await_ready() noexcept { return false; }
+
+    template <skyloft_promise P> bool await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        unsigned long arg = reinterpret_cast<unsigned long>(&h.promise().node);
+
+        if constexpr (std::is_same_v<Conn, udp_conn_t>)
+            ret_ = udp_read_notify(c_, wake, arg);
+        else
+            ret_ = tcp_read_notify(c_, wake, arg);
+        return ret_ == 0;
+    }
+
+    ssize_t await_resume() noexcept
+    {
+        /* another coroutine is waiting already, reading could block the executor */
+        if (ret_ == -EBUSY)
+            return ret_;
+        if constexpr (std::is_same_v<Conn, udp_conn_t>)
+            return udp_read_from(c_, buf_, len_, raddr_);
+        else
+            return tcp_read(c_, buf_, len_);
+    }
+
+private:
+    Conn *c_;
+    void *buf_;
+    size_t len_;
+    struct netaddr *raddr_;
+    int ret_ = 0;
+};
+
+} // namespace detail
+
+/*
+ * Awaitable socket reads, with the same return values as udp_read_from() and
+ * tcp_read(), or -EBUSY if another coroutine is reading the same socket.
+ */
+
+inline detail::read_awaiter<udp_conn_t> read(udp_conn_t *c, void *buf, size_t len) noexcept
+{
+    return {c, buf, len, nullptr};
+}
+
+inline detail::read_awaiter<udp_conn_t> read_from(udp_conn_t *c, void *buf, size_t len,
+                                                  struct netaddr *raddr) noexcept
+{
+    return {c, buf, len, raddr};
+}
+
+inline detail::read_awaiter<tcp_conn_t> read(tcp_conn_t *c, void *buf, size_t len) noexcept
+{
+    return {c, buf, len, nullptr};
+}
+
+} // namespace skyloft
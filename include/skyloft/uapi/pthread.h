@@ -34,6 +34,15 @@ int sl_pthread_cond_broadcast(pthread_cond_t *cond);
 int sl_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 int sl_pthread_cond_destroy(pthread_cond_t *cond);
 
+int sl_pthread_rwlock_init(pthread_rwlock_t *__restrict rwlock,
+                           const pthread_rwlockattr_t *__restrict attr);
+int sl_pthread_rwlock_rdlock(pthread_rwlock_t *rwlock);
+int sl_pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock);
+int sl_pthread_rwlock_wrlock(pthread_rwlock_t *rwlock);
+int sl_pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock);
+int sl_pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
+int sl_pthread_rwlock_destroy(pthread_rwlock_t *rwlock);
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,7 +14,9 @@ extern "C" {
 #define __api
 
 typedef void (*thread_fn_t)(void *arg);
+typedef void (*range_fn_t)(long begin, long end, void *arg);
 typedef int (*initializer_fn_t)(void);
+typedef struct task *sl_task_t;
 
 static inline int __api sl_current_app_id()
 {
@@ -32,7 +34,14 @@ int __api sl_current_task_id();
 
 int __api sl_task_spawn(thread_fn_t fn, void *arg, int stack_size);
 int __api sl_task_spawn_oncpu(int cpu_id, thread_fn_t fn, void *arg, int stack_size);
+int __api sl_task_spawn_joinable(sl_task_t *task, void *(*fn)(void *), void *arg, int stack_size);
+int __api sl_task_spawn_tls(thread_fn_t fn, void *arg, int stack_size);
+int __api sl_task_spawn_many(thread_fn_t fn, void **args, int n, int cpu_hint);
+int __api sl_task_join(sl_task_t task, void **retval);
+int __api sl_task_detach(sl_task_t task);
 void __api sl_task_yield();
+int __api sl_parallel_for(long begin, long end, long grain, range_fn_t fn, void *arg);
+int __api sl_spawn_join(thread_fn_t fn, void **args, int n);
 void __attribute__((noreturn)) __api sl_task_exit(int code);
 
 const char *__api sl_sched_policy_name();
@@ -45,19 +54,38 @@ int __api sl_libos_start(thread_fn_t app_main, void *arg);
 int __api sl_libos_start_daemon();
 
 void __api sl_dump_tasks();
+/* returns idle allocator memory to the kernel */
+void __api sl_mem_reclaim(void);
 
 void __api sl_sleep(int secs);
 void __api sl_usleep(int usecs);
 
-#define FUTEX_WAIT 0
-#define FUTEX_WAKE 1
+/* opaque storage for a timer, see sl_timer_start() */
+struct sl_timer {
+    unsigned long opaque[4];
+};
+
+typedef void (*sl_timer_fn_t)(unsigned long arg);
+
+void __api sl_timer_start(struct sl_timer *t, sl_timer_fn_t fn, unsigned long arg,
+                          unsigned long deadline_us);
+bool __api sl_timer_cancel(struct sl_timer *t);
+
+#define FUTEX_WAIT        0
+#define FUTEX_WAKE        1
+#define FUTEX_REQUEUE     3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_WAKE_OP     5
 
 #define FUTEX_PRIVATE_FLAG   128
 #define FUTEX_CLOCK_REALTIME 256
 #define FUTEX_CMD_MASK       ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
-#define FUTEX_WAIT_PRIVATE (FUTEX_WAIT | FUTEX_PRIVATE_FLAG)
-#define FUTEX_WAKE_PRIVATE (FUTEX_WAKE | FUTEX_PRIVATE_FLAG)
+#define FUTEX_WAIT_PRIVATE        (FUTEX_WAIT | FUTEX_PRIVATE_FLAG)
+#define FUTEX_WAKE_PRIVATE        (FUTEX_WAKE | FUTEX_PRIVATE_FLAG)
+#define FUTEX_REQUEUE_PRIVATE     (FUTEX_REQUEUE | FUTEX_PRIVATE_FLAG)
+#define FUTEX_CMP_REQUEUE_PRIVATE (FUTEX_CMP_REQUEUE | FUTEX_PRIVATE_FLAG)
+#define FUTEX_WAKE_OP_PRIVATE     (FUTEX_WAKE_OP | FUTEX_PRIVATE_FLAG)
 
 struct timespec;
 
@@ -28,6 +28,7 @@ ssize_t udp_read_from(udp_conn_t *c, void *buf, size_t len, struct netaddr *radd
 ssize_t udp_write_to(udp_conn_t *c, const void *buf, size_t len, const struct netaddr *raddr);
 ssize_t udp_read(udp_conn_t *c, void *buf, size_t len);
 ssize_t udp_write(udp_conn_t *c, const void *buf, size_t len);
+int udp_read_notify(udp_conn_t *c, void (*fn)(unsigned long arg), unsigned long arg);
 void udp_shutdown(udp_conn_t *c);
 void udp_close(udp_conn_t *c);
 
@@ -93,7 +93,7 @@ int iothread_init(void)
 
     /* map communication shared memory for command queues and egress packets */
     len = cal_chan_size(proc->nr_ks);
-    base = mem_map_anom(NULL, len, PGSIZE_2MB, 0);
+    base = mem_map_anom_huge(NULL, len, 0);
     if (base == MAP_FAILED) {
         log_err("ioqueues: mem_map_shm() failed");
         return -1;
@@ -37,6 +37,7 @@ struct proc *proc;
 static thread_fn_t saved_app_main;
 static void *saved_app_arg;
 static atomic_int all_init_done;
+static __usec start_time_us;
 
 static initializer_fn_t global_init_hook;
 static initializer_fn_t percpu_init_hook;
@@ -51,10 +52,15 @@ static const struct init_entry init_handlers[] = {
     INITIALIZER(page, init),
     INITIALIZER(slab, init),
     INITIALIZER(smalloc, init),
+#ifdef SKYLOFT_HEAP_PROFILE
+    INITIALIZER(heapprof, init),
+#endif
 
     /* scheduler */
     INITIALIZER(sched, init),
     INITIALIZER(proc, init),
+    INITIALIZER(sync, init),
+    INITIALIZER(rcu, init),
 #ifdef SKYLOFT_DPDK
     INITIALIZER(iothread, init),
 #endif
@@ -75,6 +81,13 @@ static const struct init_entry late_init_handlers_percpu[] = {
     /* platform */
     INITIALIZER(cpubind, init_percpu),
     INITIALIZER(platform, init_percpu),
+
+    /* memory management */
+    INITIALIZER(stack, init_late_percpu),
+    INITIALIZER(reclaim, init_late_percpu),
+#ifdef SKYLOFT_HEAP_PROFILE
+    INITIALIZER(heapprof, init_late_percpu),
+#endif
 };
 
 int global_init()
@@ -209,6 +222,9 @@ static __noreturn void *percpu_entry(void *arg)
     while (atomic_load(&all_init_done) < USED_CPUS);
 #endif
 
+    if (!cpu_id)
+        log_info("libos: initialized in %lu us", now_us() - start_time_us);
+
 #ifdef UTIMER
     if (cpu_id == UTIMER_CPU)
         utimer_main();
@@ -247,6 +263,7 @@ int __api sl_libos_start(thread_fn_t entry, void *arg)
     int ret = 0;
     long int i;
 
+    start_time_us = now_us();
     saved_app_main = entry;
     saved_app_arg = arg;
 
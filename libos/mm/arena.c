@@ -0,0 +1,193 @@
+/*
+ * arena.c - per-task bump allocation released when the task exits
+ *
+ * Request handlers allocate many small objects and free them all once the
+ * request is done. sl_arena_alloc() hands them out of the current task's
+ * arena by bumping a pointer through chunks of page memory, and frees nothing
+ * until the task exits (or calls sl_arena_reset()), when all of its chunks go
+ * back at once.
+ *
+ * The first chunks are 4KB pages from the per-CPU page cache, so a short
+ * request takes one or two cached pages. Tasks that keep allocating move on to
+ * 2MB pages. Objects larger than ARENA_LARGE_SIZE get their own smalloc() item,
+ * linked into the arena so they are freed with it.
+ */
+
+#include <skyloft/mm/page.h>
+#include <skyloft/mm/smalloc.h>
+#include <skyloft/sched.h>
+#include <skyloft/task.h>
+#include <skyloft/uapi/arena.h>
+
+#include <utils/assert.h>
+#include <utils/defs.h>
+
+/* the number of 4KB chunks before moving on to 2MB chunks */
+#define ARENA_NR_SMALL_CHUNKS 16
+/* larger objects are allocated with smalloc(), up to SMALLOC_MAX_SIZE */
+#define ARENA_LARGE_SIZE (PGSIZE_4KB / 4)
+/* the alignment of sl_arena_alloc() */
+#define ARENA_ALIGN 16
+
+/* at the start of each chunk */
+struct arena_chunk {
+    struct arena_chunk *next;
+};
+
+/* in front of each large object, keeps it 16 bytes aligned */
+struct arena_large {
+    struct arena_large *next;
+    unsigned long pad;
+};
+
+/* lives in the first chunk */
+struct arena {
+    char *pos, *end;
+    struct arena_chunk *chunks;
+    struct arena_large *large;
+    unsigned int nr_chunks;
+};
+
+static struct arena_chunk *arena_chunk_alloc(size_t size)
+{
+    struct arena_chunk *chunk;
+
+    /* 4KB pages come from the per-CPU cache */
+    preempt_disable();
+    chunk = page_alloc_addr(size);
+    preempt_enable();
+    return chunk;
+}
+
+static void arena_chunk_free(struct arena_chunk *chunk)
+{
+    preempt_disable();
+    page_put_addr(chunk);
+    preempt_enable();
+}
+
+static struct arena *arena_create(struct task *t)
+{
+    struct arena_chunk *chunk = arena_chunk_alloc(PGSIZE_4KB);
+    struct arena *a;
+
+    if (unlikely(!chunk))
+        return NULL;
+
+    chunk->next = NULL;
+    a = (struct arena *)(chunk + 1);
+    a->pos = (char *)(a + 1);
+    a->end = (char *)chunk + PGSIZE_4KB;
+    a->chunks = chunk;
+    a->large = NULL;
+    a->nr_chunks = 1;
+    t->arena = a;
+    return a;
+}
+
+static void *arena_alloc_large(struct arena *a, size_t size, size_t align)
+{
+    struct arena_large *large;
+    size_t len;
+
+    align = MAX(align, (size_t)ARENA_ALIGN);
+    if (unlikely(__builtin_add_overflow(size, align, &len) || len > SMALLOC_MAX_SIZE))
+        return NULL;
+
+    large = smalloc(len);
+    if (unlikely(!large))
+        return NULL;
+    large->next = a->large;
+    a->large = large;
+    return (void *)align_up((uintptr_t)(large + 1), align);
+}
+
+/* starts a new chunk and allocates from it */
+static void *arena_alloc_slow(struct arena *a, size_t size, size_t align)
+{
+    struct arena_chunk *chunk;
+    size_t chunk_size;
+    char *p;
+
+    if (size > ARENA_LARGE_SIZE || size + align > ARENA_LARGE_SIZE)
+        return arena_alloc_large(a, size, align);
+
+    chunk_size = a->nr_chunks < ARENA_NR_SMALL_CHUNKS ? PGSIZE_4KB : PGSIZE_2MB;
+    chunk = arena_chunk_alloc(chunk_size);
+    if (unlikely(!chunk))
+        return NULL;
+
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    a->nr_chunks++;
+    a->end = (char *)chunk + chunk_size;
+
+    p = (char *)align_up((uintptr_t)(chunk + 1), align);
+    a->pos = p + size;
+    return p;
+}
+
+/**
+ * task_arena_alloc - allocates memory from the arena of a task
+ * @t: the task
+ * @size: the size of the object
+ * @align: the alignment of the object, a power of two
+ *
+ * Returns the object, or NULL if out of memory.
+ */
+static __always_inline void *task_arena_alloc(struct task *t, size_t size, size_t align)
+{
+    struct arena *a = t->arena;
+    char *p;
+
+    assert(is_power_of_two(align));
+
+    if (unlikely(!a)) {
+        a = arena_create(t);
+        if (unlikely(!a))
+            return NULL;
+    }
+
+    p = (char *)align_up((uintptr_t)a->pos, align);
+    if (likely(size <= ARENA_LARGE_SIZE && p <= a->end && size <= (size_t)(a->end - p))) {
+        a->pos = p + size;
+        return p;
+    }
+    return arena_alloc_slow(a, size, align);
+}
+
+void __task_arena_free(struct task *t)
+{
+    struct arena *a = t->arena;
+    struct arena_chunk *chunk, *next_chunk;
+    struct arena_large *large, *next_large;
+
+    for (large = a->large; large; large = next_large) {
+        next_large = large->next;
+        sfree(large);
+    }
+
+    /* the arena itself is in the last chunk */
+    t->arena = NULL;
+    for (chunk = a->chunks; chunk; chunk = next_chunk) {
+        next_chunk = chunk->next;
+        arena_chunk_free(chunk);
+    }
+}
+
+void *__api sl_arena_alloc(size_t size)
+{
+    return task_arena_alloc(task_self(), size, ARENA_ALIGN);
+}
+
+void *__api sl_arena_alloc_aligned(size_t size, size_t align)
+{
+    if (unlikely(!is_power_of_two(align) || align > PGSIZE_4KB))
+        return NULL;
+    return task_arena_alloc(task_self(), size, align);
+}
+
+void __api sl_arena_reset(void)
+{
+    task_arena_free(task_self());
+}
@@ -0,0 +1,553 @@
+/*
+ * heapprof.c - sampling allocation profiler
+ *
+ * Like tcmalloc's heap profiler, an allocation is sampled once every
+ * HEAP_PROFILE_RATE bytes on average. Each kthread counts down a random number
+ * of bytes drawn from an exponential distribution, and the allocation that
+ * takes the count below zero is sampled. The sample stands for all the bytes
+ * allocated since the previous one, which keeps the totals unbiased whatever
+ * the sizes are.
+ *
+ * A sample records the backtrace of the allocation by walking the frame
+ * pointers (HEAP_PROFILE=1 builds with -fno-omit-frame-pointer). Each distinct
+ * backtrace, allocator and size has a bucket with the bytes and objects
+ * allocated since the start (alloc_*) and still live (inuse_*). Sampled
+ * objects stay in a hash table until they are freed, so frees only look up one
+ * bucket of it.
+ *
+ * Sending HEAP_PROFILE_SIGNAL writes the profile in pprof format to
+ * HEAP_PROFILE_PATH, e.g. `pprof -sample_index=alloc_space <binary> <file>`.
+ * Everything the sampling path needs is mapped at init, so it never allocates
+ * from the allocators it profiles.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <skyloft/mm/heapprof.h>
+#include <skyloft/params.h>
+#include <skyloft/sched.h>
+#include <skyloft/sync/sync.h>
+#include <skyloft/sync/timer.h>
+#include <skyloft/task.h>
+
+#include <utils/hash.h>
+#include <utils/log.h>
+#include <utils/spinlock.h>
+#include <utils/time.h>
+
+#ifdef SKYLOFT_HEAP_PROFILE
+
+#define HEAP_PROFILE_SIGNAL SIGUSR2
+#define HEAP_PROFILE_PATH   "/tmp/skyloft.%d.%u.heap.pb"
+
+/* the deepest backtrace recorded */
+#define HEAP_PROF_DEPTH 32
+/* samples beyond these limits are dropped */
+#define HEAP_PROF_MAX_OBJS    (1 << 16)
+#define HEAP_PROF_MAX_BUCKETS (1 << 14)
+#define HEAP_PROF_HASH_SIZE   4096
+/* how often the dumper checks for the signal */
+#define HEAP_PROF_POLL_US (100 * 1000)
+
+/* the totals of an allocation site */
+struct heap_prof_bucket {
+    struct heap_prof_bucket *next_hash;
+    /* the buckets created before this one */
+    struct heap_prof_bucket *next;
+    uint64_t hash;
+    const char *name;
+    size_t size;
+    int depth;
+    void *pcs[HEAP_PROF_DEPTH];
+    unsigned long alloc_objs, alloc_bytes;
+    unsigned long inuse_objs, inuse_bytes;
+};
+
+/* a sampled object that is still live */
+struct heap_prof_obj {
+    struct heap_prof_obj *next;
+    void *item;
+    struct heap_prof_bucket *b;
+    unsigned long objs, bytes;
+};
+
+DEFINE_PERCPU(long, heap_prof_left);
+/* the length of the current sampling interval */
+static DEFINE_PERCPU(long, heap_prof_period);
+static DEFINE_PERCPU(uint64_t, heap_prof_rand);
+struct heap_prof_obj *heap_prof_objs[HEAP_PROF_OBJ_BUCKETS];
+
+static DEFINE_SPINLOCK(heap_prof_lock);
+static struct heap_prof_bucket *bucket_hash[HEAP_PROF_HASH_SIZE];
+static struct heap_prof_bucket *bucket_list;
+static struct heap_prof_bucket *bucket_pool;
+static int nr_buckets;
+static struct heap_prof_obj *free_objs;
+static unsigned long nr_dropped;
+
+static volatile int dump_requests;
+static unsigned int nr_dumps;
+
+/* log2(@x) in 16.16 fixed point, for x > 0 */
+static uint32_t log2_fixed(uint32_t x)
+{
+    int lg = 31 - __builtin_clz(x), i;
+    /* the mantissa in [1, 2) with 31 fractional bits */
+    uint64_t y = ((uint64_t)x << 31) >> lg;
+    uint32_t frac = 0;
+
+    for (i = 15; i >= 0; i--) {
+        y = (y * y) >> 31;
+        if (y >= (2UL << 31)) {
+            y >>= 1;
+            frac |= 1U << i;
+        }
+    }
+    return ((uint32_t)lg << 16) | frac;
+}
+
+/* draws the next sampling interval, exponentially distributed around the rate */
+static long heap_prof_next_period(void)
+{
+    uint64_t *state = &percpu_get(heap_prof_rand), x = *state;
+    uint32_t u;
+
+    if (unlikely(!x))
+        x = now_tsc() | 1;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    /* -ln(u / 2^32) = (32 - log2(u)) * ln(2), with ln(2) = 45426 / 2^16 */
+    u = (uint32_t)(x >> 32) | 1;
+    return (((uint64_t)HEAP_PROFILE_RATE * ((32U << 16) - log2_fixed(u)) * 45426) >> 32) + 1;
+}
+
+/* records the return addresses of the frames on the current task's stack */
+static __always_inline int heap_prof_backtrace(void **pcs)
+{
+    struct task *t = task_self();
+    uintptr_t *fp = __builtin_frame_address(0), *next;
+    uintptr_t lo, hi;
+    int depth = 0;
+
+    if (!t) {
+        pcs[0] = __builtin_return_address(0);
+        return 1;
+    }
+
+    lo = (uintptr_t)t->stack;
+    hi = stack_top(t->stack);
+    while (depth < HEAP_PROF_DEPTH && (uintptr_t)fp >= lo && (uintptr_t)(fp + 2) <= hi) {
+        pcs[depth++] = (void *)fp[1];
+        next = (uintptr_t *)fp[0];
+        if (next <= fp || ((uintptr_t)next & 7))
+            break;
+        fp = next;
+    }
+    return depth;
+}
+
+static uint64_t heap_prof_hash(void **pcs, int depth, const char *name, size_t size)
+{
+    uint64_t h = hash_city_two((uintptr_t)name, size);
+    int i;
+
+    for (i = 0; i < depth; i++) h = hash_city_two(h, (uintptr_t)pcs[i]);
+    return h;
+}
+
+static struct heap_prof_bucket *heap_prof_bucket_get(void **pcs, int depth, const char *name,
+                                                     size_t size)
+{
+    uint64_t hash = heap_prof_hash(pcs, depth, name, size);
+    struct heap_prof_bucket **head = &bucket_hash[hash % HEAP_PROF_HASH_SIZE], *b;
+
+    assert_spin_lock_held(&heap_prof_lock);
+
+    for (b = *head; b; b = b->next_hash)
+        if (b->hash == hash && b->name == name && b->size == size && b->depth == depth &&
+            !memcmp(b->pcs, pcs, depth * sizeof(void *)))
+            return b;
+
+    if (nr_buckets >= HEAP_PROF_MAX_BUCKETS)
+        return NULL;
+    b = &bucket_pool[nr_buckets++];
+    b->hash = hash;
+    b->name = name;
+    b->size = size;
+    b->depth = depth;
+    memcpy(b->pcs, pcs, depth * sizeof(void *));
+    b->next_hash = *head;
+    *head = b;
+    b->next = bucket_list;
+    /* the dumper walks the list without the lock */
+    atomic_store_rel(&bucket_list, b);
+    return b;
+}
+
+/* The sampling slow path, the count of this kthread went below zero. */
+void __heap_prof_sample(void *item, size_t size, const char *name)
+{
+    unsigned long bytes = percpu_get(heap_prof_period) - percpu_get(heap_prof_left);
+    struct heap_prof_bucket *b;
+    struct heap_prof_obj *o;
+    void *pcs[HEAP_PROF_DEPTH];
+    unsigned int idx;
+    int depth;
+
+    percpu_get(heap_prof_period) = percpu_get(heap_prof_left) = heap_prof_next_period();
+    /* not initialized yet */
+    if (unlikely(!bucket_pool))
+        return;
+
+    depth = heap_prof_backtrace(pcs);
+
+    spin_lock_np(&heap_prof_lock);
+    b = heap_prof_bucket_get(pcs, depth, name, size);
+    o = free_objs;
+    if (unlikely(!b || !o)) {
+        nr_dropped++;
+        spin_unlock_np(&heap_prof_lock);
+        return;
+    }
+    free_objs = o->next;
+
+    o->item = item;
+    o->b = b;
+    o->bytes = bytes;
+    o->objs = bytes / size;
+    b->alloc_bytes += o->bytes;
+    b->alloc_objs += o->objs;
+    b->inuse_bytes += o->bytes;
+    b->inuse_objs += o->objs;
+
+    idx = heap_prof_obj_hash(item);
+    o->next = heap_prof_objs[idx];
+    atomic_store_rel(&heap_prof_objs[idx], o);
+    spin_unlock_np(&heap_prof_lock);
+}
+
+/* The free slow path, some sampled object hashes to the same bucket. */
+void __heap_prof_free(void *item)
+{
+    struct heap_prof_obj **pos, *o;
+
+    spin_lock_np(&heap_prof_lock);
+    for (pos = &heap_prof_objs[heap_prof_obj_hash(item)]; (o = *pos); pos = &o->next) {
+        if (o->item != item)
+            continue;
+        *pos = o->next;
+        o->b->inuse_bytes -= o->bytes;
+        o->b->inuse_objs -= o->objs;
+        o->next = free_objs;
+        free_objs = o;
+        break;
+    }
+    spin_unlock_np(&heap_prof_lock);
+}
+
+/*
+ * pprof output, see profile.proto in github.com/google/pprof
+ */
+
+enum {
+    STR_EMPTY,
+    STR_ALLOC_OBJECTS,
+    STR_COUNT,
+    STR_ALLOC_SPACE,
+    STR_BYTES,
+    STR_INUSE_OBJECTS,
+    STR_INUSE_SPACE,
+    STR_ALLOCATOR,
+    NR_FIXED_STRS,
+};
+
+static const char *fixed_strs[NR_FIXED_STRS] = {
+    "", "alloc_objects", "count", "alloc_space", "bytes", "inuse_objects", "inuse_space",
+    "allocator",
+};
+
+#define MAX_NAMES    64
+#define MAX_MAPPINGS 256
+
+struct pprof_writer {
+    FILE *f;
+    int nr_strs;
+    /* the string indices of the allocator names */
+    const char *names[MAX_NAMES];
+    int name_strs[MAX_NAMES];
+    int nr_names;
+    /* executable mappings */
+    uintptr_t map_start[MAX_MAPPINGS], map_end[MAX_MAPPINGS];
+    int nr_maps;
+    uint64_t next_loc;
+};
+
+static uint8_t *pb_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* a varint field */
+static uint8_t *pb_uint(uint8_t *p, int field, uint64_t v)
+{
+    p = pb_varint(p, (uint64_t)field << 3);
+    return pb_varint(p, v);
+}
+
+/* a length-delimited field */
+static uint8_t *pb_bytes(uint8_t *p, int field, const void *data, size_t len)
+{
+    p = pb_varint(p, ((uint64_t)field << 3) | 2);
+    p = pb_varint(p, len);
+    memcpy(p, data, len);
+    return p + len;
+}
+
+/* writes a length-delimited field of the top-level message */
+static void pprof_emit(struct pprof_writer *w, int field, const void *data, size_t len)
+{
+    uint8_t hdr[16], *p = hdr;
+
+    p = pb_varint(p, ((uint64_t)field << 3) | 2);
+    p = pb_varint(p, len);
+    fwrite(hdr, 1, p - hdr, w->f);
+    fwrite(data, 1, len, w->f);
+}
+
+static int pprof_string(struct pprof_writer *w, const char *s)
+{
+    pprof_emit(w, 6, s, strlen(s));
+    return w->nr_strs++;
+}
+
+static int pprof_name(struct pprof_writer *w, const char *name)
+{
+    int i;
+
+    for (i = 0; i < w->nr_names; i++)
+        if (w->names[i] == name)
+            return w->name_strs[i];
+    if (w->nr_names == MAX_NAMES)
+        return STR_EMPTY;
+    w->names[w->nr_names] = name;
+    return w->name_strs[w->nr_names++] = pprof_string(w, name);
+}
+
+static void pprof_value_type(struct pprof_writer *w, int field, int type, int unit)
+{
+    uint8_t buf[16], *p = buf;
+
+    p = pb_uint(p, 1, type);
+    p = pb_uint(p, 2, unit);
+    pprof_emit(w, field, buf, p - buf);
+}
+
+/* writes the executable mappings, so that pprof can symbolize the addresses */
+static void pprof_mappings(struct pprof_writer *w)
+{
+    char line[512], perms[8], path[256];
+    unsigned long start, end, off;
+    uint8_t buf[64], *p;
+    FILE *maps;
+    int n;
+
+    maps = fopen("/proc/self/maps", "r");
+    if (!maps)
+        return;
+
+    while (w->nr_maps < MAX_MAPPINGS && fgets(line, sizeof(line), maps)) {
+        path[0] = '\0';
+        n = sscanf(line, "%lx-%lx %7s %lx %*s %*u %255s", &start, &end, perms, &off, path);
+        if (n < 4 || !strchr(perms, 'x'))
+            continue;
+
+        w->map_start[w->nr_maps] = start;
+        w->map_end[w->nr_maps] = end;
+        p = buf;
+        p = pb_uint(p, 1, ++w->nr_maps);
+        p = pb_uint(p, 2, start);
+        p = pb_uint(p, 3, end);
+        p = pb_uint(p, 4, off);
+        p = pb_uint(p, 5, path[0] ? pprof_string(w, path) : STR_EMPTY);
+        pprof_emit(w, 3, buf, p - buf);
+    }
+    fclose(maps);
+}
+
+static int pprof_mapping_id(struct pprof_writer *w, uintptr_t addr)
+{
+    int i;
+
+    for (i = 0; i < w->nr_maps; i++)
+        if (addr >= w->map_start[i] && addr < w->map_end[i])
+            return i + 1;
+    return 0;
+}
+
+static void pprof_bucket(struct pprof_writer *w, struct heap_prof_bucket *b)
+{
+    uint8_t buf[1024], ids[HEAP_PROF_DEPTH * 10], vals[4 * 10], label[32];
+    uint8_t *p, *id = ids, *val = vals, *l;
+    uintptr_t addr;
+    int i;
+
+    for (i = 0; i < b->depth; i++) {
+        /* point into the call instruction rather than after it */
+        addr = (uintptr_t)b->pcs[i] - 1;
+        p = buf;
+        p = pb_uint(p, 1, ++w->next_loc);
+        p = pb_uint(p, 2, pprof_mapping_id(w, addr));
+        p = pb_uint(p, 3, addr);
+        pprof_emit(w, 4, buf, p - buf);
+        id = pb_varint(id, w->next_loc);
+    }
+
+    val = pb_varint(val, ACCESS_ONCE(b->alloc_objs));
+    val = pb_varint(val, ACCESS_ONCE(b->alloc_bytes));
+    val = pb_varint(val, ACCESS_ONCE(b->inuse_objs));
+    val = pb_varint(val, ACCESS_ONCE(b->inuse_bytes));
+
+    p = buf;
+    p = pb_bytes(p, 1, ids, id - ids);
+    p = pb_bytes(p, 2, vals, val - vals);
+    l = label;
+    l = pb_uint(l, 1, STR_ALLOCATOR);
+    l = pb_uint(l, 2, pprof_name(w, b->name));
+    p = pb_bytes(p, 3, label, l - label);
+    l = label;
+    l = pb_uint(l, 1, STR_BYTES);
+    l = pb_uint(l, 3, b->size);
+    p = pb_bytes(p, 3, label, l - label);
+    pprof_emit(w, 2, buf, p - buf);
+}
+
+/**
+ * heap_prof_dump - writes the profile to a file in pprof format
+ * @path: the file
+ *
+ * Returns 0 if successful, or a negative error code.
+ */
+static int heap_prof_dump(const char *path)
+{
+    static struct pprof_writer w;
+    struct heap_prof_bucket *b;
+    uint8_t buf[16], *p;
+    int i, ret = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.f = fopen(path, "w");
+    if (!w.f)
+        return -errno;
+
+    for (i = 0; i < NR_FIXED_STRS; i++) pprof_string(&w, fixed_strs[i]);
+    pprof_value_type(&w, 1, STR_ALLOC_OBJECTS, STR_COUNT);
+    pprof_value_type(&w, 1, STR_ALLOC_SPACE, STR_BYTES);
+    pprof_value_type(&w, 1, STR_INUSE_OBJECTS, STR_COUNT);
+    pprof_value_type(&w, 1, STR_INUSE_SPACE, STR_BYTES);
+    pprof_mappings(&w);
+
+    for (b = atomic_load_acq(&bucket_list); b; b = b->next) pprof_bucket(&w, b);
+
+    p = buf;
+    p = pb_uint(p, 9, now_ns());
+    fwrite(buf, 1, p - buf, w.f);
+    pprof_value_type(&w, 11, STR_ALLOC_SPACE, STR_BYTES);
+    p = buf;
+    p = pb_uint(p, 12, HEAP_PROFILE_RATE);
+    fwrite(buf, 1, p - buf, w.f);
+
+    if (ferror(w.f))
+        ret = -EIO;
+    if (fclose(w.f) && !ret)
+        ret = -errno;
+    return ret;
+}
+
+static void heap_prof_signal(int sig)
+{
+    dump_requests++;
+}
+
+static void heap_prof_dumper(void *arg)
+{
+    char path[64];
+    int seen = 0, ret;
+
+    while (true) {
+        timer_sleep(HEAP_PROF_POLL_US);
+        if (ACCESS_ONCE(dump_requests) == seen)
+            continue;
+        seen = ACCESS_ONCE(dump_requests);
+
+        snprintf(path, sizeof(path), HEAP_PROFILE_PATH, getpid(), nr_dumps++);
+        ret = heap_prof_dump(path);
+        if (ret)
+            log_err("heapprof: failed to write %s: %d", path, ret);
+        else
+            log_info("heapprof: wrote %s (%d sites, %lu samples dropped)", path, nr_buckets,
+                     nr_dropped);
+    }
+}
+
+/**
+ * heapprof_init - maps the profiler's tables and installs the dump signal
+ *
+ * Returns 0 if successful, or a negative error code.
+ */
+int heapprof_init(void)
+{
+    struct sigaction action = {.sa_handler = heap_prof_signal, .sa_flags = SA_RESTART};
+    struct heap_prof_obj *objs;
+    void *addr;
+    int i;
+
+    addr = mmap(NULL, HEAP_PROF_MAX_OBJS * sizeof(*objs), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return -ENOMEM;
+    objs = addr;
+    for (i = 0; i < HEAP_PROF_MAX_OBJS - 1; i++) objs[i].next = &objs[i + 1];
+    objs[i].next = NULL;
+    free_objs = objs;
+
+    addr = mmap(NULL, HEAP_PROF_MAX_BUCKETS * sizeof(*bucket_pool), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return -ENOMEM;
+
+    sigemptyset(&action.sa_mask);
+    if (sigaction(HEAP_PROFILE_SIGNAL, &action, NULL))
+        return -errno;
+
+    atomic_store_rel(&bucket_pool, addr);
+    log_info("heapprof: sampling every %d KB, kill -USR2 %d to dump", HEAP_PROFILE_RATE / 1024,
+             getpid());
+    return 0;
+}
+
+/**
+ * heapprof_init_late_percpu - starts the task that dumps the profile
+ *
+ * Returns 0 if successful, or a negative error code.
+ */
+int heapprof_init_late_percpu(void)
+{
+    if (current_cpu_id() != 0)
+        return 0;
+    return task_spawn(current_cpu_id(), heap_prof_dumper, NULL, 0);
+}
+
+#endif /* SKYLOFT_HEAP_PROFILE */
@@ -36,7 +36,7 @@ static struct lgpage_node lgpage_nodes[MAX_NUMA];
 /* small page (4KB) definitions */
 extern struct slab smpage_slab; /* defined in mm/slab.c */
 extern struct tcache *smpage_tcache;
-static __thread struct tcache_percpu smpage_pt;
+static DEFINE_PERCPU(struct tcache_percpu, smpage_pt);
 
 #ifdef DEBUG
 
@@ -174,7 +174,7 @@ static struct page *smpage_alloc_on_node(int numa_node)
 
     if (thread_init_done && current_numa_node() == numa_node) {
         /* if on the local node use the fast path */
-        addr = tcache_alloc(&smpage_pt);
+        addr = tcache_alloc(&percpu_get(smpage_pt));
     } else {
         /* otherwise perform a remote slab allocation */
         addr = slab_alloc_on_node(&smpage_slab, numa_node);
@@ -200,7 +200,7 @@ static void smpage_free(struct page *pg)
 
     if (thread_init_done && current_numa_node() == numa_node) {
         /* if on the local node use the fast path */
-        tcache_free(&smpage_pt, addr);
+        tcache_free(&percpu_get(smpage_pt), addr);
     } else {
         /* otherwise perform a remote slab free */
         slab_free(&smpage_slab, addr);
@@ -391,6 +391,6 @@ int page_init(void)
  */
 int page_init_percpu(void)
 {
-    tcache_init_percpu(smpage_tcache, &smpage_pt);
+    tcache_init_percpu(smpage_tcache, &percpu_get(smpage_pt));
     return 0;
 }
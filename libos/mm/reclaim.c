@@ -0,0 +1,140 @@
+/*
+ * reclaim.c - returns idle allocator memory to the kernel
+ *
+ * Memory freed to the libos allocators mostly stays with them: items sit in
+ * per-CPU magazines and in the shared magazine pools, so the slab pages they
+ * belong to never become empty, and freed stacks stay resident. After a spike
+ * the process would keep its peak RSS forever.
+ *
+ * A reclaim first asks every kthread to free the items in its own magazines,
+ * which it does the next time it runs the scheduler idle (the magazines can
+ * only be touched by their kthread). Then it frees the shared magazines, the
+ * current pages of slabs that have no items in use and the resident free
+ * stacks. Slab pages that become empty go back to the page allocator, which
+ * unmaps 2MB pages once they are unused.
+ *
+ * sl_mem_reclaim() reclaims on demand. With MEM_RECLAIM_RSS_MB set, a
+ * background task also reclaims whenever the RSS is above that target.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <skyloft/mm.h>
+#include <skyloft/mm/reclaim.h>
+#include <skyloft/params.h>
+#include <skyloft/percpu.h>
+#include <skyloft/sched.h>
+#include <skyloft/sync/timer.h>
+#include <skyloft/task.h>
+#include <skyloft/uapi/task.h>
+
+#include <utils/log.h>
+
+/* how long kthreads get to drain their magazines before the global pass */
+#define MEM_RECLAIM_DRAIN_US 1000
+
+unsigned int mem_reclaim_gen;
+DEFINE_PERCPU(unsigned int, mem_reclaim_seen);
+
+static int statm_fd = -1;
+
+/* frees the items in this kthread's magazines */
+void __mem_reclaim_percpu(void)
+{
+    percpu_get(mem_reclaim_seen) = ACCESS_ONCE(mem_reclaim_gen);
+    tcache_drain_percpu();
+}
+
+/**
+ * mem_reclaim - returns idle allocator memory to the kernel
+ *
+ * WARNING: Can only be called from thread context.
+ */
+void mem_reclaim(void)
+{
+    int i;
+
+    __atomic_fetch_add(&mem_reclaim_gen, 1, __ATOMIC_RELEASE);
+
+    /* the other kthreads drain their magazines when they go idle */
+    timer_sleep(MEM_RECLAIM_DRAIN_US);
+
+    /*
+     * This one is busy running us, so drain its magazines here. Twice, since
+     * freeing slab pages refills the caches of 4KB pages.
+     */
+    for (i = 0; i < 2; i++) {
+        preempt_disable();
+        __mem_reclaim_percpu();
+        tcache_reclaim_all();
+        slab_reclaim_all();
+        preempt_enable();
+    }
+
+    stack_reclaim_all();
+}
+
+/**
+ * mem_rss - gets the resident set size of this process
+ *
+ * Returns the RSS in bytes, or 0 if it can't be read.
+ */
+static size_t mem_rss(void)
+{
+    char buf[64];
+    unsigned long size, resident;
+    ssize_t len;
+
+    len = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+        return 0;
+    return resident * PGSIZE_4KB;
+}
+
+static void mem_reclaimer(void *arg)
+{
+    size_t rss;
+
+    while (true) {
+        timer_sleep(MEM_RECLAIM_PERIOD_US);
+
+        rss = mem_rss();
+        if (rss <= (size_t)MEM_RECLAIM_RSS_MB << 20)
+            continue;
+
+        mem_reclaim();
+        log_debug("reclaim: RSS %zu MB -> %zu MB", rss >> 20, mem_rss() >> 20);
+    }
+}
+
+/**
+ * reclaim_init_late_percpu - starts the background reclaimer if there is an RSS
+ * target, once scheduling works
+ *
+ * Returns 0 if successful, or a negative error code.
+ */
+int reclaim_init_late_percpu(void)
+{
+    if (!MEM_RECLAIM_RSS_MB || current_cpu_id() != 0)
+        return 0;
+
+    statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (statm_fd < 0) {
+        log_err("reclaim: failed to open /proc/self/statm");
+        return -errno;
+    }
+    return task_spawn(current_cpu_id(), mem_reclaimer, NULL, 0);
+}
+
+void __api sl_mem_reclaim(void)
+{
+    mem_reclaim();
+}
@@ -11,15 +11,23 @@
  * The SLAB allocator is designed for simplicity rather than for multicore
  * scalability. When scalability is required use the thread-local cache on top
  * of the SLAB allocator.
+ *
+ * Frees don't take the page lock. Like the message passing of snmalloc and
+ * mimalloc, freed items are pushed to a lock-free remote-free list of their
+ * node, usually a whole magazine at once, and the next allocation from the
+ * node takes the list: it hands out as many of the items as it needs and
+ * returns the rest to their pages in one batch under the lock.
  */
 
 #include <errno.h>
 #include <string.h>
 
 #include <skyloft/mm.h>
+#include <skyloft/mm/heapprof.h>
 #include <skyloft/mm/page.h>
 #include <skyloft/mm/slab.h>
 #include <skyloft/mm/tcache.h>
+#include <skyloft/sched.h>
 #include <utils/assert.h>
 #include <utils/defs.h>
 
@@ -57,6 +65,7 @@ static void __slab_create_node(struct slab_node *n, int numa_node, size_t size,
 
     n->cur_pg = NULL;
     n->pg_off = 0;
+    n->remote_free = NULL;
     n->nr_pages = 0;
 
     spin_lock_init(&n->page_lock);
@@ -215,9 +224,8 @@ static void slab_item_check(struct slab_node *n, void *item)
     if (unlikely(!thread_init_done))
         return;
 
-    /* NUMA node checks */
-    assert(n->numa_node == current_numa_node());
-    assert(addr_to_numa_node(item) == current_numa_node());
+    /* NUMA node checks, items may be freed from another node */
+    assert(addr_to_numa_node(item) == n->numa_node);
 
     /* page checks */
     assert(is_page_addr(item));
@@ -271,6 +279,7 @@ static struct page *__slab_node_get_page(struct slab_node *n)
             n->pg_off = n->offset;
             pg->item_count = n->nr_elems;
             pg->next = NULL;
+            n->nr_pages++;
         }
     }
 
@@ -291,7 +300,6 @@ static void *__slab_node_alloc(struct slab_node *n)
         /* ran out of memory */
         if (unlikely(!n->cur_pg))
             return NULL;
-        n->nr_pages++;
     }
 
     if (n->cur_pg->next) {
@@ -307,61 +315,129 @@ static void *__slab_node_alloc(struct slab_node *n)
     return (void *)hdr;
 }
 
-/**
- * slab_alloc_on_node - allocates an item from a slab
- * @s: the slab
- * @numa_node: the numa node
- *
- * Returns an item, or NULL if out of memory.
+/*
+ * Returns an item to its page. Pages that become empty are moved to @empty,
+ * to be released once the lock is dropped.
  */
-void *slab_alloc_on_node(struct slab *s, int numa_node)
-{
-    struct slab_node *n = s->nodes[numa_node];
-    void *item;
-
-    spin_lock(&n->page_lock);
-    item = __slab_node_alloc(n);
-    spin_unlock(&n->page_lock);
-
-    slab_alloc_check(n, item);
-
-    return item;
-}
-
-static void slab_node_free(struct slab_node *n, void *item)
+static void __slab_node_free(struct slab_node *n, void *item, struct list_head *empty)
 {
     struct page *pg;
     struct slab_hdr *hdr = (struct slab_hdr *)item;
-    bool free = false;
+
+    assert_spin_lock_held(&n->page_lock);
 
     if (n->flags & SLAB_FLAG_LGPAGE)
         pg = addr_to_lgpage(item);
     else
         pg = addr_to_smpage(item);
 
-    spin_lock(&n->page_lock);
     hdr->next_hdr = pg->next;
     pg->next = hdr;
     pg->item_count++;
 
-    if (pg == n->cur_pg) {
-        spin_unlock(&n->page_lock);
+    if (pg == n->cur_pg)
         return;
-    }
 
     if (pg->item_count == SLAB_PARTIAL_THRESH) {
         list_del(&pg->link);
         list_add(&n->partial_list, &pg->link);
     } else if (pg->item_count == n->nr_elems) {
         list_del(&pg->link);
-        free = true;
+        list_add(empty, &pg->link);
+        n->nr_pages--;
     }
-    spin_unlock(&n->page_lock);
+}
 
-    if (free) {
-        page_put(pg);
-        n->nr_pages--;
+static void slab_node_put_pages(struct list_head *empty)
+{
+    struct page *pg;
+
+    while ((pg = list_pop(empty, struct page, link))) page_put(pg);
+}
+
+/* returns the items other CPUs freed to their pages (lock held) */
+static void __slab_node_drain_remote(struct slab_node *n, struct slab_hdr *hdr,
+                                     struct list_head *empty)
+{
+    struct slab_hdr *next;
+
+    for (; hdr; hdr = next) {
+        next = hdr->next_hdr;
+        __slab_node_free(n, hdr, empty);
+    }
+}
+
+/*
+ * Frees a chain of items without taking the page lock. The items are pushed
+ * to the node's remote-free list in one go and stay there until the next
+ * allocation from the node takes them.
+ */
+static void slab_node_free_remote(struct slab_node *n, struct slab_hdr *first,
+                                  struct slab_hdr *last)
+{
+    struct slab_hdr *head = atomic_load_relax(&n->remote_free);
+
+    do {
+        last->next_hdr = head;
+    } while (!__atomic_compare_exchange_n(&n->remote_free, &head, first, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/* takes all the items on the node's remote-free list */
+static __always_inline struct slab_hdr *slab_node_take_remote(struct slab_node *n)
+{
+    if (!ACCESS_ONCE(n->remote_free))
+        return NULL;
+    return __atomic_exchange_n(&n->remote_free, NULL, __ATOMIC_ACQUIRE);
+}
+
+#ifdef SKYLOFT_HEAP_PROFILE
+/* slabs are also used before the kthreads are set up, and with preemption enabled */
+static __always_inline void slab_prof_alloc(struct slab *s, void *item)
+{
+    if (likely(thread_init_done)) {
+        preempt_disable();
+        heap_prof_alloc(item, s->size, s->name);
+        preempt_enable();
+    }
+}
+#else
+static __always_inline void slab_prof_alloc(struct slab *s, void *item) {}
+#endif
+
+/**
+ * slab_alloc_on_node - allocates an item from a slab
+ * @s: the slab
+ * @numa_node: the numa node
+ *
+ * Returns an item, or NULL if out of memory.
+ */
+void *slab_alloc_on_node(struct slab *s, int numa_node)
+{
+    struct slab_node *n = s->nodes[numa_node];
+    struct slab_hdr *remote = slab_node_take_remote(n);
+    DEFINE_LIST_HEAD(empty);
+    void *item;
+
+    if (remote) {
+        item = remote;
+        remote = remote->next_hdr;
+        if (remote) {
+            spin_lock(&n->page_lock);
+            __slab_node_drain_remote(n, remote, &empty);
+            spin_unlock(&n->page_lock);
+            slab_node_put_pages(&empty);
+        }
+    } else {
+        spin_lock(&n->page_lock);
+        item = __slab_node_alloc(n);
+        spin_unlock(&n->page_lock);
     }
+
+    slab_alloc_check(n, item);
+    slab_prof_alloc(s, item);
+
+    return item;
 }
 
 /**
@@ -373,39 +449,61 @@ void slab_free(struct slab *s, void *item)
 {
     struct slab_node *n = s->nodes[addr_to_numa_node(item)];
     slab_free_check(n, item);
-    slab_node_free(n, item);
+    heap_prof_free(item);
+    slab_node_free_remote(n, item, item);
 }
 
 static int slab_tcache_alloc(struct tcache *tc, int nr, void **items)
 {
     struct slab *s = (struct slab *)tc->data;
     struct slab_node *n = s->nodes[current_numa_node()];
-    int i;
+    struct slab_hdr *remote = slab_node_take_remote(n);
+    DEFINE_LIST_HEAD(empty);
+    int i = 0;
+
+    /* serve the items freed by other CPUs first, their pages aren't touched */
+    for (; i < nr && remote; i++) {
+        items[i] = remote;
+        remote = remote->next_hdr;
+    }
+    if (i == nr && !remote)
+        return 0;
 
     spin_lock(&n->page_lock);
-    for (i = 0; i < nr; i++) {
+    __slab_node_drain_remote(n, remote, &empty);
+    for (; i < nr; i++) {
         items[i] = __slab_node_alloc(n);
-        if (unlikely(!items[i])) {
-            spin_unlock(&n->page_lock);
-            goto fail;
-        }
+        if (unlikely(!items[i]))
+            break;
     }
+    if (unlikely(i < nr))
+        for (i--; i >= 0; i--) __slab_node_free(n, items[i], &empty);
     spin_unlock(&n->page_lock);
 
-    return 0;
-
-fail:
-    for (i--; i >= 0; i--) slab_node_free(n, items[i]);
-    return -ENOMEM;
+    slab_node_put_pages(&empty);
+    return i < 0 ? -ENOMEM : 0;
 }
 
 static void slab_tcache_free(struct tcache *tc, int nr, void **items)
 {
     struct slab *s = (struct slab *)tc->data;
-    struct slab_node *n = s->nodes[current_numa_node()];
-    int i;
+    struct slab_hdr *first[MAX_NUMA] = {}, *last[MAX_NUMA];
+    struct slab_hdr *hdr;
+    int i, node;
 
-    for (i = 0; i < nr; i++) slab_node_free(n, items[i]);
+    /* items freed on another node still go back to the node they came from */
+    for (i = 0; i < nr; i++) {
+        hdr = items[i];
+        node = addr_to_numa_node(hdr);
+        if (!first[node])
+            last[node] = hdr;
+        hdr->next_hdr = first[node];
+        first[node] = hdr;
+    }
+
+    for (node = 0; node < MAX_NUMA; node++)
+        if (first[node])
+            slab_node_free_remote(s->nodes[node], first[node], last[node]);
 }
 
 static const struct tcache_ops slab_tcache_ops = {
@@ -429,13 +527,90 @@ struct tcache *slab_create_tcache(struct slab *s, unsigned int mag_size)
     return tc;
 }
 
+/*
+ * Returns the items on the remote-free list to their pages, then releases the
+ * page the node allocates from if none of its items are in use.
+ */
+static int slab_node_reclaim(struct slab_node *n)
+{
+    struct page *pg;
+    DEFINE_LIST_HEAD(empty);
+
+    spin_lock(&n->page_lock);
+    __slab_node_drain_remote(n, slab_node_take_remote(n), &empty);
+    pg = n->cur_pg;
+    if (pg && pg->item_count == n->nr_elems) {
+        n->cur_pg = NULL;
+        n->nr_pages--;
+    } else {
+        pg = NULL;
+    }
+    spin_unlock(&n->page_lock);
+
+    slab_node_put_pages(&empty);
+    if (!pg)
+        return 0;
+    page_put(pg);
+    return 1;
+}
+
+/**
+ * slab_reclaim - releases the pages of a slab that have no items in use
+ * @s: the slab
+ *
+ * Other pages are released as soon as their last item is freed, so only the
+ * ones the nodes allocate from are left.
+ *
+ * Returns the number of pages released.
+ */
+int slab_reclaim(struct slab *s)
+{
+    int i, nr = 0;
+
+    for (i = 0; i < MAX_NUMA; i++) nr += slab_node_reclaim(s->nodes[i]);
+    return nr;
+}
+
+/**
+ * slab_reclaim_all - releases the pages of all slabs that have no items in use
+ */
+void slab_reclaim_all(void)
+{
+    struct slab *s;
+
+    spin_lock(&slab_lock);
+    list_for_each(&slab_list, s, link) slab_reclaim(s);
+    spin_unlock(&slab_lock);
+}
+
+/* the bytes in items handed out by a node, including those held by tcaches */
+static size_t slab_node_live_bytes(struct slab_node *n)
+{
+    struct page *pg;
+    long nr_free = 0, nr_live;
+
+    spin_lock(&n->page_lock);
+    if (n->cur_pg)
+        nr_free += n->cur_pg->item_count;
+    list_for_each(&n->full_list, pg, link) nr_free += pg->item_count;
+    list_for_each(&n->partial_list, pg, link) nr_free += pg->item_count;
+    nr_live = (long)n->nr_pages * n->nr_elems - nr_free;
+    spin_unlock(&n->page_lock);
+
+    return nr_live * n->size;
+}
+
 /**
  * slab_print_usage - prints the amount of memory used in each slab
+ *
+ * Also prints how much of it is fragmented, i.e. in free items and at the end
+ * of pages. Items cached by a tcache or waiting on a remote-free list count as
+ * used.
  */
 void slab_print_usage(void)
 {
     struct slab *s;
-    size_t total = 0;
+    size_t total = 0, total_live = 0;
     int i;
 
     log_info("slab: usage statistics...");
@@ -443,24 +618,30 @@ void slab_print_usage(void)
     spin_lock(&slab_lock);
     list_for_each(&slab_list, s, link)
     {
-        size_t usage = 0;
+        size_t usage = 0, live = 0;
 
         for (i = 0; i < MAX_NUMA; i++) {
             struct slab_node *n = s->nodes[i];
+            size_t node_live = slab_node_live_bytes(n);
 
+            live += node_live;
             if (n->flags & SLAB_FLAG_LGPAGE) {
                 usage += n->nr_pages * PGSIZE_2MB;
                 total += n->nr_pages * PGSIZE_2MB;
+                total_live += node_live;
             } else {
                 usage += n->nr_pages * PGSIZE_4KB;
             }
         }
 
-        log_info("%8ld KB\t%s", usage / 1024, s->name);
+        if (!usage)
+            continue;
+        log_info("%8ld KB %3ld%% fragmented\t%s", usage / 1024, 100 - live * 100 / usage, s->name);
     }
     spin_unlock(&slab_lock);
 
-    log_info("total: %ld KB", total / 1024);
+    log_info("total: %ld KB, %ld%% fragmented", total / 1024,
+             total ? 100 - total_live * 100 / total : 0);
 }
 
 /**
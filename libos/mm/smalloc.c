@@ -4,21 +4,41 @@
  */
 
 #include <errno.h>
+#include <stdio.h>
 
 #include <skyloft/mm/page.h>
 #include <skyloft/mm/slab.h>
+#include <skyloft/mm/smalloc.h>
 #include <skyloft/mm/tcache.h>
 #include <skyloft/percpu.h>
 
-#define SMALLOC_MAG_SIZE 8
-#define SMALLOC_BITS     15
-#define SMALLOC_MIN_SIZE SLAB_MIN_SIZE
-#define SMALLOC_MAX_SIZE (SMALLOC_MIN_SIZE << (SMALLOC_BITS - 1))
+/*
+ * Size classes are spaced like jemalloc's: 16 B apart up to 64 B, then four
+ * classes per doubling (80, 96, 112, 128, 160, ...), so rounding up wastes at
+ * most 20% of an item instead of 50%.
+ */
+#define SMALLOC_MAG_SIZE       8
+#define SMALLOC_MIN_SIZE       SLAB_MIN_SIZE
+#define SMALLOC_CLASSES_PER_LG 4
+#define SMALLOC_NR_CLASSES     52
+/* sizes up to this are looked up in a table, larger ones are computed */
+#define SMALLOC_LOOKUP_MAX 4096
 BUILD_ASSERT(SMALLOC_MIN_SIZE >= SLAB_MIN_SIZE);
 
-static struct slab smalloc_slabs[SMALLOC_BITS];
-static struct tcache *smalloc_tcaches[SMALLOC_BITS];
-static DEFINE_PERCPU(struct tcache_percpu, smalloc_pts[SMALLOC_BITS]);
+static struct slab smalloc_slabs[SMALLOC_NR_CLASSES];
+static struct tcache *smalloc_tcaches[SMALLOC_NR_CLASSES];
+static DEFINE_PERCPU(struct tcache_percpu, smalloc_pts[SMALLOC_NR_CLASSES]);
+static uint8_t smalloc_lookup[SMALLOC_LOOKUP_MAX / SMALLOC_MIN_SIZE + 1];
+static char slab_names[SMALLOC_NR_CLASSES][24];
+
+/* the class of sizes in (2^lg, 2^(lg+1)], for sizes above 64 B */
+static __always_inline int smalloc_size_to_idx_large(size_t size)
+{
+    size_t x = size - 1;
+    int lg = 63 - __builtin_clzl(x);
+
+    return SMALLOC_CLASSES_PER_LG * (lg - 6) + (int)(x >> (lg - 2));
+}
 
 /**
  * smalloc_size_to_idx - converts a size to a cache index
@@ -26,16 +46,34 @@ static DEFINE_PERCPU(struct tcache_percpu, smalloc_pts[SMALLOC_BITS]);
  *
  * Returns the smalloc cache index.
  */
-static inline int smalloc_size_to_idx(size_t size)
+static __always_inline int smalloc_size_to_idx(size_t size)
+{
+    if (likely(size <= SMALLOC_LOOKUP_MAX))
+        return smalloc_lookup[(size + SMALLOC_MIN_SIZE - 1) / SMALLOC_MIN_SIZE];
+    return smalloc_size_to_idx_large(size);
+}
+
+static size_t smalloc_idx_to_size(int idx)
 {
-    return 64 - __builtin_ctz(SMALLOC_MIN_SIZE) - __builtin_clzl((size - 1) | SMALLOC_MIN_SIZE);
+    int lg = idx / SMALLOC_CLASSES_PER_LG + 5;
+
+    if (idx < SMALLOC_CLASSES_PER_LG)
+        return SMALLOC_MIN_SIZE * (idx + 1);
+    return (1UL << lg) + (idx % SMALLOC_CLASSES_PER_LG + 1) * (1UL << (lg - 2));
 }
 
-static const char *slab_names[SMALLOC_BITS] = {
-    "smalloc (16 B)",  "smalloc (32 B)",  "smalloc (64 B)",  "smalloc (128 B)",  "smalloc (256 B)",
-    "smalloc (512 B)", "smalloc (1 KB)",  "smalloc (2 KB)",  "smalloc (4 KB)",   "smalloc (8 KB)",
-    "smalloc (16 KB)", "smalloc (32 KB)", "smalloc (64 KB)", "smalloc (128 KB)", "smalloc (256 KB)",
-};
+static __always_inline void *smalloc_idx(int idx)
+{
+    struct tcache_percpu *pt;
+    void *item;
+
+    preempt_disable();
+    pt = &percpu_get(smalloc_pts[idx]);
+    item = tcache_alloc(pt);
+    preempt_enable();
+
+    return item;
+}
 
 /**
  * smalloc - allocates memory (non-inlined path)
@@ -45,18 +83,33 @@ static const char *slab_names[SMALLOC_BITS] = {
  */
 void *smalloc(size_t size)
 {
-    struct tcache_percpu *pt;
-    void *item;
-
     if (unlikely(size > SMALLOC_MAX_SIZE))
         return NULL;
 
-    preempt_disable();
-    pt = &percpu_get(smalloc_pts[smalloc_size_to_idx(size)]);
-    item = tcache_alloc(pt);
-    preempt_enable();
+    return smalloc_idx(smalloc_size_to_idx(size));
+}
 
-    return item;
+/**
+ * smalloc_aligned - allocates memory with a given alignment
+ * @size: the size of the item
+ * @align: the alignment, a power of two
+ *
+ * Items sit at multiples of their size from the start of an aligned page, so
+ * the first class large enough whose size is a multiple of @align will do.
+ *
+ * Returns an item or NULL if out of memory or @align is too large.
+ */
+void *smalloc_aligned(size_t size, size_t align)
+{
+    int idx;
+
+    if (unlikely(size > SMALLOC_MAX_SIZE || align > SMALLOC_MAX_SIZE))
+        return NULL;
+
+    for (idx = smalloc_size_to_idx(MAX(size, align)); idx < SMALLOC_NR_CLASSES; idx++)
+        if (smalloc_idx_to_size(idx) % align == 0)
+            return smalloc_idx(idx);
+    return NULL;
 }
 
 /**
@@ -90,6 +143,30 @@ void sfree(void *item)
     preempt_enable();
 }
 
+/**
+ * sfree_nocache - frees memory straight to the slab
+ * @item: the item to free
+ *
+ * For threads that have no per-CPU caches, i.e. that aren't kthreads.
+ */
+void sfree_nocache(void *item)
+{
+    struct slab_node *n = addr_to_page(item)->snode;
+
+    slab_free(&smalloc_slabs[smalloc_size_to_idx(n->size)], item);
+}
+
+/**
+ * smalloc_usable_size - gets the number of bytes usable in an item
+ * @item: the item
+ *
+ * Returns the size of the item's class.
+ */
+size_t smalloc_usable_size(void *item)
+{
+    return addr_to_page(item)->snode->size;
+}
+
 /**
  * smalloc_init - initializes slab malloc
  *
@@ -97,11 +174,24 @@ void sfree(void *item)
  */
 int smalloc_init(void)
 {
+    size_t size;
     int i, ret;
 
-    for (i = 0; i < SMALLOC_BITS; i++) {
-        ret = slab_create(&smalloc_slabs[i], slab_names[i], (SMALLOC_MIN_SIZE << i),
-                          SLAB_FLAG_FALSE_OKAY);
+    BUILD_ASSERT(SMALLOC_NR_CLASSES < UINT8_MAX);
+    BUG_ON(smalloc_idx_to_size(SMALLOC_NR_CLASSES - 1) != SMALLOC_MAX_SIZE);
+
+    for (i = 0; i < (int)ARRAY_SIZE(smalloc_lookup); i++)
+        smalloc_lookup[i] = i * SMALLOC_MIN_SIZE <= 64 ? MAX(i - 1, 0)
+                                                       : smalloc_size_to_idx_large(i * SMALLOC_MIN_SIZE);
+
+    for (i = 0; i < SMALLOC_NR_CLASSES; i++) {
+        size = smalloc_idx_to_size(i);
+        if (size % 1024)
+            snprintf(slab_names[i], sizeof(slab_names[i]), "smalloc (%zu B)", size);
+        else
+            snprintf(slab_names[i], sizeof(slab_names[i]), "smalloc (%zu KB)", size / 1024);
+
+        ret = slab_create(&smalloc_slabs[i], slab_names[i], size, SLAB_FLAG_FALSE_OKAY);
         if (ret)
             return ret;
 
@@ -120,7 +210,7 @@ int smalloc_init_percpu(void)
 {
     int i;
 
-    for (i = 0; i < SMALLOC_BITS; i++)
+    for (i = 0; i < SMALLOC_NR_CLASSES; i++)
         tcache_init_percpu(smalloc_tcaches[i], &percpu_get(smalloc_pts[i]));
 
     return 0;
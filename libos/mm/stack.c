@@ -1,34 +1,75 @@
 /*
  * stack.c - allocates and manages per-thread stacks
+ *
+ * Stacks are anonymous mappings, so only the pages a task touches are
+ * committed. Each one sits right above RUNTIME_STACK_GUARD_PAGES PROT_NONE
+ * pages, so an overflow faults instead of corrupting the next stack, and the
+ * fault is reported on a per-kthread signal stack.
+ *
+ * Only the SCHED_PERCPU policies allocate stacks here. The others (rr, eevdf,
+ * sq and sq_lcbe) keep each stack next to its task in the task array (see
+ * task.c), so their stacks have no guard pages.
+ *
+ * Each NUMA node has its own address range of stacks, preferably backed by its
+ * memory. Freed stacks go back to the pool of their node and stay resident, so
+ * reusing one doesn't fault its pages in again. Only a background task returns
+ * their memory to the kernel, in batches (see stack_pool_reclaim()).
  */
 
 #include <errno.h>
+#include <numaif.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 
 #include <skyloft/mm.h>
 #include <skyloft/percpu.h>
+#include <skyloft/sync/sync.h>
+#include <skyloft/sync/timer.h>
 #include <skyloft/task.h>
 #include <utils/atomic.h>
 #include <utils/log.h>
+#include <utils/time.h>
 
-#define STACK_BASE_ADDR 0x200000000000UL
+#define STACK_GUARD_SIZE (RUNTIME_STACK_GUARD_PAGES * PGSIZE_4KB)
+/* the guard pages followed by the stack */
+#define STACK_SLOT_SIZE     (STACK_GUARD_SIZE + sizeof(struct stack))
+#define STACK_SIGSTACK_SIZE (64 * 1024)
 
 static struct tcache *stack_tcache;
 DEFINE_PERCPU(struct tcache_percpu, stack_percpu);
+/* the next slot to map on each node */
+static atomic_long stack_pos[MAX_NUMA];
 
-static struct stack *stack_create(void *base)
+static struct stack *stack_create(int node)
 {
-    void *stack_addr;
-    struct stack *s;
+    unsigned long mask = 1UL << node;
+    void *base, *slot;
 
-    stack_addr = mmap(base, sizeof(struct stack), PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (stack_addr == MAP_FAILED)
+    /* the address tells the node, so it must be exactly where we asked */
+    base = (void *)atomic_fetch_add(&stack_pos[node], STACK_SLOT_SIZE);
+    if (unlikely((uintptr_t)base + STACK_SLOT_SIZE > STACK_NODE_BASE(node + 1)))
         return NULL;
+    slot = mmap(base, STACK_SLOT_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (slot == MAP_FAILED)
+        return NULL;
+
+    /* pages are faulted in later, possibly by a kthread on another node */
+    if (mbind(slot, STACK_SLOT_SIZE, MPOL_PREFERRED, &mask, MAX_NUMA + 1, 0))
+        log_warn_once("stack: mbind failed %d", errno);
 
-    s = (struct stack *)stack_addr;
+#if RUNTIME_STACK_GUARD_PAGES
+    /* every guarded stack takes two VMAs */
+    if (mprotect(slot, STACK_GUARD_SIZE, PROT_NONE)) {
+        log_err("stack: failed to protect guard pages, is vm.max_map_count too low?");
+        munmap(slot, STACK_SLOT_SIZE);
+        return NULL;
+    }
+#endif
 
-    return s;
+    return (struct stack *)(slot + STACK_GUARD_SIZE);
 }
 
 /* WARNING: the contents of the stack may be lost after reclaiming. */
@@ -39,49 +80,186 @@ static void stack_reclaim(struct stack *s)
     WARN_ON_ONCE(ret);
 }
 
-static DEFINE_SPINLOCK(stack_lock);
-static int free_stack_count;
-static struct stack *free_stacks[MAX_TASKS];
-static atomic_long stack_pos = STACK_BASE_ADDR;
+#define STACK_POOL_SIZE (2 * MAX_TASKS)
+BUILD_ASSERT(is_power_of_two(STACK_POOL_SIZE));
+#define STACK_POOL_MASK (STACK_POOL_SIZE - 1)
 
-static void stack_tcache_free(struct tcache *tc, int nr, void **items)
+/*
+ * Free stacks of a NUMA node. Stacks spilled from the per-CPU caches stay
+ * resident ("hot") and are handed out again newest first. The reclaimer
+ * releases the oldest ones in the background when there are too many or they
+ * have been idle for too long, and keeps them as "cold" stacks.
+ */
+struct stack_pool {
+    spinlock_t lock;
+    /* resident stacks, [head, tail) from the oldest to the newest */
+    unsigned int head, tail;
+    struct {
+        struct stack *s;
+        uint64_t freed_us;
+    } hot[STACK_POOL_SIZE];
+    int nr_cold;
+    struct stack *cold[STACK_POOL_SIZE];
+} __aligned_cacheline;
+
+static struct stack_pool stack_pools[MAX_NUMA];
+static atomic_long stack_nr_reclaimed;
+
+static __always_inline unsigned int stack_pool_nr_hot(struct stack_pool *p)
 {
+    return p->tail - p->head;
+}
+
+static void stack_pool_put(struct stack_pool *p, int nr, void **items)
+{
+    uint64_t now = now_us();
     int i;
 
-    /* try to release the backing memory first */
-    for (i = 0; i < nr; i++) stack_reclaim((struct stack *)items[i]);
+    spin_lock(&p->lock);
+    BUG_ON(stack_pool_nr_hot(p) + nr > STACK_POOL_SIZE);
+    for (i = 0; i < nr; i++) {
+        p->hot[p->tail & STACK_POOL_MASK].s = items[i];
+        p->hot[p->tail & STACK_POOL_MASK].freed_us = now;
+        p->tail++;
+    }
+    spin_unlock(&p->lock);
+}
+
+static void stack_tcache_free(struct tcache *tc, int nr, void **items)
+{
+    int i, j, node;
 
-    /* then make the stacks available for reallocation */
-    spin_lock(&stack_lock);
-    for (i = 0; i < nr; i++) free_stacks[free_stack_count++] = items[i];
-    BUG_ON(free_stack_count >= MAX_TASKS + TCACHE_DEFAULT_MAG_SIZE);
-    spin_unlock(&stack_lock);
+    /* normally all local, see stack_free_remote() */
+    for (i = 0; i < nr; i = j) {
+        node = stack_numa_node(items[i]);
+        for (j = i + 1; j < nr && stack_numa_node(items[j]) == node; j++);
+        stack_pool_put(&stack_pools[node], j - i, items + i);
+    }
 }
 
-static int stack_tcache_alloc(struct tcache *tc, int nr, void **items)
+/**
+ * stack_free_remote - returns a stack of another NUMA node to that node
+ * @s: the stack to free
+ *
+ * Keeps the per-CPU caches node-local, so stack_alloc() never hands out
+ * remote memory from them.
+ */
+void stack_free_remote(struct stack *s)
+{
+    void *item = s;
+
+    ADD_STAT(REMOTE_FREES, 1);
+    stack_pool_put(&stack_pools[stack_numa_node(s)], 1, &item);
+}
+
+static int stack_pool_get(struct stack_pool *p, int nr, void **items)
 {
-    void *base;
     int i = 0;
 
-    spin_lock(&stack_lock);
-    while (free_stack_count && i < nr) {
-        items[i++] = free_stacks[--free_stack_count];
+    if (!ACCESS_ONCE(p->nr_cold) && !stack_pool_nr_hot(p))
+        return 0;
+
+    spin_lock(&p->lock);
+    while (i < nr && stack_pool_nr_hot(p)) items[i++] = p->hot[--p->tail & STACK_POOL_MASK].s;
+    ADD_STAT(STACK_HOT, i);
+    while (i < nr && p->nr_cold) {
+        items[i++] = p->cold[--p->nr_cold];
+        ADD_STAT(STACK_COLD, 1);
     }
-    spin_unlock(&stack_lock);
+    spin_unlock(&p->lock);
+
+    return i;
+}
 
+static int stack_tcache_alloc(struct tcache *tc, int nr, void **items)
+{
+    int node = current_numa_node();
+    int i, n, got;
+
+    /* prefer free stacks of the local node, then new ones on it */
+    i = stack_pool_get(&stack_pools[node], nr, items);
     for (; i < nr; i++) {
-        base = (void *)atomic_fetch_add(&stack_pos, sizeof(struct stack));
-        items[i] = stack_create(base);
+        items[i] = stack_create(node);
         if (unlikely(!items[i]))
-            goto fail;
+            break;
+        ADD_STAT(STACK_NEW, 1);
     }
 
+    /* only use remote memory if the local node is out of it */
+    for (n = 0; n < MAX_NUMA && i < nr; n++) {
+        if (n == node)
+            continue;
+        got = stack_pool_get(&stack_pools[n], nr - i, items + i);
+        ADD_STAT(REMOTE_ALLOCS, got);
+        i += got;
+    }
+
+    if (unlikely(i < nr)) {
+        log_err("stack: failed to allocate stack memory");
+        stack_tcache_free(tc, i, items);
+        return -ENOMEM;
+    }
     return 0;
+}
+
+/*
+ * releases a batch of stacks above the watermark or idle for too long, or all;
+ * runs in task context, so it must not be preempted with the pool locked
+ */
+static int stack_pool_reclaim(struct stack_pool *p, bool all)
+{
+    struct stack *batch[STACK_RECLAIM_BATCH];
+    uint64_t now = now_us();
+    int i, nr = 0;
+
+    spin_lock_np(&p->lock);
+    while (nr < STACK_RECLAIM_BATCH && stack_pool_nr_hot(p) &&
+           (all || stack_pool_nr_hot(p) > STACK_POOL_HIGH_WATERMARK ||
+            now - p->hot[p->head & STACK_POOL_MASK].freed_us > STACK_POOL_IDLE_US))
+        batch[nr++] = p->hot[p->head++ & STACK_POOL_MASK].s;
+    spin_unlock_np(&p->lock);
+
+    if (!nr)
+        return 0;
 
-fail:
-    log_err("stack: failed to allocate stack memory");
-    stack_tcache_free(tc, i, items);
-    return -ENOMEM;
+    /* the stacks are in neither list meanwhile, allocations just skip them */
+    for (i = 0; i < nr; i++) stack_reclaim(batch[i]);
+
+    spin_lock_np(&p->lock);
+    for (i = 0; i < nr; i++) p->cold[p->nr_cold++] = batch[i];
+    spin_unlock_np(&p->lock);
+
+    ADD_STAT(STACK_RECLAIMS, nr);
+    atomic_fetch_add(&stack_nr_reclaimed, nr);
+    return nr;
+}
+
+static void stack_reclaimer(void *arg)
+{
+    int node;
+
+    while (true) {
+        for (node = 0; node < MAX_NUMA; node++)
+            while (stack_pool_reclaim(&stack_pools[node], false) == STACK_RECLAIM_BATCH)
+                task_yield();
+        timer_sleep(STACK_RECLAIM_PERIOD_US);
+    }
+}
+
+/**
+ * stack_reclaim_all - releases the memory of all free stacks
+ *
+ * WARNING: Can only be called from thread context.
+ */
+void stack_reclaim_all(void)
+{
+    int node;
+
+    if (!stack_tcache)
+        return;
+
+    for (node = 0; node < MAX_NUMA; node++)
+        while (stack_pool_reclaim(&stack_pools[node], true) == STACK_RECLAIM_BATCH) task_yield();
 }
 
 static const struct tcache_ops stack_tcache_ops = {
@@ -89,14 +267,87 @@ static const struct tcache_ops stack_tcache_ops = {
     .free = stack_tcache_free,
 };
 
+#if RUNTIME_STACK_GUARD_PAGES
+
+static struct sigaction prev_segv_action;
+
+static bool stack_is_guard(uintptr_t addr)
+{
+    int node;
+
+    if (addr < STACK_BASE_ADDR || addr >= STACK_NODE_BASE(MAX_NUMA))
+        return false;
+    node = stack_numa_node((void *)addr);
+    if (addr >= (uintptr_t)atomic_load(&stack_pos[node]))
+        return false;
+    return (addr - STACK_NODE_BASE(node)) % STACK_SLOT_SIZE < STACK_GUARD_SIZE;
+}
+
+static void stack_segv_handler(int signum, siginfo_t *info, void *extra)
+{
+    extern __thread struct task *__curr;
+
+    if (stack_is_guard((uintptr_t)info->si_addr))
+        log_crit("stack: overflow in task %p (fault at %p)", __curr, info->si_addr);
+
+    if (prev_segv_action.sa_flags & SA_SIGINFO) {
+        prev_segv_action.sa_sigaction(signum, info, extra);
+    } else if (prev_segv_action.sa_handler != SIG_DFL &&
+               prev_segv_action.sa_handler != SIG_IGN) {
+        prev_segv_action.sa_handler(signum);
+    } else {
+        /* the process dies anyway: the access faults again with the default action */
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+static int stack_guard_init(void)
+{
+    struct sigaction action = {0};
+
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    action.sa_sigaction = stack_segv_handler;
+    return sigaction(SIGSEGV, &action, &prev_segv_action) ? -errno : 0;
+}
+
+/* the overflowed stack can't run the handler */
+static int stack_guard_init_percpu(void)
+{
+    stack_t ss = {0};
+
+    ss.ss_sp = malloc(STACK_SIGSTACK_SIZE);
+    if (!ss.ss_sp)
+        return -ENOMEM;
+    ss.ss_size = STACK_SIGSTACK_SIZE;
+    if (sigaltstack(&ss, NULL)) {
+        free(ss.ss_sp);
+        return -errno;
+    }
+    return 0;
+}
+
+#else
+
+static int stack_guard_init(void)
+{
+    return 0;
+}
+
+static int stack_guard_init_percpu(void)
+{
+    return 0;
+}
+
+#endif
+
 /**
  * stack_init_thread - intializes per-thread state
- * Returns 0 (always successful).
+ * Returns 0 if successful, or a negative error code.
  */
 int stack_init_percpu(void)
 {
     tcache_init_percpu(stack_tcache, &percpu_get(stack_percpu));
-    return 0;
+    return stack_guard_init_percpu();
 }
 
 /**
@@ -105,9 +356,48 @@ int stack_init_percpu(void)
  */
 int stack_init(void)
 {
+    int i;
+
+    for (i = 0; i < MAX_NUMA; i++) {
+        spin_lock_init(&stack_pools[i].lock);
+        atomic_init(&stack_pos[i], STACK_NODE_BASE(i));
+    }
+
     stack_tcache = tcache_create("runtime_stacks", &stack_tcache_ops, TCACHE_DEFAULT_MAG_SIZE,
                                  sizeof(struct stack));
     if (!stack_tcache)
         return -ENOMEM;
-    return 0;
+    return stack_guard_init();
+}
+
+/**
+ * stack_init_late_percpu - starts the stack reclaimer once scheduling works
+ * Returns 0 if successful, or a negative error code.
+ */
+int stack_init_late_percpu(void)
+{
+    /* not using the per-CPU stack allocator */
+    if (!stack_tcache || current_cpu_id() != 0)
+        return 0;
+    return task_spawn(current_cpu_id(), stack_reclaimer, NULL, 0);
+}
+
+/**
+ * stack_print_stats - dumps the free stack pools
+ */
+void stack_print_stats(void)
+{
+    struct stack_pool *p;
+    int i;
+
+    if (!stack_tcache)
+        return;
+
+    for (i = 0; i < MAX_NUMA; i++) {
+        p = &stack_pools[i];
+        printf("stack pool %d: %ld mapped, %u hot, %d cold\n", i,
+               (atomic_load(&stack_pos[i]) - STACK_NODE_BASE(i)) / STACK_SLOT_SIZE,
+               stack_pool_nr_hot(p), ACCESS_ONCE(p->nr_cold));
+    }
+    printf("stack pool: %ld reclaimed\n", atomic_load(&stack_nr_reclaimed));
 }
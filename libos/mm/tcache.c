@@ -5,7 +5,6 @@
  * CPUs and Arbitrary Resources. Jeff Bonwick and Johnathan Adams.
  *
  * TODO: Improve NUMA awareness.
- * TODO: Provide an interface to tear-down thread caches.
  * TODO: Remove dependence on libc malloc().
  * TODO: Use RCU for tcache list so printing stats doesn't block creating
  * new tcaches.
@@ -20,6 +19,14 @@
 
 #include <skyloft/mm/tcache.h>
 
+/* a window of trips to the shared pool after which magazines are resized */
+#define TCACHE_ADAPT_MISSES 16
+/* a window that took longer than this means the cache is cold */
+#define TCACHE_COLD_US 100000
+/* the miss rates above and below which magazines are resized */
+#define TCACHE_GROW_RATIO   64
+#define TCACHE_SHRINK_RATIO 512
+
 static DEFINE_SPINLOCK(tcache_lock);
 static DEFINE_LIST_HEAD(tcache_list);
 
@@ -28,7 +35,7 @@ DEFINE_PERCPU(uint64_t, mag_free);
 DEFINE_PERCPU(uint64_t, pool_alloc);
 DEFINE_PERCPU(uint64_t, pool_free);
 
-static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc)
+static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc, int nr)
 {
     void *items[TCACHE_MAX_MAG_SIZE];
     struct tcache_hdr *head, **pos;
@@ -36,19 +43,19 @@ static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc)
 
     percpu_get(mag_alloc)++;
 
-    err = tc->ops->alloc(tc, tc->mag_size, items);
+    err = tc->ops->alloc(tc, nr, items);
     if (err)
         return NULL;
 
     head = (struct tcache_hdr *)items[0];
     pos = &head->next_item;
-    for (i = 1; i < (int)tc->mag_size; i++) {
+    for (i = 1; i < nr; i++) {
         *pos = (struct tcache_hdr *)items[i];
         pos = &(*pos)->next_item;
     }
 
     *pos = NULL;
-    atomic_inc(&tc->mags_allocated);
+    atomic_fetch_add(&tc->items_allocated, nr);
     return head;
 }
 
@@ -64,15 +71,48 @@ static void tcache_free_mag(struct tcache *tc, struct tcache_hdr *hdr)
         hdr = hdr->next_item;
     } while (hdr);
 
-    assert(nr == (int)tc->mag_size);
+    assert(nr <= (int)TCACHE_MAX_MAG_SIZE);
     tc->ops->free(tc, nr, items);
-    atomic_dec(&tc->mags_allocated);
+    atomic_fetch_sub(&tc->items_allocated, nr);
+}
+
+/*
+ * Counts a trip to the shared pool. Every TCACHE_ADAPT_MISSES trips, the
+ * magazines of this CPU double if the miss rate was above 1/TCACHE_GROW_RATIO,
+ * and halve if it was below 1/TCACHE_SHRINK_RATIO or if the trips were spread
+ * over so long that the cache is cold. Magazines already loaded keep their
+ * size until they are exchanged.
+ */
+static void tcache_miss(struct tcache_percpu *ltc)
+{
+    unsigned long ops, misses;
+    unsigned int cap = ltc->capacity;
+    __usec now;
+
+    misses = ++ltc->misses - ltc->win_misses;
+    if (misses < TCACHE_ADAPT_MISSES)
+        return;
+
+    now = now_us();
+    ops = ltc->hits + ltc->misses - ltc->win_ops;
+    if (now - ltc->win_start > TCACHE_COLD_US)
+        cap /= 2;
+    else if (misses * TCACHE_GROW_RATIO > ops)
+        cap *= 2;
+    else if (misses * TCACHE_SHRINK_RATIO < ops)
+        cap /= 2;
+    ltc->capacity = MIN(MAX(cap, TCACHE_MIN_MAG_SIZE), ltc->tc->max_mag_size);
+
+    ltc->win_ops = ltc->hits + ltc->misses;
+    ltc->win_misses = ltc->misses;
+    ltc->win_start = now;
 }
 
 /* The thread-local cache allocation slow path. */
 void *__tcache_alloc(struct tcache_percpu *ltc)
 {
     struct tcache *tc = ltc->tc;
+    struct tcache_hdr *mag;
     void *item;
 
     /* must be out of rounds */
@@ -82,29 +122,36 @@ void *__tcache_alloc(struct tcache_percpu *ltc)
     /* CASE 1: exchange empty loaded mag with full previous mag */
     if (ltc->previous) {
         ltc->loaded = ltc->previous;
+        ltc->rounds = ltc->prev_rounds;
         ltc->previous = NULL;
+        ltc->hits++;
         goto alloc;
     }
 
     percpu_get(pool_alloc)++;
+    tcache_miss(ltc);
 
     /* CASE 2: grab a magazine from the shared pool */
     spin_lock(&tc->lock);
-    ltc->loaded = tc->shared_mags;
-    if (tc->shared_mags)
-        tc->shared_mags = tc->shared_mags->next_mag;
+    mag = tc->shared_mags;
+    if (mag)
+        tc->shared_mags = mag->next_mag;
     spin_unlock(&tc->lock);
-    if (ltc->loaded)
+    if (mag) {
+        ltc->loaded = mag;
+        ltc->rounds = mag->next_item->nr_items;
         goto alloc;
+    }
 
     /* CASE 3: allocate a new magazine */
-    ltc->loaded = tcache_alloc_mag(tc);
+    ltc->loaded = tcache_alloc_mag(tc, ltc->capacity);
     if (unlikely(!ltc->loaded))
         return NULL;
+    ltc->rounds = ltc->capacity;
 
 alloc:
-    /* reload the magazine and allocate an item */
-    ltc->rounds = ltc->capacity - 1;
+    /* allocate an item from the reloaded magazine */
+    ltc->rounds--;
     item = (void *)ltc->loaded;
     ltc->loaded = ltc->loaded->next_item;
     return item;
@@ -115,25 +162,32 @@ void __tcache_free(struct tcache_percpu *ltc, void *item)
 {
     struct tcache *tc = ltc->tc;
     struct tcache_hdr *hdr = (struct tcache_hdr *)item;
+    struct tcache_hdr *mag;
 
-    /* magazine must be full */
-    assert(ltc->rounds == ltc->capacity);
+    /* magazine must be full, it may be larger than a shrunk capacity */
+    assert(ltc->rounds >= ltc->capacity);
     assert(ltc->loaded != NULL);
 
     /* CASE 1: exchange empty previous mag with full loaded mag */
     if (!ltc->previous) {
         ltc->previous = ltc->loaded;
+        ltc->prev_rounds = ltc->rounds;
+        ltc->hits++;
         goto free;
     }
 
     percpu_get(pool_free)++;
+    tcache_miss(ltc);
 
     /* CASE 2: return a magazine to the shared pool */
+    mag = ltc->previous;
+    mag->next_item->nr_items = ltc->prev_rounds;
     spin_lock(&tc->lock);
-    ltc->previous->next_mag = tc->shared_mags;
-    tc->shared_mags = ltc->previous;
+    mag->next_mag = tc->shared_mags;
+    tc->shared_mags = mag;
     spin_unlock(&tc->lock);
     ltc->previous = ltc->loaded;
+    ltc->prev_rounds = ltc->rounds;
 
 free:
     /* start a new magazine and free the item */
@@ -146,13 +200,16 @@ free:
  * tcache_create - creates a new thread-local cache
  * @name: a human-readable name to identify the cache
  * @ops: operations for allocating and freeing items that back the cache
- * @mag_size: the number of items in a magazine
+ * @mag_size: the initial number of items in a magazine
  * @item_size: the size of each item
  *
  * Returns a thread cache or NULL of out of memory.
  *
  * After creating a thread-local cache, you'll want to attach one or more
- * thread-local handles using tcache_init_percpu().
+ * thread-local handles using tcache_init_percpu(). Each handle then resizes
+ * its magazines between TCACHE_MIN_MAG_SIZE and the smaller of
+ * TCACHE_MAX_MAG_SIZE and TCACHE_MAX_MAG_BYTES worth of items as its miss rate
+ * changes.
  */
 struct tcache *tcache_create(const char *name, const struct tcache_ops *ops, unsigned int mag_size,
                              size_t item_size)
@@ -161,7 +218,7 @@ struct tcache *tcache_create(const char *name, const struct tcache_ops *ops, uns
 
     /* we assume the caller is aware of the tcache size limits */
     assert(item_size >= TCACHE_MIN_ITEM_SIZE);
-    assert(mag_size <= TCACHE_MAX_MAG_SIZE);
+    assert(mag_size >= TCACHE_MIN_MAG_SIZE && mag_size <= TCACHE_MAX_MAG_SIZE);
 
     tc = malloc(sizeof(*tc));
     if (!tc)
@@ -170,10 +227,13 @@ struct tcache *tcache_create(const char *name, const struct tcache_ops *ops, uns
     tc->name = name;
     tc->ops = ops;
     tc->item_size = item_size;
-    atomic_store(&tc->mags_allocated, 0);
+    atomic_store(&tc->items_allocated, 0);
     tc->mag_size = mag_size;
+    tc->max_mag_size =
+        MIN(MAX(TCACHE_MAX_MAG_BYTES / item_size, (size_t)mag_size), (size_t)TCACHE_MAX_MAG_SIZE);
     spin_lock_init(&tc->lock);
     tc->shared_mags = NULL;
+    list_head_init(&tc->percpu_list);
 
     spin_lock(&tcache_lock);
     list_add_tail(&tcache_list, &tc->link);
@@ -192,8 +252,16 @@ void tcache_init_percpu(struct tcache *tc, struct tcache_percpu *ltc)
 {
     ltc->tc = tc;
     ltc->loaded = ltc->previous = NULL;
-    ltc->rounds = 0;
+    ltc->rounds = ltc->prev_rounds = 0;
     ltc->capacity = tc->mag_size;
+    ltc->hits = ltc->misses = 0;
+    ltc->win_ops = ltc->win_misses = 0;
+    ltc->win_start = now_us();
+    ltc->owner = percpu_ptr;
+
+    spin_lock(&tcache_lock);
+    list_add_tail(&tc->percpu_list, &ltc->link);
+    spin_unlock(&tcache_lock);
 }
 
 /**
@@ -216,12 +284,59 @@ void tcache_reclaim(struct tcache *tc)
     }
 }
 
+/**
+ * tcache_reclaim_all - reclaims unused memory from all thread-local caches
+ *
+ * The caches created first back the later ones (e.g. 4KB pages back slabs),
+ * so they are reclaimed last.
+ */
+void tcache_reclaim_all(void)
+{
+    struct tcache *tc;
+
+    spin_lock(&tcache_lock);
+    list_for_each_rev(&tcache_list, tc, link) tcache_reclaim(tc);
+    spin_unlock(&tcache_lock);
+}
+
+/**
+ * tcache_drain_percpu - frees the items in this kthread's magazines
+ *
+ * Empties the loaded and previous magazines of every handle the calling
+ * kthread attached, straight to the backing allocator. Must be called with
+ * preemption disabled.
+ */
+void tcache_drain_percpu(void)
+{
+    struct tcache *tc;
+    struct tcache_percpu *ltc;
+
+    spin_lock(&tcache_lock);
+    list_for_each_rev(&tcache_list, tc, link)
+    {
+        list_for_each(&tc->percpu_list, ltc, link)
+        {
+            if (ltc->owner != percpu_ptr)
+                continue;
+            if (ltc->rounds)
+                tcache_free_mag(tc, ltc->loaded);
+            if (ltc->previous)
+                tcache_free_mag(tc, ltc->previous);
+            ltc->loaded = ltc->previous = NULL;
+            ltc->rounds = ltc->prev_rounds = 0;
+        }
+    }
+    spin_unlock(&tcache_lock);
+}
+
 /**
  * tcache_print_stats - dumps usage statistics about all thread-local caches
  */
 void tcache_print_usage(void)
 {
     struct tcache *tc;
+    struct tcache_percpu *ltc;
+    unsigned long hits, ops;
     size_t total = 0;
 
     log_info("tcache: dumping usage statistics...");
@@ -229,9 +344,15 @@ void tcache_print_usage(void)
     spin_lock(&tcache_lock);
     list_for_each(&tcache_list, tc, link)
     {
-        long mags = atomic_load(&tc->mags_allocated);
-        size_t usage = tc->mag_size * tc->item_size * mags;
-        log_info("%8ld KB\t%s", usage / 1024, tc->name);
+        size_t usage = tc->item_size * atomic_load(&tc->items_allocated);
+
+        hits = ops = 0;
+        list_for_each(&tc->percpu_list, ltc, link)
+        {
+            hits += ltc->hits;
+            ops += ltc->hits + ltc->misses;
+        }
+        log_info("%8ld KB %3lu%% hits\t%s", usage / 1024, ops ? hits * 100 / ops : 0, tc->name);
         total += usage;
     }
     spin_unlock(&tcache_lock);
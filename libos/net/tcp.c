@@ -212,6 +212,7 @@ tcp_conn_t *tcp_conn_alloc(void)
     waitq_init(&c->rx_wq);
     list_head_init(&c->rxq_ooo);
     list_head_init(&c->rxq);
+    c->rx_notify = NULL;
 
     /* egress fields */
     c->tx_closed = false;
@@ -644,10 +645,42 @@ static void tcp_read_finish(tcp_conn_t *c, struct mbuf *m)
     spin_lock_np(&c->lock);
     c->rx_exclusive = false;
     waitq_release_start(&c->rx_wq, &waiters);
+    if (!list_empty(&c->rxq))
+        tcp_conn_rx_notify(c);
     spin_unlock_np(&c->lock);
     waitq_release_finish(&waiters);
 }
 
+/**
+ * tcp_read_notify - arms a one-shot callback for when a TCP connection is readable
+ * @c: the TCP connection
+ * @fn: called once data is pending or the connection is closed
+ * @arg: passed to @fn
+ *
+ * Lets an event loop wait for data without blocking a task. @fn may run in
+ * softirq context and must not block; tcp_read() won't block afterwards unless
+ * another reader takes the data first.
+ *
+ * Returns 0 if armed, -EAGAIN if the connection is readable already (@fn isn't
+ * called), or -EBUSY if another callback is armed.
+ */
+int tcp_read_notify(tcp_conn_t *c, void (*fn)(unsigned long arg), unsigned long arg)
+{
+    int ret = 0;
+
+    spin_lock_np(&c->lock);
+    if (c->rx_closed || (!c->rx_exclusive && !list_empty(&c->rxq))) {
+        ret = -EAGAIN;
+    } else if (c->rx_notify) {
+        ret = -EBUSY;
+    } else {
+        c->rx_notify = fn;
+        c->rx_notify_arg = arg;
+    }
+    spin_unlock_np(&c->lock);
+    return ret;
+}
+
 /**
  * tcp_read - reads data from a TCP connection
  * @c: the TCP connection
@@ -947,6 +980,7 @@ void tcp_conn_fail(tcp_conn_t *c, int err)
     if (!c->rx_closed) {
         c->rx_closed = true;
         waitq_release(&c->rx_wq);
+        tcp_conn_rx_notify(c);
     }
 
     if (!c->tx_closed) {
@@ -985,6 +1019,24 @@ void tcp_conn_shutdown_rx(tcp_conn_t *c)
 
     c->rx_closed = true;
     waitq_release(&c->rx_wq);
+    tcp_conn_rx_notify(c);
+}
+
+/**
+ * tcp_conn_rx_notify - runs the callback armed by tcp_read_notify()
+ * @c: the TCP connection that became readable
+ *
+ * The caller must hold @c's lock.
+ */
+void tcp_conn_rx_notify(tcp_conn_t *c)
+{
+    void (*fn)(unsigned long arg) = c->rx_notify;
+
+    assert_spin_lock_held(&c->lock);
+    if (fn) {
+        c->rx_notify = NULL;
+        fn(c->rx_notify_arg);
+    }
 }
 
 static int tcp_conn_shutdown_tx(tcp_conn_t *c)
@@ -77,6 +77,9 @@ struct tcp_conn {
     waitq_t rx_wq;
     struct list_head rxq_ooo;
     struct list_head rxq;
+    /* one-shot callback armed by tcp_read_notify() */
+    void (*rx_notify)(unsigned long arg);
+    unsigned long rx_notify_arg;
 
     /* egress path */
     unsigned int tx_closed : 1;
@@ -103,6 +106,7 @@ void tcp_conn_ack(tcp_conn_t *c, struct list_head *freeq);
 void tcp_conn_set_state(tcp_conn_t *c, int new_state);
 void tcp_conn_fail(tcp_conn_t *c, int err);
 void tcp_conn_shutdown_rx(tcp_conn_t *c);
+void tcp_conn_rx_notify(tcp_conn_t *c);
 void tcp_conn_destroy(tcp_conn_t *c);
 
 void tcp_timer_update(tcp_conn_t *c);
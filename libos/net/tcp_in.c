@@ -374,6 +374,7 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
             assert(!list_empty(&c->rxq));
             assert(do_drop == false);
             rx_task = waitq_signal(&c->rx_wq, &c->lock);
+            tcp_conn_rx_notify(c);
         }
         if (!c->ack_delayed) {
             c->ack_delayed = true;
@@ -49,6 +49,9 @@ struct udp_conn {
     int inq_err;
     waitq_t inq_wq;
     struct mbufq inq;
+    /* one-shot callback armed by udp_read_notify() */
+    void (*inq_notify)(unsigned long arg);
+    unsigned long inq_notify_arg;
 
     /* egress support */
     spinlock_t outq_lock;
@@ -58,6 +61,18 @@ struct udp_conn {
     waitq_t outq_wq;
 };
 
+/* runs the armed read callback, the caller must hold inq_lock */
+static void udp_conn_notify(udp_conn_t *c)
+{
+    void (*fn)(unsigned long arg) = c->inq_notify;
+
+    assert_spin_lock_held(&c->inq_lock);
+    if (fn) {
+        c->inq_notify = NULL;
+        fn(c->inq_notify_arg);
+    }
+}
+
 /* handles ingress packets for UDP sockets */
 static void udp_conn_recv(struct trans_entry *e, struct mbuf *m)
 {
@@ -83,6 +98,7 @@ static void udp_conn_recv(struct trans_entry *e, struct mbuf *m)
 
     /* wake up a waiter */
     t = waitq_signal(&c->inq_wq, &c->inq_lock);
+    udp_conn_notify(c);
     spin_unlock_np(&c->inq_lock);
 
     waitq_signal_finish(t);
@@ -98,6 +114,7 @@ static void udp_conn_err(struct trans_entry *e, int err)
     spin_lock_np(&c->inq_lock);
     do_release = !c->inq_err && !c->shutdown;
     c->inq_err = err;
+    udp_conn_notify(c);
     spin_unlock_np(&c->inq_lock);
 
     if (do_release)
@@ -121,6 +138,7 @@ static void udp_init_conn(udp_conn_t *c)
     c->inq_err = 0;
     waitq_init(&c->inq_wq);
     mbufq_init(&c->inq);
+    c->inq_notify = NULL;
 
     /* initialize egress fields */
     spin_lock_init(&c->outq_lock);
@@ -429,12 +447,43 @@ ssize_t udp_write(udp_conn_t *c, const void *buf, size_t len)
     return udp_write_to(c, buf, len, NULL);
 }
 
+/**
+ * udp_read_notify - arms a one-shot callback for when a UDP socket is readable
+ * @c: the socket
+ * @fn: called once a datagram, an error, or a shutdown is pending
+ * @arg: passed to @fn
+ *
+ * Lets an event loop wait for datagrams without blocking a task. @fn may run in
+ * softirq context and must not block; udp_read_from() won't block afterwards
+ * unless another reader takes the datagram first.
+ *
+ * Returns 0 if armed, -EAGAIN if the socket is readable already (@fn isn't
+ * called), or -EBUSY if another callback is armed.
+ */
+int udp_read_notify(udp_conn_t *c, void (*fn)(unsigned long arg), unsigned long arg)
+{
+    int ret = 0;
+
+    spin_lock_np(&c->inq_lock);
+    if (!mbufq_empty(&c->inq) || c->inq_err || c->shutdown) {
+        ret = -EAGAIN;
+    } else if (c->inq_notify) {
+        ret = -EBUSY;
+    } else {
+        c->inq_notify = fn;
+        c->inq_notify_arg = arg;
+    }
+    spin_unlock_np(&c->inq_lock);
+    return ret;
+}
+
 void __udp_shutdown(udp_conn_t *c)
 {
     spin_lock_np(&c->inq_lock);
     spin_lock_np(&c->outq_lock);
     BUG_ON(c->shutdown);
     c->shutdown = true;
+    udp_conn_notify(c);
     spin_unlock_np(&c->outq_lock);
     spin_unlock_np(&c->inq_lock);
 
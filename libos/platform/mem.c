@@ -17,6 +17,10 @@
 #include <utils/assert.h>
 #include <utils/log.h>
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 long mbind(void *start, size_t len, int mode, const unsigned long *nmask, unsigned long maxnode,
            unsigned flags)
 {
@@ -43,19 +47,15 @@ void touch_mapping(void *base, size_t len, size_t pgsize)
     signal(SIGBUS, s);
 }
 
-static void *__mem_map_common(void *base, size_t len, size_t pgsize, int flags, int fd,
-                              unsigned long *mask, int numa_policy)
+static void *__mem_mmap(void *base, size_t len, size_t pgsize, int flags, int fd)
 {
     void *addr;
 
-    flags |= MAP_POPULATE;
     if (fd == -1)
         flags |= MAP_ANONYMOUS;
     if (base)
         flags |= MAP_FIXED;
 
-    len = align_up(len, pgsize);
-
     switch (pgsize) {
     case PGSIZE_4KB:
         break;
@@ -78,9 +78,25 @@ static void *__mem_map_common(void *base, size_t len, size_t pgsize, int flags,
 
     addr = mmap(base, len, PROT_READ | PROT_WRITE, flags, fd, 0);
     if (addr == MAP_FAILED) {
-        log_err("failed %s", strerror(errno));
+        /* 1GB pages are optional, callers fall back to 2MB pages */
+        if (pgsize == PGSIZE_1GB)
+            log_debug("failed to map 1GB pages: %s", strerror(errno));
+        else
+            log_err("failed %s", strerror(errno));
         return MAP_FAILED;
     }
+    return addr;
+}
+
+static void *__mem_map_common(void *base, size_t len, size_t pgsize, int flags, int fd,
+                              unsigned long *mask, int numa_policy)
+{
+    void *addr;
+
+    len = align_up(len, pgsize);
+    addr = __mem_mmap(base, len, pgsize, flags | MAP_POPULATE, fd);
+    if (addr == MAP_FAILED)
+        return MAP_FAILED;
 
     BUILD_ASSERT(sizeof(unsigned long) * 8 >= MAX_NUMA);
     if (mbind(addr, len, numa_policy, mask ? mask : NULL, mask ? MAX_NUMA + 1 : 0,
@@ -112,6 +128,54 @@ void *mem_map_anom(void *base, size_t len, size_t pgsize, int node)
     return __mem_map_common(base, len, pgsize, MAP_PRIVATE, -1, &mask, MPOL_BIND);
 }
 
+/**
+ * mem_map_anom_huge - map anonymous memory with 1GB pages where possible
+ * @base: the base address (or NULL for automatic), must be 1GB aligned
+ * @len: the length of the mapping
+ * @node: the NUMA node
+ *
+ * The whole gigabytes at the start of the mapping are backed with 1GB pages
+ * and the rest with 2MB pages, so no memory is wasted on rounding up. If 1GB
+ * pages are disabled (MEM_1GB_PAGES) or none are free, 2MB pages back all of
+ * it. Only the I/O region uses it: the scheduler region is shared through
+ * hugetlbfs files and populated lazily, 2MB at a time.
+ *
+ * Returns the base address, or MAP_FAILED if out of memory
+ */
+void *mem_map_anom_huge(void *base, size_t len, int node)
+{
+    size_t giant_len = MEM_1GB_PAGES ? align_down(len, PGSIZE_1GB) : 0;
+    void *addr;
+
+    if (!giant_len)
+        return mem_map_anom(base, len, PGSIZE_2MB, node);
+
+    len = align_up(len, PGSIZE_2MB);
+    if (!base) {
+        /* reserve a 1GB aligned range to map into */
+        addr = mmap(NULL, len + PGSIZE_1GB, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1, 0);
+        if (addr == MAP_FAILED)
+            return MAP_FAILED;
+        base = (void *)align_up((uintptr_t)addr, PGSIZE_1GB);
+        if (base != addr)
+            munmap(addr, (char *)base - (char *)addr);
+        munmap((char *)base + len, (char *)addr + PGSIZE_1GB - (char *)base);
+    }
+    assert(PGOFF_1GB(base) == 0);
+
+    if (mem_map_anom(base, giant_len, PGSIZE_1GB, node) == MAP_FAILED) {
+        log_info("mem: no 1GB pages on node %d, using 2MB pages", node);
+        return mem_map_anom(base, len, PGSIZE_2MB, node);
+    }
+    if (giant_len < len &&
+        mem_map_anom((char *)base + giant_len, len - giant_len, PGSIZE_2MB, node) == MAP_FAILED) {
+        munmap(base, len);
+        return MAP_FAILED;
+    }
+    return base;
+}
+
 /**
  * mem_map_shm - maps a System V shared memory segment backed with a file
  * @path: the file path to the shared memory backing file
@@ -131,11 +195,99 @@ void *mem_map_shm_file(const char *path, void *base, size_t len, size_t pgsize,
 
     len = align_up(len, pgsize);
     if (ftruncate(fd, len) < 0) {
+        close(fd);
         return MAP_FAILED;
     }
 
     unsigned long mask = (1 << node);
-    return __mem_map_common(base, len, pgsize, MAP_SHARED, fd, &mask, MPOL_BIND);
+    void *addr = __mem_map_common(base, len, pgsize, MAP_SHARED, fd, &mask, MPOL_BIND);
+    /* the mapping keeps the file open */
+    close(fd);
+    return addr;
+}
+
+/**
+ * mem_map_shm_file_numa - maps a shared memory file spread over NUMA nodes
+ * @path: the file path to the shared memory backing file
+ * @base: the base address to map the shared segment (or automatic if NULL)
+ * @len: the length of the mapping
+ * @pgsize: the size of each page
+ * @page_node: returns the NUMA node for the page at an address of the mapping
+ * @populate: whether to populate the mapping now
+ *
+ * Like mem_map_shm_file(), but each page is bound to the node @page_node picks
+ * for it before the mapping is populated. The pages of a file are allocated
+ * when they are first touched, later mappings share them where they are.
+ *
+ * If @populate is false, no pages are reserved or allocated: they are faulted
+ * in on first touch, which raises SIGBUS if there are no free huge pages, so
+ * use mem_populate() before touching them.
+ *
+ * Returns a pointer to the mapping, or MAP_FAILED if the mapping failed.
+ */
+void *mem_map_shm_file_numa(const char *path, void *base, size_t len, size_t pgsize,
+                            int (*page_node)(void *addr), bool populate)
+{
+    unsigned long mask;
+    char *addr, *pos, *end;
+    int fd, node;
+
+    fd = open(path, O_CREAT | O_RDWR, 0666);
+    if (fd < 0)
+        return MAP_FAILED;
+
+    len = align_up(len, pgsize);
+    if (ftruncate(fd, len) < 0) {
+        close(fd);
+        return MAP_FAILED;
+    }
+
+    /* not populated yet, so the pages follow the policies set below */
+    addr = __mem_mmap(base, len, pgsize, MAP_SHARED | (populate ? 0 : MAP_NORESERVE), fd);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return MAP_FAILED;
+
+    /* one mbind() for each run of pages on the same node */
+    for (pos = addr; pos < addr + len; pos = end) {
+        node = page_node(pos);
+        for (end = pos + pgsize; end < addr + len && page_node(end) == node; end += pgsize);
+
+        mask = 1UL << node;
+        if (mbind(pos, end - pos, MPOL_BIND, &mask, MAX_NUMA + 1, 0)) {
+            log_err("failed %s", strerror(errno));
+            munmap(addr, len);
+            return MAP_FAILED;
+        }
+    }
+
+    if (populate)
+        touch_mapping(addr, len, pgsize);
+    return addr;
+}
+
+/**
+ * mem_populate - allocates the pages of a range of a mapping
+ * @addr: the start of the range
+ * @len: the length of the range
+ *
+ * Unlike touching the pages, this fails gracefully if they can't be allocated.
+ *
+ * Returns 0 if successful, or a negative error code.
+ */
+int mem_populate(void *addr, size_t len)
+{
+    char *start = (char *)PGADDR_4KB(addr);
+
+    len = align_up((char *)addr + len - start, PGSIZE_4KB);
+    if (!madvise(start, len, MADV_POPULATE_WRITE))
+        return 0;
+    /* before Linux 5.14 */
+    if (errno == EINVAL) {
+        touch_mapping(start, len, PGSIZE_4KB);
+        return 0;
+    }
+    return -errno;
 }
 
 /**
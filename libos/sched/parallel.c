@@ -0,0 +1,198 @@
+/*
+ * parallel.c - fork-join helpers on top of task_spawn()
+ *
+ * A parallel loop is never split up front. Participants claim grain-sized
+ * chunks from a shared cursor, and the range is offered to more CPUs only when
+ * a helper task actually starts running (i.e. a CPU had time to pick it up).
+ * Each helper that starts spawns up to two more helpers while chunks remain,
+ * and the calling task runs chunks itself until the range is exhausted, so
+ * an idle machine ramps up quickly and a busy one barely pays for splitting.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <skyloft/sched.h>
+#include <skyloft/sync/sync.h>
+#include <skyloft/task.h>
+#include <skyloft/uapi/task.h>
+#include <utils/atomic.h>
+#include <utils/defs.h>
+#include <utils/spinlock.h>
+
+/* the number of helpers each new participant may spawn */
+#define PFOR_FANOUT 2
+/* chunks per CPU when the caller doesn't pick a grain */
+#define PFOR_CHUNKS_PER_CPU 8
+
+struct pfor {
+    /* next index to claim */
+    long next __aligned_cacheline;
+
+    long end, grain;
+    range_fn_t fn;
+    void *arg;
+    int cpu;
+    int max_helpers;
+    int nr_helpers;
+    int ref;
+    /* items not completed yet */
+    long remaining;
+    spinlock_t lock;
+    struct task *waiter;
+};
+
+static void pfor_put(struct pfor *p)
+{
+    if (__atomic_sub_fetch(&p->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        free(p);
+}
+
+static void pfor_helper(void *arg);
+
+static void pfor_spawn_helpers(struct pfor *p)
+{
+    int i, n;
+
+    for (i = 0; i < PFOR_FANOUT; i++) {
+        /* don't offer a range that has at most one chunk left */
+        if (ACCESS_ONCE(p->next) + p->grain >= p->end)
+            return;
+
+        n = __atomic_fetch_add(&p->nr_helpers, 1, __ATOMIC_RELAXED);
+        if (n >= p->max_helpers)
+            return;
+
+        __atomic_fetch_add(&p->ref, 1, __ATOMIC_RELAXED);
+        if (task_spawn((p->cpu + n + 1) % proc->nr_ks, pfor_helper, p, 0)) {
+            pfor_put(p);
+            return;
+        }
+    }
+}
+
+static void pfor_run(struct pfor *p)
+{
+    struct task *waiter;
+    long begin, end;
+
+    while (true) {
+        begin = __atomic_fetch_add(&p->next, p->grain, __ATOMIC_RELAXED);
+        if (begin >= p->end)
+            return;
+        end = MIN(begin + p->grain, p->end);
+
+        p->fn(begin, end, p->arg);
+
+        if (__atomic_sub_fetch(&p->remaining, end - begin, __ATOMIC_ACQ_REL) == 0) {
+            spin_lock_np(&p->lock);
+            waiter = p->waiter;
+            p->waiter = NULL;
+            spin_unlock_np(&p->lock);
+            if (waiter)
+                task_wakeup(waiter);
+        }
+    }
+}
+
+static void pfor_helper(void *arg)
+{
+    struct pfor *p = arg;
+
+    /* a CPU picked us up, so offer the rest of the range further */
+    pfor_spawn_helpers(p);
+    pfor_run(p);
+    pfor_put(p);
+}
+
+/**
+ * sl_parallel_for - runs @fn over [@begin, @end) in parallel and waits for it
+ * @begin: the first index
+ * @end: one past the last index
+ * @grain: the number of indices per call of @fn (0 picks one)
+ * @fn: called with disjoint sub-ranges that cover [@begin, @end)
+ * @arg: passed to @fn
+ *
+ * The calling task runs chunks too, so the range completes even if no helper
+ * gets scheduled.
+ *
+ * Returns 0 if successful, -EINVAL, or -ENOMEM.
+ */
+int __api sl_parallel_for(long begin, long end, long grain, range_fn_t fn, void *arg)
+{
+    struct pfor *p;
+
+    if (unlikely(end < begin || grain < 0 || !fn))
+        return -EINVAL;
+    if (!grain)
+        grain = MAX(div_up(end - begin, (long)proc->nr_ks * PFOR_CHUNKS_PER_CPU), 1L);
+
+    /* a single chunk isn't worth a helper */
+    if (end - begin <= grain) {
+        if (end > begin)
+            fn(begin, end, arg);
+        return 0;
+    }
+
+    p = aligned_alloc(CACHE_LINE_SIZE, align_up(sizeof(*p), CACHE_LINE_SIZE));
+    if (unlikely(!p))
+        return -ENOMEM;
+
+    p->next = begin;
+    p->end = end;
+    p->grain = grain;
+    p->fn = fn;
+    p->arg = arg;
+    p->cpu = current_cpu_id();
+    p->max_helpers = proc->nr_ks - 1;
+    p->nr_helpers = 0;
+    p->ref = 1;
+    p->remaining = end - begin;
+    spin_lock_init(&p->lock);
+    p->waiter = NULL;
+
+    pfor_spawn_helpers(p);
+    pfor_run(p);
+
+    /* wait for helpers still running their last chunk */
+    spin_lock_np(&p->lock);
+    if (ACCESS_ONCE(p->remaining)) {
+        p->waiter = task_self();
+        task_block(&p->lock);
+    } else {
+        spin_unlock_np(&p->lock);
+    }
+
+    pfor_put(p);
+    return 0;
+}
+
+struct spawn_join_arg {
+    thread_fn_t fn;
+    void **args;
+};
+
+static void spawn_join_range(long begin, long end, void *arg)
+{
+    struct spawn_join_arg *sj = arg;
+    long i;
+
+    for (i = begin; i < end; i++) sj->fn(sj->args[i]);
+}
+
+/**
+ * sl_spawn_join - runs @fn once per argument in parallel and waits for all
+ * @fn: the function
+ * @args: the arguments
+ * @n: the number of arguments
+ *
+ * Returns 0 if successful, -EINVAL, or -ENOMEM.
+ */
+int __api sl_spawn_join(thread_fn_t fn, void **args, int n)
+{
+    struct spawn_join_arg sj = {.fn = fn, .args = args};
+
+    if (unlikely(!fn))
+        return -EINVAL;
+    return sl_parallel_for(0, n, 1, spawn_join_range, &sj);
+}
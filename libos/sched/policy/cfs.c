@@ -374,6 +374,38 @@ int cfs_sched_spawn(struct task *t, int cpu)
     return 0;
 }
 
+/* forks every @stride-th task of @tasks onto @cfs_rq under one lock */
+static void __spawn_batch(struct cfs_rq *cfs_rq, struct task **tasks, int n, int stride)
+{
+    struct cfs_task *task;
+    int i;
+
+    spin_lock(&cfs_rq->lock);
+    for (i = 0; i < n; i += stride) {
+        task = cfs_task_of(tasks[i]);
+        __fork_task(cfs_rq, task);
+        enqueue_task(cfs_rq, task, false);
+    }
+    spin_unlock(&cfs_rq->lock);
+}
+
+int cfs_sched_spawn_many(struct task **tasks, int n, int cpu)
+{
+    unsigned int start;
+    int i;
+
+    if (cpu >= 0) {
+        __spawn_batch(cpu_rq(cpu), tasks, n, 1);
+        return n;
+    }
+
+    /* the same CPUs n calls to cfs_sched_spawn() would pick, one lock each */
+    start = atomic_fetch_add(&TARGET_CPU, n);
+    for (i = 0; i < MIN(n, USED_CPUS); i++)
+        __spawn_batch(cpu_rq((start + i) % USED_CPUS), tasks + i, n - i, USED_CPUS);
+    return n;
+}
+
 static void __set_next_task(struct cfs_rq *cfs_rq, struct cfs_task *task)
 {
     if (task->on_rq)
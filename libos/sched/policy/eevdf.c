@@ -726,6 +726,38 @@ int eevdf_sched_spawn(struct task *t, int cpu)
     return 0;
 }
 
+/* forks every @stride-th task of @tasks onto @eevdf_rq under one lock */
+static void __spawn_batch(struct eevdf_rq *eevdf_rq, struct task **tasks, int n, int stride)
+{
+    struct eevdf_task *task;
+    int i;
+
+    spin_lock(&eevdf_rq->lock);
+    for (i = 0; i < n; i += stride) {
+        task = eevdf_task_of(tasks[i]);
+        __fork_task(eevdf_rq, task);
+        enqueue_task(eevdf_rq, task);
+    }
+    spin_unlock(&eevdf_rq->lock);
+}
+
+int eevdf_sched_spawn_many(struct task **tasks, int n, int cpu)
+{
+    unsigned int start;
+    int i;
+
+    if (cpu >= 0) {
+        __spawn_batch(cpu_rq(cpu), tasks, n, 1);
+        return n;
+    }
+
+    /* the same CPUs n calls to eevdf_sched_spawn() would pick, one lock each */
+    start = atomic_fetch_add(&TARGET_CPU, n);
+    for (i = 0; i < MIN(n, USED_CPUS); i++)
+        __spawn_batch(cpu_rq((start + i) % USED_CPUS), tasks + i, n - i, USED_CPUS);
+    return n;
+}
+
 /*
  * Earliest Eligible Virtual Deadline First
  *
@@ -59,6 +59,27 @@ int fifo_sched_spawn(struct task *task, int cpu)
     return 0;
 }
 
+/* new tasks go to the local runqueue, idle CPUs steal them from there */
+int fifo_sched_spawn_many(struct task **tasks, int n, int cpu)
+{
+    struct fifo_rq *rq = this_rq();
+    uint32_t tail = rq->tail;
+    int i, nr;
+
+    assert_local_irq_disabled();
+
+    nr = MIN(n, (int)(RUNTIME_RQ_SIZE - (tail - atomic_load_acq(&rq->head))));
+    for (i = 0; i < nr; i++) rq->tasks[tail++ & RQ_SIZE_MASK] = tasks[i];
+    atomic_store_rel(&rq->tail, tail);
+
+    if (unlikely(nr < n)) {
+        spin_lock(&rq->lock);
+        for (; i < n; i++) list_add_tail(&rq->overflow, &tasks[i]->link);
+        spin_unlock(&rq->lock);
+    }
+    return n;
+}
+
 void fifo_sched_yield()
 {
     put_task(this_rq(), task_self());
@@ -65,6 +65,40 @@ int fifo_sched_spawn(struct task *task, int cpu)
     return 0;
 }
 
+/* puts every @stride-th task of @tasks on @rq, reserving their slots at once */
+static void put_tasks(struct fifo_rq *rq, struct task **tasks, int n, int stride)
+{
+    unsigned int tail;
+    int i, nr = div_up(n, stride);
+
+    tail = atomic_fetch_add_explicit(&rq->tail, nr, memory_order_acquire);
+    if (tail + nr > atomic_load_acq(&rq->head) + RUNTIME_RQ_SIZE) {
+        panic("runqueue full");
+    }
+    for (i = 0; i < n; i += stride) {
+        fifo_task_of(tasks[i])->quan = 0;
+        atomic_store_rel(&rq->tasks[tail++ & RQ_SIZE_MASK], tasks[i]);
+    }
+    atomic_fetch_add(&rq->num_tasks, nr);
+}
+
+int fifo_sched_spawn_many(struct task **tasks, int n, int cpu)
+{
+    unsigned int start;
+    int i;
+
+    if (cpu >= 0) {
+        put_tasks(cpu_rq(cpu), tasks, n, 1);
+        return n;
+    }
+
+    /* the same CPUs n calls to fifo_sched_spawn() would pick */
+    start = atomic_fetch_add(&TARGET_CPU, n);
+    for (i = 0; i < MIN(n, USED_CPUS); i++)
+        put_tasks(cpu_rq((start + i) % USED_CPUS), tasks + i, n - i, USED_CPUS);
+    return n;
+}
+
 void fifo_sched_yield()
 {
     put_task(this_rq(), task_self());
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdio.h>
 
+#include <skyloft/global.h>
+#include <skyloft/mm/reclaim.h>
 #include <skyloft/params.h>
 #include <skyloft/percpu.h>
 #include <skyloft/platform.h>
@@ -19,6 +21,7 @@
 #include <utils/time.h>
 
 #define SHM_SCHED_DATA_HUGE_PATH      "/mnt/huge/skyloft_sched_data_huge"
+#define SHM_SCHED_DATA_POLICY_PATH    "/mnt/huge/skyloft_sched_data_policy"
 #define SHM_SCHED_DATA_HUGE_BASE_ADDR 0x300000000000UL
 
 static void *huge_pages_base;
@@ -28,7 +31,8 @@ static void *shm_sched_data_percpu[USED_CPUS];
 __thread struct task *__curr, *__idle;
 __thread struct kthread *localk;
 __thread volatile unsigned int preempt_cnt;
-static __thread uint32_t rcu_gen;
+/* not __thread, its address must not change with FS (see tls.c) */
+static DEFINE_PERCPU(uint32_t, rcu_gen);
 extern __thread int g_logic_cpu_id;
 
 static inline void switch_to_app(void *arg)
@@ -66,12 +70,16 @@ static __always_inline void fast_schedule()
 
     assert_local_irq_disabled();
     assert(__curr != NULL);
+    task_stack_check(prev);
+    /* before anything in the libos gets to clobber vector registers */
+    task_xstate_save(prev);
 
     __sched_percpu_lock(g_logic_cpu_id);
     next = __sched_pick_next();
     /* slow path: switch to idle and run schedule() */
     if (unlikely(!next)) {
         log_debug("%s: (%d,%d) -> ", __func__, prev->app_id, prev->id);
+        task_tls_switch(prev, __idle);
         __context_switch_to_idle(&prev->rsp, __idle->rsp);
         return;
     }
@@ -80,8 +88,8 @@ static __always_inline void fast_schedule()
     log_debug("%s: (%d,%d) -> (%d,%d)", __func__, prev->app_id, prev->id, next->app_id, next->id);
 
     /* increment the RCU generation number (odd is in task) */
-    atomic_store_rel(&rcu_gen, rcu_gen + 2);
-    assert((rcu_gen & 0x1) == 0x1);
+    atomic_store_rel(&percpu_get(rcu_gen), percpu_get(rcu_gen) + 2);
+    assert((percpu_get(rcu_gen) & 0x1) == 0x1);
 
 #if defined(SKYLOFT_TIMER) && !defined(SKYLOFT_UINTR) && !defined(SKYLOFT_DPDK)
     softirq_run(SOFTIRQ_MAX_BUDGET);
@@ -91,6 +99,7 @@ static __always_inline void fast_schedule()
     /* check if we're switching into the same task as before */
     if (unlikely(next == prev)) {
         next->stack_busy = false;
+        task_xstate_restore(next);
         return;
     }
 
@@ -102,13 +111,18 @@ static __always_inline void fast_schedule()
 
     if (unlikely(next->app_id != prev->app_id)) {
         /* switch to idle first */
+        prev->on_cpu = false;
         atomic_store_rel(&prev->stack_busy, false);
         switch_to_app(next);
         return;
     }
 
     /* switch stacks and enter the next task */
+    prev->on_cpu = false;
+    next->on_cpu = true;
     __curr = next;
+    task_tls_switch(prev, next);
+    task_xstate_restore(next);
     if (next->init) {
         next->init = false;
         __context_switch_init(&prev->rsp, next->rsp, &prev->stack_busy);
@@ -128,13 +142,14 @@ __noreturn __noinline void schedule()
 
     /* unmark busy for the stack of the previous task */
     if (__curr != NULL) {
+        __curr->on_cpu = false;
         atomic_store_rel(&__curr->stack_busy, false);
         __curr = NULL;
     }
 
     /* increment the RCU generation number (even is in scheduler) */
-    atomic_store_rel(&rcu_gen, rcu_gen + 1);
-    assert((rcu_gen & 0x1) == 0x0);
+    atomic_store_rel(&percpu_get(rcu_gen), percpu_get(rcu_gen) + 1);
+    assert((percpu_get(rcu_gen) & 0x1) == 0x0);
 
     STAT_CYCLES_BEGIN(elapsed);
 again:
@@ -144,6 +159,8 @@ again:
         // log_debug("%s: again, unlocking", __func__);
         __sched_percpu_unlock(g_logic_cpu_id);
 #endif
+        /* free the items cached by this kthread if asked to */
+        mem_reclaim_poll();
 #ifdef SCHED_PERCPU
 #ifdef SKYLOFT_DPDK
         if ((next = softirq_task(localk, SOFTIRQ_MAX_BUDGET))) {
@@ -173,8 +190,8 @@ done:
     ADD_STAT(IDLE, 1);
 
     /* increment the RCU generation number (odd is in task) */
-    atomic_store_rel(&rcu_gen, rcu_gen + 1);
-    assert((rcu_gen & 0x1) == 0x1);
+    atomic_store_rel(&percpu_get(rcu_gen), percpu_get(rcu_gen) + 1);
+    assert((percpu_get(rcu_gen) & 0x1) == 0x1);
 
     /* task must be scheduled atomically */
     if (unlikely(atomic_load_acq(&next->stack_busy))) {
@@ -191,7 +208,10 @@ done:
     }
 
     /* switch stacks and enter the next task */
+    next->on_cpu = true;
     __curr = next;
+    task_tls_switch(__idle, next);
+    task_xstate_restore(next);
     if (next->init) {
         next->init = false;
         __context_switch_from_idle_init(next->rsp);
@@ -201,7 +221,7 @@ done:
 
 __noreturn void start_schedule(void)
 {
-    atomic_store_rel(&rcu_gen, 1);
+    atomic_store_rel(&percpu_get(rcu_gen), 1);
     __sched_percpu_lock(g_logic_cpu_id);
     schedule();
 }
@@ -213,6 +233,11 @@ int sched_init_percpu()
         return -1;
     }
 
+    if (task_tls_init_percpu() < 0) {
+        log_err("sched: init task TLS failed");
+        return -1;
+    }
+
     void *data_percpu = shm_sched_data_percpu[g_logic_cpu_id];
     log_debug("sched: shm_sched_data_percpu[%d]: %p", current_cpu_id(), data_percpu);
 
@@ -231,16 +256,61 @@ int sched_init_percpu()
     __idle = task;
 
     extern uint32_t *rcu_gen_percpu[USED_CPUS];
-    rcu_gen_percpu[g_logic_cpu_id] = &rcu_gen;
+    rcu_gen_percpu[g_logic_cpu_id] = &percpu_get(rcu_gen);
 
     return 0;
 }
 
+/* the layout of the scheduler region */
+static size_t policy_off, policy_percpu_off, policy_percpu_size;
+static int shm_nr_nodes;
+
+/* Returns the NUMA node for a page of the scheduler region. */
+static int sched_shm_page_node(void *addr)
+{
+    size_t off = (char *)addr - (char *)SHM_SCHED_DATA_HUGE_BASE_ADDR;
+
+    if (off < policy_off)
+        return task_area_node(off % TASK_SIZE_PER_APP, shm_nr_nodes);
+    /* global policy data, e.g. the sq dispatcher on CPU 0 */
+    if (off < policy_percpu_off)
+        return cpu_numa_node(0);
+    return cpu_numa_node((off - policy_percpu_off) / policy_percpu_size);
+}
+
+/*
+ * Maps the scheduler region, each page on the NUMA node of the CPUs that use
+ * it: the runqueues of a CPU on its node, and each app's tasks split between
+ * the nodes (see task_area_node()).
+ *
+ * The task array is only reserved here, the apps populate it 2MB at a time as
+ * they create tasks. It stays on 2MB pages: a 1GB page would be populated as a
+ * whole on the first task creation.
+ */
+static int sched_shm_map_pages(size_t len, size_t task_size)
+{
+    char *base = (char *)SHM_SCHED_DATA_HUGE_BASE_ADDR;
+
+    if (mem_map_shm_file_numa(SHM_SCHED_DATA_HUGE_PATH, base, task_size, PGSIZE_2MB,
+                              sched_shm_page_node, false) != base) {
+        log_err("sched: open shm %s failed", SHM_SCHED_DATA_HUGE_PATH);
+        return -ENOMEM;
+    }
+
+    if (mem_map_shm_file_numa(SHM_SCHED_DATA_POLICY_PATH, base + task_size, len - task_size,
+                              PGSIZE_2MB, sched_shm_page_node, true) != base + task_size) {
+        log_err("sched: open shm %s failed", SHM_SCHED_DATA_POLICY_PATH);
+        return -ENOMEM;
+    }
+
+    log_info("sched: mapped %zu MB on %d nodes", len >> 20, shm_nr_nodes);
+    return 0;
+}
+
 static int sched_shm_map()
 {
-    int i;
-    size_t task_size, policy_size, policy_percpu_size;
-    off_t policy_off, policy_percpu_off;
+    int i, ret;
+    size_t task_size, policy_size;
     size_t huge_pages_size = 0;
 
     task_size = TASK_SIZE_PER_APP * MAX_APPS;
@@ -252,14 +322,11 @@ static int sched_shm_map()
     huge_pages_size += policy_size;
     policy_percpu_off = huge_pages_size;
     huge_pages_size += policy_percpu_size * USED_CPUS;
+    shm_nr_nodes = used_numa_nodes();
 
-    huge_pages_base =
-        mem_map_shm_file(SHM_SCHED_DATA_HUGE_PATH, (void *)SHM_SCHED_DATA_HUGE_BASE_ADDR,
-                         huge_pages_size, PGSIZE_2MB, 0);
-    if (huge_pages_base != (void *)SHM_SCHED_DATA_HUGE_BASE_ADDR) {
-        log_err("sched: open shm %s failed", SHM_SCHED_DATA_HUGE_PATH);
-        return -ENOMEM;
-    }
+    if ((ret = sched_shm_map_pages(huge_pages_size, task_size)) < 0)
+        return ret;
+    huge_pages_base = (void *)SHM_SCHED_DATA_HUGE_BASE_ADDR;
 
     shm_sched_data = (void *)(huge_pages_base + policy_off);
     for (i = 0; i < USED_CPUS; i++)
@@ -280,6 +347,12 @@ int sched_init()
         return ret;
     }
 
+    /* sizes the XSAVE area of the tasks created from now on */
+    if ((ret = xstate_init()) < 0) {
+        log_err("sched: init extended state failed %d", ret);
+        return ret;
+    }
+
     if ((ret = sched_task_init(huge_pages_base + current_app_id() * TASK_SIZE_PER_APP)) < 0) {
         log_err("sched: init task failed %d", ret);
         return ret;
@@ -290,6 +363,11 @@ int sched_init()
         return ret;
     }
 
+    if ((ret = task_tls_init()) < 0) {
+        log_err("sched: init task TLS failed %d", ret);
+        return ret;
+    }
+
     return 0;
 }
 
@@ -317,6 +395,49 @@ int task_spawn(int cpu_id, thread_fn_t fn, void *arg, int stack_size)
     return ret;
 }
 
+/* the number of tasks created before handing them to the policy */
+#define SPAWN_MANY_BATCH 64
+
+/**
+ * task_spawn_many - creates and enqueues one task per argument
+ * @cpu_hint: the CPU to run them on, or -1 to let the policy place them
+ * @fn: the task function
+ * @args: the arguments of @fn, or NULL to pass NULL to every task
+ * @n: the number of tasks
+ *
+ * Tasks are created and handed to the policy in batches, each with
+ * interrupts disabled once. cfs, eevdf and rr take each target runqueue's
+ * lock once per batch.
+ *
+ * Returns the number of tasks spawned, fewer than @n only if out of memory.
+ */
+int task_spawn_many(int cpu_hint, thread_fn_t fn, void **args, int n)
+{
+    struct task *tasks[SPAWN_MANY_BATCH];
+    int i, nr, ret, done = 0;
+    int flags;
+
+    while (done < n) {
+        nr = MIN(n - done, SPAWN_MANY_BATCH);
+        for (i = 0; i < nr; i++) {
+            tasks[i] = task_create(fn, args ? args[done + i] : NULL);
+            if (unlikely(!tasks[i]))
+                break;
+        }
+
+        local_irq_save(flags);
+        ret = __sched_spawn_many(tasks, i, cpu_hint);
+        for (; ret < i; i--) task_free(tasks[i - 1]);
+        local_irq_restore(flags);
+
+        ADD_STAT(LOCAL_SPAWNS, ret);
+        done += ret;
+        if (unlikely(ret < nr))
+            break;
+    }
+    return done;
+}
+
 int task_enqueue(int cpu_id, struct task *task)
 {
     int flags, ret;
@@ -378,11 +499,64 @@ void task_block(spinlock_t *lock)
     local_irq_restore(flags);
 }
 
+/*
+ * Blocks the current task if @word changes from *@old to @new, otherwise stores
+ * the current value into *@old. Whoever observes @new must wake the task up.
+ */
+static bool task_block_cas(uint8_t *word, uint8_t *old, uint8_t new)
+{
+    bool blocked;
+    int flags;
+
+    local_irq_save(flags);
+    __curr->state = TASK_BLOCKED;
+    __curr->stack_busy = true;
+    blocked = __atomic_compare_exchange_n(word, old, new, false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE);
+    if (blocked) {
+        __sched_block();
+        fast_schedule();
+    } else {
+        __curr->state = TASK_RUNNABLE;
+        __curr->stack_busy = false;
+    }
+    local_irq_restore(flags);
+    return blocked;
+}
+
+/* returns true if the exiting task must be kept until it is joined */
+static bool __task_exit_join(struct task *task)
+{
+    uint8_t state = TASK_JOIN_JOINABLE;
+    struct task *joiner;
+    void **slot;
+
+    if (__atomic_compare_exchange_n(&task->join_state, &state, TASK_JOIN_EXITED, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return true;
+
+    if (state == TASK_JOIN_WAITING) {
+        /* hand the return value over and wake the joiner, it never touches us again */
+        joiner = task->joiner;
+        slot = joiner->join_retval;
+        if (slot)
+            *slot = task->join_retval;
+        task_wakeup(joiner);
+    }
+    return false;
+}
+
 static void __task_exit()
 {
+    bool zombie = false;
+
     /* task stack might be freed */
+    __curr->on_cpu = false;
     __sched_finish_task(__curr);
-    if (!__curr->skip_free)
+    if (__curr->join_state != TASK_JOIN_NONE)
+        zombie = __task_exit_join(__curr);
+    /* a zombie may be freed by its joiner from now on */
+    if (!zombie && !__curr->skip_free)
         task_free(__curr);
     __curr = NULL;
 
@@ -396,11 +570,88 @@ static void __task_exit()
  */
 __noreturn void task_exit(void *code)
 {
+    uint8_t state = TASK_JOIN_JOINABLE;
+
     /* disable preemption before scheduling */
     local_irq_disable();
+    __curr->join_retval = code;
+    /*
+     * The policy frees the task after it exits, so it can't be left as a
+     * zombie. Wait here for the joiner to take the return value instead.
+     */
+    if (unlikely(__curr->skip_free && __curr->join_state != TASK_JOIN_NONE))
+        task_block_cas(&__curr->join_state, &state, TASK_JOIN_EXITED);
+    /* the TLS block is freed along with the task */
+    task_tls_switch(__curr, __idle);
     __context_switch_to_fn_nosave(__task_exit, __idle->rsp);
 }
 
+/* frees an exited joinable task, or lets it finish exiting if the policy frees it */
+static void task_release_exited(struct task *task)
+{
+    if (task->skip_free) {
+        task_wakeup(task);
+        return;
+    }
+
+    preempt_disable();
+    task_free(task);
+    preempt_enable();
+}
+
+/**
+ * task_join - waits for a joinable task to exit and frees it
+ * @task: the task created by task_create_joinable()
+ * @retval: if not NULL, receives the return value of @task
+ *
+ * If @task is still running, the caller blocks and @task stores its return
+ * value into @retval and wakes the caller directly when it exits.
+ *
+ * Returns 0 if successful, or -EINVAL if @task is detached or already joined,
+ * or another task is joining it.
+ */
+int task_join(struct task *task, void **retval)
+{
+    uint8_t state = TASK_JOIN_JOINABLE;
+    struct task *self = task_self(), *none = NULL;
+
+    /* only one joiner gets past here, a racing one must not overwrite it */
+    if (!__atomic_compare_exchange_n(&task->joiner, &none, self, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+        return -EINVAL;
+
+    /* both stores are released by the CAS, before the task can see WAITING */
+    self->join_retval = retval;
+    if (task_block_cas(&task->join_state, &state, TASK_JOIN_WAITING))
+        return 0;
+
+    if (unlikely(state != TASK_JOIN_EXITED))
+        return -EINVAL;
+    if (retval)
+        *retval = task->join_retval;
+    task_release_exited(task);
+    return 0;
+}
+
+/**
+ * task_detach - lets a joinable task free itself when it exits
+ * @task: the task created by task_create_joinable()
+ *
+ * Returns 0 if successful, or -EINVAL if @task is detached or already joined.
+ */
+int task_detach(struct task *task)
+{
+    uint8_t state = TASK_JOIN_JOINABLE;
+
+    if (__atomic_compare_exchange_n(&task->join_state, &state, TASK_JOIN_NONE, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+    if (unlikely(state != TASK_JOIN_EXITED))
+        return -EINVAL;
+    task_release_exited(task);
+    return 0;
+}
+
 /* API implementations */
 
 const char *__api sl_sched_policy_name()
@@ -433,6 +684,28 @@ int __api sl_task_spawn_oncpu(int cpu_id, thread_fn_t fn, void *arg, int stack_s
     return task_spawn(cpu_id, fn, arg, stack_size);
 }
 
+/**
+ * sl_task_spawn_many - spawns one task per argument in a single call
+ * @fn: the task function
+ * @args: the arguments of @fn, or NULL to pass NULL to every task
+ * @n: the number of tasks
+ * @cpu_hint: the CPU to run them on, or -1 to spread them over the CPUs
+ *
+ * Cheaper than calling sl_task_spawn() @n times. With -1 the tasks land
+ * where @n calls to sl_task_spawn() would put them: round-robin over the
+ * CPUs for cfs, eevdf and rr, and on the dispatcher's queue for sq. fifo
+ * always fills the local runqueue and leaves the spreading to idle CPUs
+ * stealing from it, so it ignores @cpu_hint.
+ *
+ * Returns the number of tasks spawned, fewer than @n only if out of memory.
+ */
+int __api sl_task_spawn_many(thread_fn_t fn, void **args, int n, int cpu_hint)
+{
+    if (unlikely(!fn || n < 0 || cpu_hint >= USED_CPUS))
+        return -EINVAL;
+    return task_spawn_many(cpu_hint, fn, args, n);
+}
+
 void __api sl_task_yield()
 {
     task_yield();
@@ -443,6 +716,70 @@ __noreturn void __api sl_task_exit(void *code)
     task_exit(code);
 }
 
+int __api sl_task_spawn_joinable(struct task **task, void *(*fn)(void *), void *arg,
+                                 int stack_size)
+{
+    struct task *t;
+    int ret, flags;
+
+    t = task_create_joinable(fn, arg);
+    if (unlikely(!t))
+        return -ENOMEM;
+
+    ADD_STAT(LOCAL_SPAWNS, 1);
+    local_irq_save(flags);
+    ret = __sched_spawn(t, g_logic_cpu_id);
+    if (unlikely(ret)) {
+        log_warn("sched: %s failed to spawn task on %d", __func__, g_logic_cpu_id);
+        task_free(t);
+    } else {
+        *task = t;
+    }
+    local_irq_restore(flags);
+    return ret;
+}
+
+/**
+ * sl_task_spawn_tls - spawns a task with its own thread-local storage
+ * @fn: the task function
+ * @arg: the argument of @fn
+ * @stack_size: unused
+ *
+ * The task sees its own errno, tid and __thread/thread_local variables instead
+ * of those of the kthread it runs on. Each switch into or out of it copies a
+ * few per-kthread variables and reloads FS. Destructors of thread_locals don't
+ * run when the task exits. Link with libshim_malloc, or glibc's malloc thread
+ * cache of every such task is leaked.
+ *
+ * Returns 0 if successful, -ENOMEM, or -EOPNOTSUPP if built without TASK_TLS.
+ */
+int __api sl_task_spawn_tls(thread_fn_t fn, void *arg, int stack_size)
+{
+    struct task *task;
+    int ret;
+
+    task = task_create(fn, arg);
+    if (unlikely(!task))
+        return -ENOMEM;
+
+    ret = task_tls_alloc(task);
+    if (likely(!ret))
+        ret = task_enqueue(g_logic_cpu_id, task);
+    if (unlikely(ret))
+        task_free(task);
+    return ret;
+}
+
+int __api sl_task_join(struct task *task, void **retval)
+{
+    return task_join(task, retval);
+}
+
+int __api sl_task_detach(struct task *task)
+{
+    return task_detach(task);
+}
+
 void __api sl_dump_tasks()
 {
     __sched_dump_tasks();
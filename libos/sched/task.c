@@ -3,6 +3,7 @@
 #include <skyloft/mm.h>
 #include <skyloft/params.h>
 #include <skyloft/percpu.h>
+#include <skyloft/platform.h>
 #include <skyloft/sched/ops.h>
 #include <skyloft/task.h>
 
@@ -21,17 +22,53 @@ static __always_inline void __task_init(struct task *t, struct stack *s)
     extern int g_app_id;
     t->app_id = g_app_id;
     t->stack = s;
+    stack_canary_init(s);
     t->stack_busy = false;
     t->state = TASK_RUNNABLE;
     t->allow_preempt = false;
     t->skip_free = false;
     t->init = true;
+    t->on_cpu = false;
+    t->join_state = TASK_JOIN_NONE;
+    t->arena = NULL;
+#ifdef SKYLOFT_TASK_TLS
+    t->tls_base = 0;
+    t->tls_mem = NULL;
+#endif
+#ifdef SKYLOFT_XSAVE
+    t->xstate_mem = NULL;
+    t->xstate_saved = false;
+#endif
 #if DEBUG
     t->id = atomic_inc(&task_id_allocator);
 #endif
     __sched_init_task(t);
 }
 
+/* the tasks of an app are split evenly between the NUMA nodes, in index order */
+static __always_inline int task_index_node(size_t i, int nr_nodes)
+{
+    return i * nr_nodes / MAX_TASKS_PER_APP;
+}
+
+/**
+ * task_area_node - gets the NUMA node of a page of an app's task area
+ * @off: the offset of the page in the area
+ * @nr_nodes: the number of NUMA nodes in use
+ *
+ * A task and its stack are on the same node.
+ */
+int task_area_node(size_t off, int nr_nodes)
+{
+    size_t tasks_len = MAX_TASKS_PER_APP * sizeof(struct task), i;
+
+    if (off < tasks_len)
+        i = off / sizeof(struct task);
+    else
+        i = (off - tasks_len) / sizeof(struct stack);
+    return task_index_node(MIN(i, (size_t)MAX_TASKS_PER_APP - 1), nr_nodes);
+}
+
 #ifdef SCHED_PERCPU
 
 /* per-CPU task allocator */
@@ -69,16 +106,26 @@ static __always_inline struct task *__task_create(bool _idle)
 
 static __always_inline void __task_free(struct task *t)
 {
-    stack_free(t->stack);
-    tcache_free(&percpu_get(task_percpu), t);
+    int node = current_numa_node();
+
+    /* keep the per-CPU caches node-local, remote memory goes back to its node */
+    if (unlikely(stack_numa_node(t->stack) != node))
+        stack_free_remote(t->stack);
+    else
+        stack_free(t->stack);
+
+    if (unlikely(addr_to_numa_node(t) != node)) {
+        ADD_STAT(REMOTE_FREES, 1);
+        slab_free(&thread_slab, t);
+    } else {
+        tcache_free(&percpu_get(task_percpu), t);
+    }
 }
 
 static __always_inline int __task_alloc_init_percpu()
 {
     tcache_init_percpu(task_tcache, &percpu_get(task_percpu));
-    stack_init_percpu();
-
-    return 0;
+    return stack_init_percpu();
 }
 
 static __always_inline int __task_alloc_init(void *base)
@@ -108,30 +155,126 @@ static __always_inline int __task_alloc_init(void *base)
 
 /* centralized task allocator */
 
-struct task_cache {
-    atomic_int head, tail;
-    struct task *task[MAX_TASKS_PER_APP];
-    struct stack *stack[MAX_TASKS_PER_APP];
+/*
+ * Tasks not cached by any CPU, one pool for each NUMA node. Each task keeps its
+ * stack for good, so the per-CPU magazines only need to hold tasks.
+ *
+ * The task array is populated lazily: a pool that runs out takes the next
+ * TASK_CHUNK_TASKS tasks of its node, whose stacks fill a 2MB page, until it
+ * reaches its share of TASK_POOL_MAX_TASKS.
+ */
+struct task_pool {
+    spinlock_t lock;
+    int nr;
+    /* the tasks of the node that are not populated yet */
+    int next, end;
+    struct task *tasks[MAX_TASKS_PER_APP];
 } __aligned_cacheline;
-BUILD_ASSERT(is_power_of_two(MAX_TASKS_PER_APP));
-#define TASK_CACHE_MASK (MAX_TASKS_PER_APP - 1)
 
-static struct task_cache task_cache;
+#define TASK_CHUNK_TASKS ((int)MAX(PGSIZE_2MB / sizeof(struct stack), 1UL))
+
+/* the magazine links only overwrite t->link */
+BUILD_ASSERT(offsetof(struct task, stack) >= sizeof(struct tcache_hdr));
+
+static struct task_pool task_pools[MAX_NUMA];
+static struct task *task_base;
+static struct stack *task_stack_base;
+static int task_nr_nodes;
+static struct tcache *task_tcache;
+static DEFINE_PERCPU(struct tcache_percpu, task_percpu);
+
+static __always_inline struct task_pool *task_pool_of(struct task *t)
+{
+    return &task_pools[task_index_node(t - task_base, task_nr_nodes)];
+}
+
+/* populates the next chunk of tasks of a pool */
+static int task_pool_grow(struct task_pool *pool)
+{
+    int i, n = MIN(TASK_CHUNK_TASKS, pool->end - pool->next), ret;
+    struct task *t = task_base + pool->next;
+    struct stack *s = task_stack_base + pool->next;
+
+    assert_spin_lock_held(&pool->lock);
+
+    if (n <= 0)
+        return -ENOMEM;
+    if ((ret = mem_populate(t, n * sizeof(*t))) < 0 ||
+        (ret = mem_populate(s, n * sizeof(*s))) < 0) {
+        log_warn_first_n(8, "task: failed to populate %d tasks: %d", n, ret);
+        return ret;
+    }
+
+    /* hand out the lowest addresses first */
+    for (i = n - 1; i >= 0; i--) {
+        t[i].stack = &s[i];
+        pool->tasks[pool->nr++] = &t[i];
+    }
+    pool->next += n;
+    return 0;
+}
+
+static void task_pool_free(struct tcache *tc, int nr, void **items)
+{
+    struct task_pool *pool;
+    bool locked;
+    int i, node;
+
+    /* a magazine may hold tasks of several nodes, take each pool lock once */
+    for (node = 0; node < task_nr_nodes; node++) {
+        pool = &task_pools[node];
+        locked = false;
+        for (i = 0; i < nr; i++) {
+            if (task_pool_of(items[i]) != pool)
+                continue;
+            if (!locked) {
+                spin_lock(&pool->lock);
+                locked = true;
+            }
+            BUG_ON(pool->nr >= MAX_TASKS_PER_APP);
+            pool->tasks[pool->nr++] = items[i];
+        }
+        if (locked)
+            spin_unlock(&pool->lock);
+    }
+}
+
+static int task_pool_alloc(struct tcache *tc, int nr, void **items)
+{
+    int node = current_numa_node(), got = 0, j;
+    struct task_pool *pool;
+
+    /* the local node first, then whatever the others have */
+    for (j = 0; j < task_nr_nodes && got < nr; j++) {
+        pool = &task_pools[(node + j) % task_nr_nodes];
+        spin_lock(&pool->lock);
+        while (pool->nr < nr - got && !task_pool_grow(pool));
+        while (got < nr && pool->nr > 0) items[got++] = pool->tasks[--pool->nr];
+        spin_unlock(&pool->lock);
+    }
+
+    if (likely(got == nr))
+        return 0;
+    task_pool_free(tc, got, items);
+    return -ENOMEM;
+}
+
+static const struct tcache_ops task_pool_ops = {
+    .alloc = task_pool_alloc,
+    .free = task_pool_free,
+};
 
 static __always_inline struct task *__task_create(bool idle)
 {
     struct task *t;
-    struct stack *s;
-    int i;
-
-    assert_local_irq_disabled();
-    BUG_ON(task_cache.head < task_cache.tail);
 
-    i = atomic_inc(&task_cache.head) & TASK_CACHE_MASK;
-    t = task_cache.task[i];
-    s = task_cache.stack[i];
+    preempt_disable();
+    t = tcache_alloc(&percpu_get(task_percpu));
+    preempt_enable();
+    if (unlikely(!t))
+        return NULL;
 
-    __task_init(t, s);
+    __task_init(t, t->stack);
 
     log_debug("%s %p %p %d", __func__, t, t->stack, t->id);
 
@@ -140,19 +283,31 @@ static __always_inline struct task *__task_create(bool idle)
 
 static __always_inline void __task_free(struct task *t)
 {
-    int i = atomic_inc(&task_cache.tail) & TASK_CACHE_MASK;
-    task_cache.stack[i] = t->stack;
-    task_cache.task[i] = t;
+    tcache_free(&percpu_get(task_percpu), t);
 }
 
 static __always_inline int __task_alloc_init(void *base)
 {
-    int i;
-    void *stack_base = base + MAX_TASKS_PER_APP * sizeof(struct task);
+    struct task_pool *pool;
+    int i, max_tasks;
+
+    task_base = base;
+    task_stack_base = base + MAX_TASKS_PER_APP * sizeof(struct task);
+    task_nr_nodes = used_numa_nodes();
+    max_tasks = div_up(MIN(TASK_POOL_MAX_TASKS, MAX_TASKS_PER_APP), task_nr_nodes);
+    for (i = 0; i < task_nr_nodes; i++) {
+        pool = &task_pools[i];
+        spin_lock_init(&pool->lock);
+        /* the first task of each node, see task_index_node() */
+        pool->next = div_up(i * MAX_TASKS_PER_APP, task_nr_nodes);
+        pool->end = MIN(div_up((i + 1) * MAX_TASKS_PER_APP, task_nr_nodes), pool->next + max_tasks);
+    }
 
-    for (i = 0; i < MAX_TASKS_PER_APP; i++) {
-        task_cache.task[i] = base + i * sizeof(struct task);
-        task_cache.stack[i] = stack_base + i * sizeof(struct stack);
+    task_tcache = tcache_create("runtime_tasks", &task_pool_ops, TCACHE_DEFAULT_MAG_SIZE,
+                                sizeof(struct task));
+    if (!task_tcache) {
+        log_err("sched_task_init: failed to create task tcache");
+        return -ENOMEM;
     }
 
     return 0;
@@ -160,25 +315,38 @@ static __always_inline int __task_alloc_init(void *base)
 
 static __always_inline int __task_alloc_init_percpu()
 {
+    tcache_init_percpu(task_tcache, &percpu_get(task_percpu));
     return 0;
 }
 
 #endif
 
-struct task *task_create(thread_fn_t fn, void *arg)
+/* a task with everything it needs to be switched to */
+static __always_inline struct task *task_alloc(bool idle)
+{
+    struct task *t = __task_create(idle);
+
+    if (unlikely(t && task_xstate_alloc(t))) {
+        __task_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static __always_inline struct task *__task_create_fn(uint64_t fn, void *arg)
 {
     uint64_t *rsp;
     struct task *task;
     struct callee_saved *frame;
 
-    task = __task_create(false);
+    task = task_alloc(false);
     if (unlikely(!task))
         return NULL;
 
     rsp = (uint64_t *)stack_top(task->stack);
-    *--rsp = (uint64_t)task_exit;
+    *--rsp = (uint64_t)__task_return;
     frame = (struct callee_saved *)rsp - 1;
-    frame->rip = (uint64_t)fn;
+    frame->rip = fn;
     frame->rdi = (uint64_t)arg;
     frame->rbp = 0;
     task->rsp = (uint64_t)frame;
@@ -186,13 +354,37 @@ struct task *task_create(thread_fn_t fn, void *arg)
     return task;
 }
 
+struct task *task_create(thread_fn_t fn, void *arg)
+{
+    return __task_create_fn((uint64_t)fn, arg);
+}
+
+/**
+ * task_create_joinable - creates a task whose return value can be joined
+ * @fn: the task function
+ * @arg: the argument of @fn
+ *
+ * The return value of @fn (or the code passed to task_exit()) is kept until the
+ * task is joined, and the task isn't freed before it is joined or detached.
+ */
+struct task *task_create_joinable(void *(*fn)(void *), void *arg)
+{
+    struct task *task = __task_create_fn((uint64_t)fn, arg);
+
+    if (likely(task)) {
+        task->join_state = TASK_JOIN_JOINABLE;
+        task->joiner = NULL;
+    }
+    return task;
+}
+
 struct task *task_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
 {
 
     uint64_t rsp, *ptr;
     struct callee_saved *frame;
 
-    struct task *task = __task_create(false);
+    struct task *task = task_alloc(false);
     if (unlikely(!task))
         return NULL;
 
@@ -202,7 +394,7 @@ struct task *task_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
     *buf = (void *)rsp;
 
     ptr = (uint64_t *)rsp;
-    *--ptr = (uint64_t)task_exit;
+    *--ptr = (uint64_t)__task_return;
     frame = (struct callee_saved *)ptr - 1;
     frame->rip = (uint64_t)fn;
     frame->rdi = (uint64_t)*buf;
@@ -216,7 +408,7 @@ struct task *task_create_idle()
 {
     struct task *task;
 
-    task = __task_create(true);
+    task = task_alloc(true);
     if (unlikely(!task))
         return NULL;
 
@@ -228,6 +420,9 @@ struct task *task_create_idle()
 
 void task_free(struct task *t)
 {
+    task_arena_free(t);
+    task_tls_free(t);
+    task_xstate_free(t);
     __task_free(t);
     atomic_dec(&task_count);
 
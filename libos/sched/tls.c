@@ -0,0 +1,242 @@
+/*
+ * tls.c - optional per-task thread-local storage
+ *
+ * Tasks normally share the TLS of the kthread they run on, so errno, glibc's
+ * malloc arena and tcache and application thread_locals leak between them. A
+ * task with a private TLS block gets its own copy of the static TLS of every
+ * module and of the TCB, and FS points to it while the task runs.
+ *
+ * The block is laid out like glibc lays out a thread's: static TLS below the
+ * thread pointer and the TCB (struct pthread) above it. glibc itself fills in
+ * the TLS images and the DTV, as it does in pthread_create(). The TCB is copied
+ * from the kthread so stack guard and pointer guard stay the same. The tid is
+ * replaced by one above any real tid, so the owner checks of recursive and
+ * errorcheck pthread mutexes tell tasks apart. PI and robust mutexes hand the
+ * tid to the kernel and don't work in these tasks.
+ *
+ * glibc's malloc keeps its thread cache and arena in TLS too, and only frees
+ * them when a real thread exits. libshim_malloc runs glibc's malloc on the
+ * kthread's TLS instead (see task_tls_kthread_enter()); without it, every task
+ * leaves the cache behind.
+ *
+ * The libos keeps its per-kthread state in __thread variables too. Those
+ * belong to the kthread and not to the task, so they are copied from the old
+ * block to the new one whenever FS changes. Per-kthread state whose address
+ * is published must not be __thread at all; use DEFINE_PERCPU() instead.
+ */
+
+#ifdef SKYLOFT_TASK_TLS
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/rseq.h>
+
+#include <skyloft/mm.h>
+#include <skyloft/percpu.h>
+#include <skyloft/platform.h>
+#include <skyloft/sched.h>
+#include <skyloft/task.h>
+
+#include <utils/assert.h>
+#include <utils/atomic.h>
+#include <utils/defs.h>
+#include <utils/log.h>
+
+#ifdef SKYLOFT_SCHED_FIFO
+#include <skyloft/sched/policy/fifo.h>
+#endif
+
+#define MAX_KTHREAD_VARS 16
+/* PID_MAX_LIMIT, no real thread gets a tid this high */
+#define TLS_TID_BASE (4 * 1024 * 1024)
+
+/* glibc internals, the same ones libthread_db and pthread_create() use */
+extern const uint32_t _thread_db_sizeof_pthread;
+/* size in bits, count and offset of struct pthread's tid */
+extern const uint32_t _thread_db_pthread_tid[3];
+extern void _dl_get_tls_static_info(size_t *sizep, size_t *alignp);
+extern void *_dl_allocate_tls(void *mem);
+extern void _dl_deallocate_tls(void *tcb, bool dealloc_tcb);
+
+extern __thread int g_logic_cpu_id;
+extern __thread struct task *__curr, *__idle;
+#ifdef SKYLOFT_UINTR
+extern __thread int g_uintr_index;
+#endif
+/* defined by libshim_malloc */
+extern const bool shim_malloc_linked __attribute__((weak));
+
+/* the FS base of this kthread */
+static __thread uint64_t kthread_fsbase;
+
+/* the static TLS area is [tp - tls_below, tp + tcb_size) */
+static size_t tls_below, tcb_size, tls_align;
+
+/* per-kthread variables as offsets from the thread pointer */
+static struct {
+    long off;
+    size_t size;
+} kthread_vars[MAX_KTHREAD_VARS];
+static int nr_kthread_vars;
+static atomic_uint tls_next_tid;
+
+static void tls_add_kthread_var(volatile void *addr, size_t size)
+{
+    BUG_ON(nr_kthread_vars >= MAX_KTHREAD_VARS);
+    kthread_vars[nr_kthread_vars].off = (long)((uint64_t)addr - rdfsbase());
+    kthread_vars[nr_kthread_vars].size = size;
+    nr_kthread_vars++;
+}
+
+#define TLS_KTHREAD_VAR(var) tls_add_kthread_var(&(var), sizeof(var))
+
+int task_tls_init(void)
+{
+    size_t static_size;
+
+    _dl_get_tls_static_info(&static_size, &tls_align);
+    tcb_size = _thread_db_sizeof_pthread;
+    if (static_size <= tcb_size) {
+        log_err("tls: unexpected static TLS size %zu", static_size);
+        return -EINVAL;
+    }
+    tls_below = static_size - tcb_size;
+    if (_thread_db_pthread_tid[0] != sizeof(pid_t) * 8 ||
+        _thread_db_pthread_tid[2] + sizeof(pid_t) > tcb_size) {
+        log_err("tls: unexpected layout of the TCB");
+        return -EINVAL;
+    }
+    tls_align = MAX(tls_align, (size_t)CACHE_LINE_SIZE);
+
+    TLS_KTHREAD_VAR(kthread_fsbase);
+    TLS_KTHREAD_VAR(g_logic_cpu_id);
+    TLS_KTHREAD_VAR(thread_init_done);
+    TLS_KTHREAD_VAR(percpu_ptr);
+    TLS_KTHREAD_VAR(__curr);
+    TLS_KTHREAD_VAR(__idle);
+    TLS_KTHREAD_VAR(localk);
+    TLS_KTHREAD_VAR(preempt_cnt);
+#ifdef SKYLOFT_UINTR
+    TLS_KTHREAD_VAR(g_uintr_index);
+#endif
+#ifdef SKYLOFT_SCHED_FIFO
+    TLS_KTHREAD_VAR(this_rq);
+#endif
+    /* the kernel updates the rseq area of the kthread, sched_getcpu() reads it */
+    if (__rseq_size)
+        tls_add_kthread_var((void *)(rdfsbase() + __rseq_offset), __rseq_size);
+
+    log_info("tls: %zu bytes of static TLS, %zu bytes of TCB", tls_below, tcb_size);
+    if (!&shim_malloc_linked)
+        log_warn("tls: without libshim_malloc, TLS tasks leak glibc's malloc thread cache");
+    return 0;
+}
+
+int task_tls_init_percpu(void)
+{
+    kthread_fsbase = rdfsbase();
+    return 0;
+}
+
+/**
+ * task_tls_alloc - gives a task its own TLS block
+ * @task: the task, which must not have run yet
+ *
+ * Returns 0 if successful, or -ENOMEM.
+ */
+int task_tls_alloc(struct task *task)
+{
+    uint64_t ktp = kthread_fsbase, tp, *word;
+    void *mem, *tcb;
+
+    mem = smalloc(tls_below + tcb_size + tls_align);
+    if (unlikely(!mem))
+        return -ENOMEM;
+
+    tp = align_up((uint64_t)mem + tls_below, tls_align);
+    memcpy((void *)tp, (void *)ktp, tcb_size);
+    /* the TCB points to itself in a few places (tcb, self, specific[0], ...) */
+    for (word = (uint64_t *)tp; word < (uint64_t *)(tp + tcb_size); word++)
+        if (*word >= ktp && *word < ktp + tcb_size)
+            *word = *word - ktp + tp;
+
+    *(pid_t *)(tp + _thread_db_pthread_tid[2]) =
+        TLS_TID_BASE + atomic_fetch_add(&tls_next_tid, 1) % (INT_MAX - TLS_TID_BASE);
+
+    /* install a new DTV and fresh TLS images, may take glibc's locks */
+    preempt_disable();
+    tcb = _dl_allocate_tls((void *)tp);
+    preempt_enable();
+    if (unlikely(!tcb)) {
+        sfree(mem);
+        return -ENOMEM;
+    }
+
+    task->tls_base = tp;
+    task->tls_mem = mem;
+    return 0;
+}
+
+void task_tls_free(struct task *task)
+{
+    if (!task->tls_mem)
+        return;
+
+    preempt_disable();
+    _dl_deallocate_tls((void *)task->tls_base, false);
+    preempt_enable();
+    sfree(task->tls_mem);
+    task->tls_base = 0;
+    task->tls_mem = NULL;
+}
+
+/**
+ * task_tls_kthread_enter - switches to the kthread's TLS for a call into glibc
+ *
+ * Keeps per-thread state that glibc allocates, such as the malloc thread cache,
+ * on the kthread instead of on a task with a private TLS block. Preemption is
+ * disabled until task_tls_kthread_exit().
+ *
+ * Returns the task's TLS base to pass to task_tls_kthread_exit().
+ */
+uint64_t task_tls_kthread_enter(void)
+{
+    uint64_t base;
+
+    preempt_disable();
+    base = __curr ? __curr->tls_base : 0;
+    if (base)
+        __task_tls_switch(base, 0);
+    return base;
+}
+
+/**
+ * task_tls_kthread_exit - switches back to the task's TLS
+ * @base: the return value of task_tls_kthread_enter()
+ */
+void task_tls_kthread_exit(uint64_t base)
+{
+    if (base)
+        __task_tls_switch(0, base);
+    preempt_enable();
+}
+
+/* moves the per-kthread variables to the new block and switches FS to it */
+void __task_tls_switch(uint64_t prev_base, uint64_t next_base)
+{
+    uint64_t kfs = kthread_fsbase;
+    int i;
+
+    if (!prev_base)
+        prev_base = kfs;
+    if (!next_base)
+        next_base = kfs;
+
+    for (i = 0; i < nr_kthread_vars; i++)
+        memcpy((void *)(next_base + kthread_vars[i].off),
+               (void *)(prev_base + kthread_vars[i].off), kthread_vars[i].size);
+    wrfsbase(next_base);
+}
+
+#endif /* SKYLOFT_TASK_TLS */
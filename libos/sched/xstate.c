@@ -0,0 +1,190 @@
+/*
+ * xstate.c - lazy saving of extended (x87, SSE, AVX, AVX-512) state
+ *
+ * The preemptive policies build the libos without SSE, so a kthread's vector
+ * registers belong to the task it runs. They are saved when the task is
+ * switched out, but only if XINUSE (XGETBV with ECX=1) reports a component
+ * that isn't in its initial configuration; tasks that never touch vector
+ * registers pay for a single XGETBV. XSAVEC (or XSAVEOPT) further skips the
+ * components that are in use by nobody, e.g. the upper halves of the ZMM
+ * registers after VZEROUPPER.
+ *
+ * The save area is sized from CPUID and allocated when the task is created:
+ * nothing on the switch path may allocate or call libc, which is free to use
+ * the vector registers that are about to be saved.
+ */
+
+#ifdef SKYLOFT_XSAVE
+
+#include <cpuid.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <skyloft/mm.h>
+#include <skyloft/task.h>
+
+#include <utils/defs.h>
+#include <utils/fxsave.h>
+#include <utils/log.h>
+
+#define XSAVE_ALIGN        64
+#define XSAVE_HDR_OFFSET   512
+#define XSAVE_HDR_SIZE     64
+#define XCOMP_BV_COMPACT   (1UL << 63)
+/* the kthread's protection keys, which are never in their initial state */
+#define XFEATURE_MASK_PKRU (1UL << 9)
+/* AMX tiles need permission from the kernel, tasks are not allowed to use them */
+#define XFEATURE_MASK_AMX  (3UL << 17)
+
+/* CPUID leaf 0xd, sub-leaf 1, EAX */
+#define CPUID_XSAVE       0xd
+#define CPUID_D1_XSAVEOPT (1U << 0)
+#define CPUID_D1_XSAVEC   (1U << 1)
+#define CPUID_D1_XINUSE   (1U << 2)
+
+enum xsave_insn {
+    XSAVE_PLAIN,
+    XSAVE_OPT,
+    XSAVE_COMPACT,
+};
+
+struct xsave_hdr {
+    uint64_t xstate_bv;
+    uint64_t xcomp_bv;
+    uint64_t reserved[6];
+};
+BUILD_ASSERT(sizeof(struct xsave_hdr) == XSAVE_HDR_SIZE);
+
+uint64_t xstate_mask;
+bool xstate_has_xinuse;
+static enum xsave_insn xsave_insn;
+static size_t xstate_size;
+/* all components in their initial configuration */
+static void *xstate_init_area;
+
+static __always_inline void *task_xstate_area(struct task *t)
+{
+    return (void *)align_up((uintptr_t)t->xstate_mem, XSAVE_ALIGN);
+}
+
+static size_t xstate_calc_size(bool compact)
+{
+    unsigned int eax, ebx, ecx, edx;
+    size_t size = XSAVE_HDR_OFFSET + XSAVE_HDR_SIZE;
+    int i;
+
+    for (i = 2; i < 64; i++) {
+        if (!(xstate_mask & (1UL << i)))
+            continue;
+        __cpuid_count(CPUID_XSAVE, i, eax, ebx, ecx, edx);
+        if (compact) {
+            /* ECX[1]: the component is 64-byte aligned in the compacted format */
+            if (ecx & 2)
+                size = align_up(size, XSAVE_ALIGN);
+            size += eax;
+        } else {
+            size = MAX(size, (size_t)ebx + eax);
+        }
+    }
+    return size;
+}
+
+/**
+ * xstate_init - detects XSAVE support and sizes the save area
+ *
+ * Returns 0 if successful, -EOPNOTSUPP, or -ENOMEM.
+ */
+int xstate_init(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    struct xsave_hdr *hdr;
+
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_OSXSAVE)) {
+        log_err("xstate: XSAVE is not enabled by the OS");
+        return -EOPNOTSUPP;
+    }
+
+    xstate_mask = xgetbv(0) & ~(XFEATURE_MASK_PKRU | XFEATURE_MASK_AMX);
+    __cpuid_count(CPUID_XSAVE, 1, eax, ebx, ecx, edx);
+    if (eax & CPUID_D1_XSAVEC)
+        xsave_insn = XSAVE_COMPACT;
+    else if (eax & CPUID_D1_XSAVEOPT)
+        xsave_insn = XSAVE_OPT;
+    else
+        xsave_insn = XSAVE_PLAIN;
+    xstate_has_xinuse = eax & CPUID_D1_XINUSE;
+    xstate_size = xstate_calc_size(xsave_insn == XSAVE_COMPACT);
+
+    xstate_init_area = aligned_alloc(XSAVE_ALIGN, align_up(xstate_size, XSAVE_ALIGN));
+    if (!xstate_init_area)
+        return -ENOMEM;
+    memset(xstate_init_area, 0, xstate_size);
+    /* XRSTOR loads MXCSR even for components it initializes */
+    fxstate_init(xstate_init_area);
+    hdr = xstate_init_area + XSAVE_HDR_OFFSET;
+    if (xsave_insn == XSAVE_COMPACT)
+        hdr->xcomp_bv = XCOMP_BV_COMPACT | xstate_mask;
+
+    log_info("xstate: components %#lx, %zu bytes, %s%s", xstate_mask, xstate_size,
+             xsave_insn == XSAVE_COMPACT ? "xsavec" : xsave_insn == XSAVE_OPT ? "xsaveopt" : "xsave",
+             xstate_has_xinuse ? ", xinuse" : "");
+    return 0;
+}
+
+/**
+ * task_xstate_alloc - allocates the XSAVE area of a new task
+ * @t: the task
+ *
+ * Returns 0 if successful, or -ENOMEM.
+ */
+int task_xstate_alloc(struct task *t)
+{
+    t->xstate_mem = smalloc(xstate_size + XSAVE_ALIGN - 1);
+    if (unlikely(!t->xstate_mem))
+        return -ENOMEM;
+    /* XRSTOR faults on garbage in the reserved parts of the header */
+    memset(task_xstate_area(t) + XSAVE_HDR_OFFSET, 0, XSAVE_HDR_SIZE);
+    return 0;
+}
+
+/* saves the state of a task that is using some component */
+void __task_xstate_save(struct task *t)
+{
+    uint32_t lo = xstate_mask, hi = xstate_mask >> 32;
+    void *area = task_xstate_area(t);
+
+    switch (xsave_insn) {
+    case XSAVE_COMPACT:
+        asm volatile("xsavec64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    case XSAVE_OPT:
+        asm volatile("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    default:
+        asm volatile("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    }
+}
+
+/* restores the saved state of a task, or the initial state if it has none */
+void __task_xstate_restore(struct task *t)
+{
+    uint32_t lo = xstate_mask, hi = xstate_mask >> 32;
+    void *area = t->xstate_saved ? task_xstate_area(t) : xstate_init_area;
+
+    asm volatile("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+}
+
+void task_xstate_free(struct task *t)
+{
+    if (!t->xstate_mem)
+        return;
+
+    sfree(t->xstate_mem);
+    t->xstate_mem = NULL;
+    t->xstate_saved = false;
+}
+
+#endif /* SKYLOFT_XSAVE */
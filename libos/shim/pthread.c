@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stdlib.h>
 
 #include <skyloft/sched.h>
 #include <skyloft/sync/sync.h>
@@ -6,98 +7,47 @@
 #include <skyloft/uapi/pthread.h>
 #include <skyloft/uapi/task.h>
 #include <utils/assert.h>
+#include <utils/atomic.h>
 #include <utils/defs.h>
 #include <utils/log.h>
 #include <utils/spinlock.h>
 
-struct join_handle {
-    void *(*fn)(void *);
-    void *args;
-    void *retval;
-    spinlock_t lock;
-    struct task *waiter;
-    bool detached;
-};
-
-static void __trampoline(void *arg)
-{
-    struct join_handle *j = arg;
-
-    j->retval = j->fn(j->args);
-    spin_lock_np(&j->lock);
-    if (j->detached) {
-        spin_unlock_np(&j->lock);
-        return;
-    }
-
-    if (j->waiter)
-        task_wakeup(j->waiter);
-
-    j->waiter = task_self();
-    task_block(&j->lock);
-}
-
 int sl_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*fn)(void *), void *arg)
 {
-    struct join_handle **handle = (struct join_handle **)thread;
-    struct join_handle *j;
     struct task *task;
 
-    task = task_create_with_buf(__trampoline, (void **)&j, sizeof(struct join_handle));
+    task = task_create_joinable(fn, arg);
     if (unlikely(!task))
         return -ENOMEM;
 
-    j->fn = fn;
-    j->args = arg;
-    spin_lock_init(&j->lock);
-    j->waiter = NULL;
-    j->detached = false;
-
-    if (handle)
-        *handle = j;
+#ifdef SKYLOFT_TASK_TLS
+    /* pthreads expect their own errno and thread_locals */
+    if (unlikely(task_tls_alloc(task))) {
+        task_free(task);
+        return -ENOMEM;
+    }
+#endif
 
     if (unlikely(task_enqueue(current_cpu_id(), task))) {
         task_free(task);
         return -EAGAIN;
     }
 
+    if (thread)
+        *thread = (pthread_t)task;
+    else
+        task_detach(task);
     return 0;
 }
 
 int sl_pthread_join(pthread_t thread, void **retval)
 {
-    struct join_handle *j = (struct join_handle *)thread;
-
-    spin_lock_np(&j->lock);
-    if (j->detached) {
-        spin_unlock_np(&j->lock);
-        return -EINVAL;
-    }
-    if (j->waiter == NULL) {
-        j->waiter = task_self();
-        task_block(&j->lock);
-        spin_lock_np(&j->lock);
-    }
-    if (retval)
-        *retval = j->retval;
-    spin_unlock_np(&j->lock);
-    return 0;
+    return task_join((struct task *)thread, retval);
 }
 
 int sl_pthread_detach(pthread_t thread)
 {
-    struct join_handle *j = (struct join_handle *)thread;
-
-    spin_lock_np(&j->lock);
-    if (j->detached) {
-        spin_unlock_np(&j->lock);
-        return -EINVAL;
-    }
-    j->detached = true;
-    if (j->waiter)
-        task_wakeup(j->waiter);
-    spin_unlock_np(&j->lock);
-    return 0;
+    return task_detach((struct task *)thread);
 }
 
 int sl_pthread_yield(void)
@@ -108,7 +58,7 @@ int sl_pthread_yield(void)
 
 pthread_t sl_pthread_self()
 {
-    return align_down(stack_top(task_self()->stack) - sizeof(struct join_handle), RSP_ALIGNMENT);
+    return (pthread_t)task_self();
 }
 
 void __attribute__((noreturn)) sl_pthread_exit(void *retval)
@@ -116,6 +66,8 @@ void __attribute__((noreturn)) sl_pthread_exit(void *retval)
     task_exit(retval);
 }
 
+BUILD_ASSERT(sizeof(mutex_t) <= sizeof(pthread_mutex_t));
+
 int sl_pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *mutexattr)
 {
     mutex_init((mutex_t *)mutex);
@@ -172,4 +124,88 @@ int sl_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 int sl_pthread_cond_destroy(pthread_cond_t *cond)
 {
     return 0;
-}
\ No newline at end of file
+}
+
+BUILD_ASSERT(sizeof(rwmutex_t) <= sizeof(pthread_rwlock_t));
+
+static DEFINE_SPINLOCK(rwlock_init_lock);
+
+/* PTHREAD_RWLOCK_INITIALIZER leaves the lock zeroed, so set it up on first use */
+static rwmutex_t *to_rwmutex(pthread_rwlock_t *rwlock)
+{
+    rwmutex_t *m = (rwmutex_t *)rwlock;
+    struct rwmutex_percpu *percpu;
+
+    if (likely(atomic_load_acq(&m->percpu)))
+        return m;
+
+    /* allocate outside the lock, the loser of a race frees its block */
+    percpu = rwmutex_alloc_percpu();
+    if (!percpu)
+        return NULL;
+
+    spin_lock_np(&rwlock_init_lock);
+    if (!m->percpu) {
+        __rwmutex_init(m, percpu);
+        percpu = NULL;
+    }
+    spin_unlock_np(&rwlock_init_lock);
+    free(percpu);
+    return m;
+}
+
+int sl_pthread_rwlock_init(pthread_rwlock_t *__restrict rwlock,
+                           const pthread_rwlockattr_t *__restrict attr)
+{
+    return -rwmutex_init((rwmutex_t *)rwlock);
+}
+
+int sl_pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
+{
+    rwmutex_t *m = to_rwmutex(rwlock);
+
+    if (unlikely(!m))
+        return ENOMEM;
+    rwmutex_rdlock(m);
+    return 0;
+}
+
+int sl_pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
+{
+    rwmutex_t *m = to_rwmutex(rwlock);
+
+    if (unlikely(!m))
+        return ENOMEM;
+    return rwmutex_try_rdlock(m) ? 0 : EBUSY;
+}
+
+int sl_pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
+{
+    rwmutex_t *m = to_rwmutex(rwlock);
+
+    if (unlikely(!m))
+        return ENOMEM;
+    rwmutex_wrlock(m);
+    return 0;
+}
+
+int sl_pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)
+{
+    rwmutex_t *m = to_rwmutex(rwlock);
+
+    if (unlikely(!m))
+        return ENOMEM;
+    return rwmutex_try_wrlock(m) ? 0 : EBUSY;
+}
+
+int sl_pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+    rwmutex_unlock((rwmutex_t *)rwlock);
+    return 0;
+}
+
+int sl_pthread_rwlock_destroy(pthread_rwlock_t *rwlock)
+{
+    rwmutex_destroy((rwmutex_t *)rwlock);
+    return 0;
+}
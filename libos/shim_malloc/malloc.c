@@ -0,0 +1,203 @@
+/*
+ * malloc.c - replaces the C library's malloc() with smalloc()
+ *
+ * Linking with libshim_malloc serves malloc() and friends from the per-CPU
+ * caches of smalloc() instead of glibc's arenas, whose locks and thread caches
+ * belong to kthreads and not to the tasks that migrate between them.
+ *
+ * Sizes up to SMALLOC_MAX_SIZE go to smalloc() on kthreads of the libos.
+ * Larger sizes, and everything allocated before sl_libos_start() has set up
+ * the kthread or on threads that aren't kthreads, fall back to glibc, which
+ * serves large sizes straight from mmap(). free() tells the two apart by
+ * address since smalloc() items always live in the page region. glibc always
+ * runs on the kthread's TLS, so tasks with a private TLS block (TASK_TLS) don't
+ * each get a thread cache and arena that nothing frees.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <skyloft/mm/page.h>
+#include <skyloft/mm/smalloc.h>
+#include <skyloft/percpu.h>
+#include <skyloft/task.h>
+
+#include <utils/defs.h>
+
+/* the alignment malloc() guarantees */
+#define MALLOC_ALIGN 16
+
+/* glibc's allocator, exported for exactly this purpose */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static size_t (*libc_malloc_usable_size)(void *ptr);
+
+/* tells task_tls_init() that glibc's malloc runs on the kthread's TLS */
+const bool shim_malloc_linked = true;
+
+/* calls into glibc's allocator on the kthread's TLS, errno goes to the task */
+#define LIBC_ALLOC(call)                           \
+    ({                                             \
+        uint64_t __tls = task_tls_kthread_enter(); \
+        void *__ptr = (call);                      \
+        task_tls_kthread_exit(__tls);              \
+        if (unlikely(__tls && !__ptr))             \
+            errno = ENOMEM;                        \
+        __ptr;                                     \
+    })
+
+/* only kthreads of the libos have per-CPU caches */
+static __always_inline bool use_smalloc(size_t size)
+{
+    return size <= SMALLOC_MAX_SIZE && likely(thread_init_done);
+}
+
+static __always_inline bool is_smalloc_addr(void *ptr)
+{
+    return is_page_addr(ptr);
+}
+
+void *malloc(size_t size)
+{
+    void *ptr;
+
+    if (use_smalloc(size)) {
+        ptr = smalloc(size);
+        if (likely(ptr))
+            return ptr;
+    }
+    return LIBC_ALLOC(__libc_malloc(size));
+}
+
+void free(void *ptr)
+{
+    uint64_t tls;
+
+    if (unlikely(!ptr))
+        return;
+
+    if (is_smalloc_addr(ptr)) {
+        if (likely(thread_init_done))
+            sfree(ptr);
+        else
+            sfree_nocache(ptr);
+        return;
+    }
+    tls = task_tls_kthread_enter();
+    __libc_free(ptr);
+    task_tls_kthread_exit(tls);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t total;
+    void *ptr;
+
+    if (unlikely(__builtin_mul_overflow(nmemb, size, &total))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (use_smalloc(total)) {
+        ptr = smalloc(total);
+        if (likely(ptr)) {
+            memset(ptr, 0, total);
+            return ptr;
+        }
+    }
+    return LIBC_ALLOC(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    size_t old_size;
+    void *new_ptr;
+
+    if (!ptr)
+        return malloc(size);
+    /* glibc's blocks stay with glibc */
+    if (!is_smalloc_addr(ptr))
+        return LIBC_ALLOC(__libc_realloc(ptr, size));
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    old_size = smalloc_usable_size(ptr);
+    if (size <= old_size)
+        return ptr;
+
+    new_ptr = malloc(size);
+    if (unlikely(!new_ptr))
+        return NULL;
+    memcpy(new_ptr, ptr, old_size);
+    free(ptr);
+    return new_ptr;
+}
+
+static void *__memalign(size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align <= MALLOC_ALIGN)
+        return malloc(size);
+
+    if (is_power_of_two(align) && use_smalloc(size)) {
+        ptr = smalloc_aligned(size, align);
+        if (likely(ptr))
+            return ptr;
+    }
+    return LIBC_ALLOC(__libc_memalign(align, size));
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align % sizeof(void *) || !is_power_of_two(align))
+        return EINVAL;
+
+    ptr = __memalign(align, size);
+    if (unlikely(!ptr))
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return __memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return __memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+    return __memalign(PGSIZE_4KB, size);
+}
+
+void *pvalloc(size_t size)
+{
+    return __memalign(PGSIZE_4KB, align_up(size, PGSIZE_4KB));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (!ptr)
+        return 0;
+    if (is_smalloc_addr(ptr))
+        return smalloc_usable_size(ptr);
+
+    if (unlikely(!libc_malloc_usable_size))
+        libc_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    return libc_malloc_usable_size(ptr);
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 
 #include <skyloft/io.h>
+#include <skyloft/mm/stack.h>
 #include <skyloft/stat.h>
 #include <utils/defs.h>
 #include <utils/log.h>
@@ -17,4 +18,5 @@ void print_stats(void)
         for (j = 0; j < STAT_NR; j++) printf("%16ld", proc->all_ks[i].stats[j]);
         printf("\n");
     }
+    stack_print_stats();
 }
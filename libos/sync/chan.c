@@ -0,0 +1,745 @@
+/*
+ * chan.c - support for bounded channels
+ *
+ * Items are stored in a lock-free bounded MPMC ring with per-slot sequence
+ * numbers, indexed with a head, a tail and a mask like utils/queue.h. Sending
+ * to a ring that is not full or receiving from a ring that is not empty never
+ * takes a lock. Tasks that can't make progress park on per-channel waiter lists
+ * protected by a spin lock, and a sender that finds a parked receiver (or vice
+ * versa) hands the item over directly.
+ *
+ * Every blocking operation is a select over one or more cases: the selecting
+ * task queues one waiter per case, and the first channel that claims the shared
+ * select state completes the operation and wakes the task.
+ *
+ * Closing fails new sends at once, but receivers only report the close after
+ * every lock-free push that passed its closed check has published its item, so
+ * a send that succeeds is always received.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <skyloft/sched.h>
+#include <skyloft/sync/sync.h>
+#include <skyloft/task.h>
+#include <skyloft/uapi/chan.h>
+#include <utils/atomic.h>
+#include <utils/defs.h>
+#include <utils/list.h>
+#include <utils/spinlock.h>
+#include <utils/time.h>
+
+struct chan_slot {
+    unsigned int seq;
+    void *item;
+};
+
+struct sl_chan {
+    /* consumer index */
+    unsigned int head __aligned_cacheline;
+    /* producer index */
+    unsigned int tail __aligned_cacheline;
+    /* lock-free pushes in progress, see chan_push_begin() */
+    int nr_pushing;
+
+    /* protects the waiter lists */
+    spinlock_t lock __aligned_cacheline;
+    /* sends fail */
+    bool closed;
+    /* no send can complete anymore, receivers may report the close */
+    bool sends_done;
+    unsigned int mask;
+    struct chan_slot *slots;
+    int nr_recv_waiters;
+    int nr_send_waiters;
+    struct list_head recv_waiters;
+    struct list_head send_waiters;
+};
+
+enum {
+    CHAN_PENDING = 0,
+    CHAN_DONE,
+    CHAN_CLOSED,
+    CHAN_RETRY,
+};
+
+struct chan_select {
+    spinlock_t lock;
+    struct task *task;
+    /* index + 1 of the case that was claimed */
+    int fired;
+    bool parked;
+    /* the claimer no longer touches this select */
+    bool handled;
+};
+
+struct chan_waiter {
+    struct list_node link;
+    struct chan_select *sel;
+    void *item;
+    int idx;
+    int result;
+    bool queued;
+};
+
+/*
+ * Lock-free ring
+ */
+
+static int chan_ring_push(struct sl_chan *c, void *item)
+{
+    struct chan_slot *slot;
+    unsigned int pos;
+    int diff;
+
+    if (unlikely(!c->slots))
+        return -EAGAIN;
+
+    pos = atomic_load_relax(&c->tail);
+    while (true) {
+        slot = &c->slots[pos & c->mask];
+        diff = (int)(atomic_load_acq(&slot->seq) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&c->tail, &pos, pos + 1, false, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -EAGAIN;
+        } else {
+            pos = atomic_load_relax(&c->tail);
+        }
+    }
+
+    slot->item = item;
+    atomic_store_rel(&slot->seq, pos + 1);
+    return 0;
+}
+
+static int chan_ring_pop(struct sl_chan *c, void **item)
+{
+    struct chan_slot *slot;
+    unsigned int pos;
+    int diff;
+
+    if (unlikely(!c->slots))
+        return -EAGAIN;
+
+    pos = atomic_load_relax(&c->head);
+    while (true) {
+        slot = &c->slots[pos & c->mask];
+        diff = (int)(atomic_load_acq(&slot->seq) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&c->head, &pos, pos + 1, false, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -EAGAIN;
+        } else {
+            pos = atomic_load_relax(&c->head);
+        }
+    }
+
+    *item = slot->item;
+    atomic_store_rel(&slot->seq, pos + c->mask + 1);
+    return 0;
+}
+
+static void chan_push_end(struct sl_chan *c)
+{
+    __atomic_fetch_sub(&c->nr_pushing, 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+/*
+ * Announces a push without the channel lock, so that sl_chan_close() waits for
+ * it. Returns false if the channel is closed.
+ */
+static bool chan_push_begin(struct sl_chan *c)
+{
+    preempt_disable();
+    /* pairs with the store of closed in sl_chan_close() */
+    __atomic_fetch_add(&c->nr_pushing, 1, __ATOMIC_SEQ_CST);
+    if (likely(!__atomic_load_n(&c->closed, __ATOMIC_SEQ_CST)))
+        return true;
+    chan_push_end(c);
+    return false;
+}
+
+/*
+ * Waiters
+ */
+
+/* pops the first waiter whose select has not fired yet and claims it */
+static struct chan_waiter *chan_claim_waiter(struct list_head *waiters, int *nr)
+{
+    struct chan_waiter *w;
+
+    while ((w = list_pop(waiters, struct chan_waiter, link))) {
+        w->queued = false;
+        (*nr)--;
+        if (__sync_bool_compare_and_swap(&w->sel->fired, 0, w->idx + 1))
+            return w;
+    }
+
+    return NULL;
+}
+
+/* completes a claimed waiter, which may go away as soon as this returns */
+static void chan_complete(struct chan_waiter *w, int result)
+{
+    struct chan_select *sel = w->sel;
+    struct task *task;
+    bool parked;
+
+    w->result = result;
+    spin_lock_np(&sel->lock);
+    parked = sel->parked;
+    task = sel->task;
+    spin_unlock_np(&sel->lock);
+    atomic_store_rel(&sel->handled, true);
+
+    if (parked)
+        task_wakeup(task);
+}
+
+/* must hold the channel lock */
+static bool __chan_handoff_send(struct sl_chan *c, void *item)
+{
+    struct chan_waiter *w = chan_claim_waiter(&c->recv_waiters, &c->nr_recv_waiters);
+
+    if (!w)
+        return false;
+    w->item = item;
+    chan_complete(w, CHAN_DONE);
+    return true;
+}
+
+/* must hold the channel lock */
+static bool __chan_handoff_recv(struct sl_chan *c, void **item)
+{
+    struct chan_waiter *w = chan_claim_waiter(&c->send_waiters, &c->nr_send_waiters);
+
+    if (!w)
+        return false;
+    *item = w->item;
+    chan_complete(w, CHAN_DONE);
+    return true;
+}
+
+/* must hold the channel lock */
+static void __chan_wake_receivers(struct sl_chan *c, int nr)
+{
+    struct chan_waiter *w;
+    int result;
+
+    while (nr-- > 0 && (w = chan_claim_waiter(&c->recv_waiters, &c->nr_recv_waiters))) {
+        result = chan_ring_pop(c, &w->item) ? CHAN_RETRY : CHAN_DONE;
+        chan_complete(w, result);
+    }
+}
+
+/* must hold the channel lock */
+static void __chan_wake_senders(struct sl_chan *c, int nr)
+{
+    struct chan_waiter *w;
+    int result;
+
+    while (nr-- > 0 && (w = chan_claim_waiter(&c->send_waiters, &c->nr_send_waiters))) {
+        result = chan_ring_push(c, w->item) ? CHAN_RETRY : CHAN_DONE;
+        chan_complete(w, result);
+    }
+}
+
+/* passes @nr items that were just pushed to receivers that parked meanwhile */
+static void chan_wake_receivers(struct sl_chan *c, int nr)
+{
+    /* pairs with the waiter count increment in sl_chan_select() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (likely(!ACCESS_ONCE(c->nr_recv_waiters)))
+        return;
+
+    spin_lock_np(&c->lock);
+    __chan_wake_receivers(c, nr);
+    spin_unlock_np(&c->lock);
+}
+
+/* fills @nr slots that were just freed with items of parked senders */
+static void chan_wake_senders(struct sl_chan *c, int nr)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (likely(!ACCESS_ONCE(c->nr_send_waiters)))
+        return;
+
+    spin_lock_np(&c->lock);
+    __chan_wake_senders(c, nr);
+    spin_unlock_np(&c->lock);
+}
+
+/*
+ * Select
+ */
+
+/**
+ * chan_try_case - attempts a select case without blocking
+ * @cs: the case
+ * @locked: whether the caller holds the channel lock
+ *
+ * Returns true if the case completed.
+ */
+static bool chan_try_case(struct sl_chan_case *cs, bool locked)
+{
+    struct sl_chan *c = cs->chan;
+    bool done, sends_done;
+
+    if (cs->op == SL_CHAN_SEND) {
+        /* the channel lock keeps sl_chan_close() out */
+        if (unlikely(locked ? ACCESS_ONCE(c->closed) : !chan_push_begin(c))) {
+            cs->ok = false;
+            return true;
+        }
+
+        if (ACCESS_ONCE(c->nr_recv_waiters)) {
+            if (!locked)
+                spin_lock_np(&c->lock);
+            done = __chan_handoff_send(c, cs->item);
+            if (!locked)
+                spin_unlock_np(&c->lock);
+            if (done)
+                goto sent;
+        }
+
+        done = chan_ring_push(c, cs->item) == 0;
+        if (!locked)
+            chan_push_end(c);
+        if (!done)
+            return false;
+        if (locked)
+            __chan_wake_receivers(c, 1);
+        else
+            chan_wake_receivers(c, 1);
+    } else {
+        /* items published before the close finished are visible to the pops */
+        sends_done = atomic_load_acq(&c->sends_done);
+        if (chan_ring_pop(c, &cs->item) == 0) {
+            if (locked)
+                __chan_wake_senders(c, 1);
+            else
+                chan_wake_senders(c, 1);
+            goto out;
+        }
+
+        if (ACCESS_ONCE(c->nr_send_waiters)) {
+            if (!locked)
+                spin_lock_np(&c->lock);
+            done = __chan_handoff_recv(c, &cs->item);
+            if (!locked)
+                spin_unlock_np(&c->lock);
+            if (done)
+                goto out;
+        }
+
+        if (!sends_done)
+            return false;
+        cs->item = NULL;
+        cs->ok = false;
+        return true;
+    }
+
+out:
+    cs->ok = true;
+    return true;
+
+sent:
+    if (!locked)
+        chan_push_end(c);
+    goto out;
+}
+
+/* locks each distinct channel of @cases in address order */
+static int chan_lock_all(struct sl_chan_case *cases, int n, struct sl_chan **chans)
+{
+    struct sl_chan *c;
+    int i, j, nr = 0;
+
+    for (i = 0; i < n; i++) {
+        c = cases[i].chan;
+        for (j = nr; j > 0 && chans[j - 1] > c; j--) chans[j] = chans[j - 1];
+        if (j > 0 && chans[j - 1] == c) {
+            memmove(&chans[j], &chans[j + 1], sizeof(*chans) * (nr - j));
+            continue;
+        }
+        chans[j] = c;
+        nr++;
+    }
+
+    for (i = 0; i < nr; i++) spin_lock_np(&chans[i]->lock);
+    return nr;
+}
+
+static void chan_unlock_all(struct sl_chan **chans, int nr)
+{
+    while (nr-- > 0) spin_unlock_np(&chans[nr]->lock);
+}
+
+/* must hold the locks of all channels in @cases */
+static void chan_dequeue_all(struct sl_chan_case *cases, struct chan_waiter *waiters, int n)
+{
+    struct chan_waiter *w;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        w = &waiters[i];
+        if (!w->queued)
+            continue;
+        list_del(&w->link);
+        w->queued = false;
+        if (cases[i].op == SL_CHAN_SEND)
+            cases[i].chan->nr_send_waiters--;
+        else
+            cases[i].chan->nr_recv_waiters--;
+    }
+}
+
+/* must hold the locks of all channels in @cases */
+static void chan_enqueue_all(struct sl_chan_case *cases, struct chan_waiter *waiters, int n,
+                             struct chan_select *sel)
+{
+    struct sl_chan *c;
+    struct chan_waiter *w;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        c = cases[i].chan;
+        w = &waiters[i];
+        w->sel = sel;
+        w->item = cases[i].item;
+        w->idx = i;
+        w->result = CHAN_PENDING;
+        w->queued = true;
+
+        /* the atomic increment orders it before the ring is rechecked */
+        if (cases[i].op == SL_CHAN_SEND) {
+            list_add_tail(&c->send_waiters, &w->link);
+            __atomic_fetch_add(&c->nr_send_waiters, 1, __ATOMIC_SEQ_CST);
+        } else {
+            list_add_tail(&c->recv_waiters, &w->link);
+            __atomic_fetch_add(&c->nr_recv_waiters, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+/**
+ * sl_chan_select - performs one of several channel operations
+ * @cases: the send and receive cases
+ * @n: the number of cases (at most SL_CHAN_SELECT_MAX)
+ * @block: whether to wait until one of the cases can complete
+ *
+ * Exactly one case is performed. For a receive, the item is stored in the
+ * case. The ok field of the case is false if its channel was closed.
+ *
+ * Returns the index of the completed case, -EAGAIN if @block is false and no
+ * case is ready, or -EINVAL.
+ */
+int __api sl_chan_select(struct sl_chan_case *cases, int n, bool block)
+{
+    struct chan_waiter waiters[SL_CHAN_SELECT_MAX];
+    struct sl_chan *chans[SL_CHAN_SELECT_MAX];
+    struct sl_chan_case *cs;
+    struct chan_select sel;
+    struct chan_waiter *w;
+    int i, idx, start, nr_chans;
+
+    if (unlikely(n <= 0 || n > SL_CHAN_SELECT_MAX))
+        return -EINVAL;
+
+again:
+    /* poll the cases from a varying start so that no case starves */
+    start = n > 1 ? now_tsc() % n : 0;
+    for (i = 0; i < n; i++) {
+        idx = (start + i) % n;
+        if (chan_try_case(&cases[idx], false))
+            return idx;
+    }
+    if (!block)
+        return -EAGAIN;
+
+    nr_chans = chan_lock_all(cases, n, chans);
+    for (idx = 0; idx < n; idx++) {
+        if (chan_try_case(&cases[idx], true)) {
+            chan_unlock_all(chans, nr_chans);
+            return idx;
+        }
+    }
+
+    spin_lock_init(&sel.lock);
+    sel.task = task_self();
+    sel.fired = 0;
+    sel.parked = false;
+    sel.handled = false;
+    chan_enqueue_all(cases, waiters, n, &sel);
+
+    /* lock-free peers may have touched a ring before seeing our waiters */
+    for (idx = 0; idx < n; idx++) {
+        cs = &cases[idx];
+        if (cs->op == SL_CHAN_SEND ? chan_ring_push(cs->chan, cs->item)
+                                   : chan_ring_pop(cs->chan, &cs->item))
+            continue;
+
+        chan_dequeue_all(cases, waiters, n);
+        if (cs->op == SL_CHAN_SEND)
+            __chan_wake_receivers(cs->chan, 1);
+        else
+            __chan_wake_senders(cs->chan, 1);
+        chan_unlock_all(chans, nr_chans);
+        cs->ok = true;
+        return idx;
+    }
+    chan_unlock_all(chans, nr_chans);
+
+    spin_lock_np(&sel.lock);
+    if (!sel.fired) {
+        sel.parked = true;
+        task_block(&sel.lock);
+    } else {
+        spin_unlock_np(&sel.lock);
+    }
+
+    /* the claimer may still be completing us */
+    while (!atomic_load_acq(&sel.handled)) cpu_relax();
+
+    if (n > 1) {
+        nr_chans = chan_lock_all(cases, n, chans);
+        chan_dequeue_all(cases, waiters, n);
+        chan_unlock_all(chans, nr_chans);
+    }
+
+    idx = sel.fired - 1;
+    w = &waiters[idx];
+    cs = &cases[idx];
+    switch (w->result) {
+    case CHAN_DONE:
+        if (cs->op == SL_CHAN_RECV)
+            cs->item = w->item;
+        cs->ok = true;
+        return idx;
+    case CHAN_CLOSED:
+        if (cs->op == SL_CHAN_RECV)
+            cs->item = NULL;
+        cs->ok = false;
+        return idx;
+    default:
+        goto again;
+    }
+}
+
+/*
+ * Channel APIs
+ */
+
+/**
+ * sl_chan_create - creates a bounded channel
+ * @cap: the capacity, rounded up to a power of two (0 for unbuffered)
+ *
+ * Returns the channel, or NULL if out of memory.
+ */
+sl_chan_t *__api sl_chan_create(int cap)
+{
+    struct sl_chan *c;
+    unsigned int i, size = 1;
+
+    if (cap < 0)
+        return NULL;
+
+    c = aligned_alloc(CACHE_LINE_SIZE, sizeof(*c));
+    if (!c)
+        return NULL;
+    memset(c, 0, sizeof(*c));
+
+    if (cap > 0) {
+        while (size < (unsigned int)cap) size <<= 1;
+        c->slots = malloc(sizeof(struct chan_slot) * size);
+        if (!c->slots) {
+            free(c);
+            return NULL;
+        }
+        for (i = 0; i < size; i++) c->slots[i].seq = i;
+        c->mask = size - 1;
+    }
+
+    spin_lock_init(&c->lock);
+    list_head_init(&c->recv_waiters);
+    list_head_init(&c->send_waiters);
+    return c;
+}
+
+/**
+ * sl_chan_destroy - frees a channel
+ * @c: the channel, which must have no waiters
+ */
+void __api sl_chan_destroy(sl_chan_t *c)
+{
+    free(c->slots);
+    free(c);
+}
+
+/**
+ * sl_chan_close - closes a channel
+ * @c: the channel
+ *
+ * Pending and future sends fail. Receivers drain the remaining items and then
+ * fail, including the items of sends that were already under way.
+ */
+void __api sl_chan_close(sl_chan_t *c)
+{
+    struct chan_waiter *w;
+
+    spin_lock_np(&c->lock);
+    __atomic_store_n(&c->closed, true, __ATOMIC_SEQ_CST);
+    while ((w = chan_claim_waiter(&c->send_waiters, &c->nr_send_waiters)))
+        chan_complete(w, CHAN_CLOSED);
+    spin_unlock_np(&c->lock);
+
+    /* lock-free pushes that missed the close, they run with preemption disabled */
+    while (__atomic_load_n(&c->nr_pushing, __ATOMIC_ACQUIRE)) cpu_relax();
+
+    spin_lock_np(&c->lock);
+    atomic_store_rel(&c->sends_done, true);
+    /* receivers recheck the ring before reporting the close */
+    while ((w = chan_claim_waiter(&c->recv_waiters, &c->nr_recv_waiters)))
+        chan_complete(w, CHAN_RETRY);
+    spin_unlock_np(&c->lock);
+}
+
+static int chan_do(sl_chan_t *c, int op, void **item, bool block)
+{
+    struct sl_chan_case cs = {.chan = c, .op = op, .item = *item};
+    int ret;
+
+    ret = sl_chan_select(&cs, 1, block);
+    if (ret < 0)
+        return ret;
+
+    *item = cs.item;
+    return cs.ok ? 0 : -EPIPE;
+}
+
+/**
+ * sl_chan_send - sends an item, waiting while the channel is full
+ * @c: the channel
+ * @item: the item
+ *
+ * Returns 0 if successful, or -EPIPE if the channel is closed.
+ */
+int __api sl_chan_send(sl_chan_t *c, void *item)
+{
+    return chan_do(c, SL_CHAN_SEND, &item, true);
+}
+
+/**
+ * sl_chan_recv - receives an item, waiting while the channel is empty
+ * @c: the channel
+ * @item: where to store the item
+ *
+ * Returns 0 if successful, or -EPIPE if the channel is closed and drained.
+ */
+int __api sl_chan_recv(sl_chan_t *c, void **item)
+{
+    return chan_do(c, SL_CHAN_RECV, item, true);
+}
+
+/**
+ * sl_chan_try_send - sends an item if it can be done without waiting
+ * @c: the channel
+ * @item: the item
+ *
+ * Returns 0 if successful, -EAGAIN if the channel is full, or -EPIPE.
+ */
+int __api sl_chan_try_send(sl_chan_t *c, void *item)
+{
+    return chan_do(c, SL_CHAN_SEND, &item, false);
+}
+
+/**
+ * sl_chan_try_recv - receives an item if it can be done without waiting
+ * @c: the channel
+ * @item: where to store the item
+ *
+ * Returns 0 if successful, -EAGAIN if the channel is empty, or -EPIPE.
+ */
+int __api sl_chan_try_recv(sl_chan_t *c, void **item)
+{
+    return chan_do(c, SL_CHAN_RECV, item, false);
+}
+
+/**
+ * sl_chan_send_batch - sends several items, waiting while the channel is full
+ * @c: the channel
+ * @items: the items
+ * @n: the number of items
+ *
+ * Parked receivers are woken once per batch rather than once per item.
+ *
+ * Returns the number of items sent, or -EPIPE if the channel was closed before
+ * any item was sent.
+ */
+int __api sl_chan_send_batch(sl_chan_t *c, void **items, int n)
+{
+    int i = 0, pushed, ret;
+
+    while (i < n) {
+        if (unlikely(!chan_push_begin(c)))
+            return i ? i : -EPIPE;
+
+        for (pushed = 0; i < n && !ACCESS_ONCE(c->nr_recv_waiters); i++, pushed++) {
+            if (chan_ring_push(c, items[i]))
+                break;
+        }
+        chan_push_end(c);
+        if (pushed)
+            chan_wake_receivers(c, pushed);
+        if (i == n)
+            break;
+
+        /* the ring is full or receivers are parked: send one the slow way */
+        ret = sl_chan_send(c, items[i]);
+        if (ret)
+            return i ? i : ret;
+        i++;
+    }
+
+    return n;
+}
+
+/**
+ * sl_chan_recv_batch - receives up to @n items, waiting for at least one
+ * @c: the channel
+ * @items: where to store the items
+ * @n: the max number of items
+ *
+ * Returns the number of items received, -EPIPE if the channel is closed and
+ * drained, or -EINVAL.
+ */
+int __api sl_chan_recv_batch(sl_chan_t *c, void **items, int n)
+{
+    int got = 0, ret;
+
+    if (unlikely(n <= 0))
+        return -EINVAL;
+
+    while (got < n && chan_ring_pop(c, &items[got]) == 0) got++;
+    if (got == 0) {
+        ret = sl_chan_recv(c, &items[0]);
+        if (ret)
+            return ret;
+        got = 1;
+        while (got < n && chan_ring_pop(c, &items[got]) == 0) got++;
+        if (got > 1)
+            chan_wake_senders(c, got - 1);
+        return got;
+    }
+
+    chan_wake_senders(c, got);
+    return got;
+}
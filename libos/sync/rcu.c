@@ -10,12 +10,19 @@
  * each kthread count is either even & >= the previous value (to detect parking)
  * or odd & > the previous value (to detect rescheduling).
  *
- * FIXME: Freeing objects is expensive with this minimal implementation. This
- * should be fine as long as RCU updates are rare. The Linux Kernel uses several
- * more optimized strategies that we may want to consider in the future.
+ * Objects are queued on per-CPU lists and a single worker reclaims everything
+ * queued so far as one batch per grace period. The worker sleeps between
+ * batches unless a CPU queues RCU_BATCH_MAX objects or a task is blocked in
+ * synchronize_rcu(), which bounds the memory held by pending objects.
  */
 
+#include <errno.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <skyloft/params.h>
+#include <skyloft/sched.h>
 #include <skyloft/sync/rcu.h>
 #include <skyloft/sync/sync.h>
 #include <skyloft/sync/timer.h>
@@ -25,93 +32,167 @@
 #include <utils/log.h>
 #include <utils/spinlock.h>
 
-/* the time RCU waits before checking if it can free objects */
+/* the max time callbacks are batched before a grace period starts */
 #define RCU_SLEEP_PERIOD (10 * USEC_PER_MSEC)
+/* the time RCU waits between quiescent state checks in a grace period */
+#define RCU_POLL_PERIOD 200
+/* the number of callbacks queued on a CPU that starts a grace period early */
+#define RCU_BATCH_MAX 1024
+
+/* per-CPU queue of objects waiting to be freed */
+struct rcu_percpu {
+    spinlock_t lock;
+    int count;
+    struct rcu_head *head, *tail;
+} __aligned_cacheline;
 
-/* Protects @rcu_head. */
-static DEFINE_SPINLOCK(rcu_lock);
-/* The head of the list of objects waiting to be freed */
-static struct rcu_head *rcu_head;
+static struct rcu_percpu rcu_percpu[USED_CPUS];
 static bool rcu_worker_launched;
+/* futex word the worker sleeps on between batches */
+static int rcu_kicked;
 uint32_t *rcu_gen_percpu[USED_CPUS];
 
 #ifdef DEBUG
 __thread int rcu_read_count;
 #endif /* DEBUG */
 
+static void rcu_snapshot(unsigned int *last_rcu_gen)
+{
+    int i;
+
+    for (i = 0; i < USED_CPUS; i++)
+        last_rcu_gen[i] = rcu_gen_percpu[i] ? atomic_load_acq(rcu_gen_percpu[i]) : 0;
+}
+
+/* has every CPU passed a quiescent state (a context switch) since the snapshot? */
+static bool rcu_gp_passed(const unsigned int *last_rcu_gen)
+{
+    unsigned int gen;
+    int i;
+
+    for (i = 0; i < USED_CPUS; i++) {
+        if (!rcu_gen_percpu[i])
+            continue;
+        gen = atomic_load_acq(rcu_gen_percpu[i]);
+        if ((gen & 0x1) == 0x1 && gen == last_rcu_gen[i])
+            return false;
+    }
+
+    return true;
+}
+
+/* must hold @p->lock */
+static void __rcu_enqueue(struct rcu_percpu *p, struct rcu_head *head)
+{
+    head->next = p->head;
+    if (!p->head)
+        p->tail = head;
+    p->head = head;
+    p->count++;
+}
+
+/* detaches the callbacks queued on all CPUs as one batch */
+static struct rcu_head *rcu_collect(void)
+{
+    struct rcu_percpu *p;
+    struct rcu_head *batch = NULL;
+    int i;
+
+    for (i = 0; i < USED_CPUS; i++) {
+        p = &rcu_percpu[i];
+        if (!ACCESS_ONCE(p->head))
+            continue;
+
+        spin_lock_np(&p->lock);
+        p->tail->next = batch;
+        batch = p->head;
+        p->head = p->tail = NULL;
+        p->count = 0;
+        spin_unlock_np(&p->lock);
+    }
+
+    return batch;
+}
+
+static void rcu_kick_worker(void)
+{
+    if (!ACCESS_ONCE(rcu_kicked) && !__sync_lock_test_and_set(&rcu_kicked, 1))
+        futex_wake(&rcu_kicked, 1);
+}
+
+static void rcu_worker_wait(uint64_t timeout_us)
+{
+#ifdef SKYLOFT_TIMER
+    futex_wait_until(&rcu_kicked, 0, now_us() + timeout_us);
+#else
+    uint64_t deadline_us = now_us() + timeout_us;
+
+    while (!ACCESS_ONCE(rcu_kicked) && now_us() < deadline_us) task_yield();
+#endif
+    atomic_store_rel(&rcu_kicked, 0);
+}
+
 static void rcu_worker(void *arg)
 {
     struct rcu_head *head, *next;
     unsigned int last_rcu_gen[USED_CPUS];
-    unsigned int gen;
-    int i;
 
     log_info("rcu: rcu worker %p", arg);
 
     while (true) {
         /* check if any RCU objects are waiting to be freed */
-        spin_lock_np(&rcu_lock);
-        if (!rcu_head) {
-            spin_unlock_np(&rcu_lock);
-            timer_sleep(RCU_SLEEP_PERIOD);
+        head = rcu_collect();
+        if (!head) {
+            rcu_worker_wait(RCU_SLEEP_PERIOD);
             continue;
         }
-        head = rcu_head;
-        rcu_head = NULL;
-        spin_unlock_np(&rcu_lock);
-
-        /* read the RCU generation counters */
-        for (i = 0; i < USED_CPUS; i++) last_rcu_gen[i] = atomic_load_acq(rcu_gen_percpu[i]);
-
-        while (true) {
-            /* wait for RCU generation counters to increase */
-            timer_sleep(RCU_SLEEP_PERIOD);
-
-            /* read the RCU generation counters again */
-            for (i = 0; i < USED_CPUS; i++) {
-                gen = atomic_load_acq(rcu_gen_percpu[i]);
-                /* wait for a quiescent period (all passes context switch) */
-                if ((gen & 0x1) == 0x1 && gen == last_rcu_gen[i]) {
-                    break;
-                }
-            }
-
-            /* did any of the RCU generation checks fail? */
-            if (i != USED_CPUS)
-                continue;
-
-            /* actually free the RCU objects */
-            while (head) {
-                next = head->next;
-                head->func(head);
-                head = next;
-            }
-
-            break;
+
+        /* wait for a quiescent period (all passes context switch) */
+        rcu_snapshot(last_rcu_gen);
+        while (!rcu_gp_passed(last_rcu_gen)) timer_sleep(RCU_POLL_PERIOD);
+
+        /* actually free the RCU objects */
+        while (head) {
+            next = head->next;
+            head->func(head);
+            head = next;
         }
     }
 }
 
+static void rcu_launch_worker(void)
+{
+    if (likely(ACCESS_ONCE(rcu_worker_launched)))
+        return;
+    if (__sync_bool_compare_and_swap(&rcu_worker_launched, false, true))
+        BUG_ON(sl_task_spawn(rcu_worker, NULL, 0));
+}
+
 /**
  * rcu_free - frees an RCU object after the quiescent period
  * @head: the RCU head structure embedded within the object
  * @func: the release method
+ *
+ * Objects are queued on the local CPU and reclaimed in batches. A grace period
+ * starts early once RCU_BATCH_MAX objects are queued on a CPU.
  */
 void rcu_free(struct rcu_head *head, rcu_callback_t func)
 {
-    bool launch_worker = false;
+    struct rcu_percpu *p;
+    bool kick;
 
     head->func = func;
 
-    spin_lock_np(&rcu_lock);
-    if (unlikely(!rcu_worker_launched))
-        launch_worker = rcu_worker_launched = true;
-    head->next = rcu_head;
-    rcu_head = head;
-    spin_unlock_np(&rcu_lock);
+    preempt_disable();
+    p = &rcu_percpu[current_cpu_id()];
+    spin_lock(&p->lock);
+    __rcu_enqueue(p, head);
+    kick = p->count >= RCU_BATCH_MAX;
+    spin_unlock_np(&p->lock);
 
-    if (unlikely(launch_worker))
-        BUG_ON(sl_task_spawn(rcu_worker, head, 0));
+    rcu_launch_worker();
+    if (unlikely(kick))
+        rcu_kick_worker();
 }
 
 struct sync_arg {
@@ -132,19 +213,92 @@ static void synchronize_rcu_finish(struct rcu_head *head)
  */
 void synchronize_rcu(void)
 {
-    bool launch_worker = false;
+    struct rcu_percpu *p;
     struct sync_arg tmp;
-    struct task *task = task_self();
 
     tmp.rcu.func = synchronize_rcu_finish;
-    tmp.task = task;
-
-    spin_lock_np(&rcu_lock);
-    if (unlikely(!rcu_worker_launched))
-        launch_worker = rcu_worker_launched = true;
-    tmp.rcu.next = rcu_head;
-    rcu_head = &tmp.rcu;
-    if (unlikely(launch_worker))
-        BUG_ON(sl_task_spawn(rcu_worker, NULL, 0));
-    task_block(&rcu_lock);
+    tmp.task = task_self();
+
+    rcu_launch_worker();
+
+    preempt_disable();
+    p = &rcu_percpu[current_cpu_id()];
+    spin_lock(&p->lock);
+    __rcu_enqueue(p, &tmp.rcu);
+    /* don't wait for the batching period */
+    rcu_kick_worker();
+    task_block(&p->lock);
+}
+
+/*
+ * The signal that kicks CPUs for synchronize_rcu_expedited(). SIGURG is
+ * ignored by default, so a kick that races with startup is harmless.
+ */
+#define RCU_KICK_SIGNAL SIGURG
+
+/*
+ * Runs on a kicked kthread, on top of whatever it was doing. Readers hold
+ * preemption disabled (see rcu_read_lock()), so if it is enabled, the kthread
+ * is not in a read-side critical section: that's a quiescent state. The counter
+ * moves by two to keep its parity, and the kthread only races with itself.
+ */
+static void rcu_kick_handler(int signum, siginfo_t *info, void *extra)
+{
+    uint32_t *gen = rcu_gen_percpu[current_cpu_id()];
+
+    if (gen && preempt_enabled())
+        atomic_store_rel(gen, *gen + 2);
+}
+
+/* signals the other CPUs that are still running the task they ran at the snapshot */
+static void rcu_kick_cpus(const unsigned int *last_rcu_gen)
+{
+    int i, cpu = current_cpu_id();
+
+    for (i = 0; i < USED_CPUS; i++) {
+        if (i == cpu || !rcu_gen_percpu[i] || !(last_rcu_gen[i] & 0x1) ||
+            atomic_load_acq(rcu_gen_percpu[i]) != last_rcu_gen[i])
+            continue;
+        syscall(SYS_tgkill, getpid(), cpuk(i)->tid, RCU_KICK_SIGNAL);
+    }
+}
+
+/**
+ * synchronize_rcu_expedited - blocks until it is safe to free an RCU object,
+ * without waiting for the RCU worker
+ *
+ * Every other CPU still running the task it ran at the start is signaled, and
+ * passes a quiescent state in the handler unless it is inside a read-side
+ * critical section. Those are kicked again every RCU_POLL_PERIOD. The caller
+ * polls the RCU generation counters meanwhile, yielding instead of sleeping.
+ *
+ * WARNING: Can only be called from thread context.
+ */
+void synchronize_rcu_expedited(void)
+{
+    unsigned int last_rcu_gen[USED_CPUS];
+    uint64_t kick_us = 0;
+
+    rcu_snapshot(last_rcu_gen);
+    while (!rcu_gp_passed(last_rcu_gen)) {
+        if (now_us() >= kick_us) {
+            rcu_kick_cpus(last_rcu_gen);
+            kick_us = now_us() + RCU_POLL_PERIOD;
+        }
+        task_yield();
+    }
+}
+
+/**
+ * rcu_init - installs the handler of expedited grace period kicks
+ *
+ * Returns 0 if successful, or a negative error code.
+ */
+int rcu_init(void)
+{
+    struct sigaction action = {0};
+
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    action.sa_sigaction = rcu_kick_handler;
+    return sigaction(RCU_KICK_SIGNAL, &action, NULL) ? -errno : 0;
 }
@@ -1,15 +1,72 @@
 #include <skyloft/sched.h>
 #include <skyloft/sync/sync.h>
+#include <skyloft/sync/timer.h>
 #include <skyloft/task.h>
 #include <skyloft/uapi/task.h>
+#include <utils/hash.h>
 #include <utils/log.h>
+#include <utils/time.h>
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 /*
  * Mutex support
+ *
+ * The mutex is adaptive: a contender spins while the owner is running on
+ * another CPU and parks otherwise. Unlock wakes the oldest waiter and lets it
+ * compete with running tasks, unless that waiter has waited longer than
+ * MUTEX_HANDOFF_US, in which case ownership is handed off to it directly.
  */
 
+struct mutex_waiter {
+    struct list_node link;
+    struct task *task;
+    uint64_t start_us;
+    bool handoff;
+};
+
+static __always_inline bool __mutex_try_acquire(mutex_t *m)
+{
+    if (ACCESS_ONCE(m->held) || !__sync_bool_compare_and_swap(&m->held, false, true))
+        return false;
+    atomic_store_rel(&m->owner, task_self());
+    return true;
+}
+
+/* zero-filled mutexes (e.g. PTHREAD_MUTEX_INITIALIZER) get their list lazily */
+static __always_inline void __mutex_init_waiters(mutex_t *m)
+{
+    if (unlikely(!m->waiters.n.next))
+        list_head_init(&m->waiters);
+}
+
+/**
+ * mutex_spin_on_owner - spins on a mutex while its owner is running
+ * @m: the mutex to acquire
+ *
+ * Returns true if the mutex was acquired, or false if the caller should park.
+ */
+static bool mutex_spin_on_owner(mutex_t *m)
+{
+    struct task *owner;
+    uint64_t deadline_us = now_us() + MUTEX_SPIN_US;
+
+    while (true) {
+        if (__mutex_try_acquire(m))
+            return true;
+
+        /* the owner is NULL briefly between acquisition and publishing it */
+        owner = atomic_load_acq(&m->owner);
+        if (owner && !ACCESS_ONCE(owner->on_cpu))
+            return false;
+        if (now_us() >= deadline_us)
+            return false;
+        cpu_relax();
+    }
+}
+
 /**
  * mutex_try_lock - attempts to acquire a mutex
  * @m: the mutex to acquire
@@ -18,14 +75,7 @@
  */
 bool mutex_try_lock(mutex_t *m)
 {
-    spin_lock_np(&m->waiter_lock);
-    if (m->held) {
-        spin_unlock_np(&m->waiter_lock);
-        return false;
-    }
-    m->held = true;
-    spin_unlock_np(&m->waiter_lock);
-    return true;
+    return __mutex_try_acquire(m);
 }
 
 /**
@@ -34,17 +84,43 @@ bool mutex_try_lock(mutex_t *m)
  */
 void mutex_lock(mutex_t *m)
 {
-    struct task *task;
+    struct mutex_waiter w;
+    bool requeue = false;
 
-    spin_lock_np(&m->waiter_lock);
-    task = task_self();
-    if (!m->held) {
-        m->held = true;
-        spin_unlock_np(&m->waiter_lock);
+    if (likely(__mutex_try_acquire(m)))
         return;
+
+    ADD_STAT(MUTEX_CONTENDED, 1);
+    if (mutex_spin_on_owner(m))
+        return;
+
+    w.task = task_self();
+    w.start_us = now_us();
+    w.handoff = false;
+
+    while (true) {
+        spin_lock_np(&m->waiter_lock);
+        __mutex_init_waiters(m);
+        if (__mutex_try_acquire(m)) {
+            spin_unlock_np(&m->waiter_lock);
+            return;
+        }
+
+        /* a waiter that lost the race keeps its place at the head */
+        if (requeue)
+            list_add(&m->waiters, &w.link);
+        else
+            list_add_tail(&m->waiters, &w.link);
+        ADD_STAT(MUTEX_PARKS, 1);
+        task_block(&m->waiter_lock);
+
+        /* the unlocker already made us the owner */
+        if (w.handoff)
+            return;
+        if (mutex_spin_on_owner(m))
+            return;
+        requeue = true;
     }
-    list_add_tail(&m->waiters, &task->link);
-    task_block(&m->waiter_lock);
 }
 
 /**
@@ -53,15 +129,31 @@ void mutex_lock(mutex_t *m)
  */
 void mutex_unlock(mutex_t *m)
 {
+    struct mutex_waiter *w;
     struct task *task;
 
+    assert_mutex_held(m);
+
     spin_lock_np(&m->waiter_lock);
-    task = list_pop(&m->waiters, struct task, link);
-    if (!task) {
-        m->held = false;
+    __mutex_init_waiters(m);
+    w = list_pop(&m->waiters, struct mutex_waiter, link);
+    if (!w) {
+        atomic_store_rel(&m->owner, NULL);
+        atomic_store_rel(&m->held, false);
         spin_unlock_np(&m->waiter_lock);
         return;
     }
+
+    /* @w stays valid until the waiter is woken below */
+    task = w->task;
+    if (now_us() - w->start_us >= MUTEX_HANDOFF_US) {
+        w->handoff = true;
+        atomic_store_rel(&m->owner, task);
+        ADD_STAT(MUTEX_HANDOFFS, 1);
+    } else {
+        atomic_store_rel(&m->owner, NULL);
+        atomic_store_rel(&m->held, false);
+    }
     spin_unlock_np(&m->waiter_lock);
     task_wakeup(task);
 }
@@ -73,6 +165,7 @@ void mutex_unlock(mutex_t *m)
 void mutex_init(mutex_t *m)
 {
     m->held = false;
+    m->owner = NULL;
     spin_lock_init(&m->waiter_lock);
     list_head_init(&m->waiters);
 }
@@ -146,6 +239,248 @@ void condvar_init(condvar_t *cv)
     list_head_init(&cv->waiters);
 }
 
+/*
+ * Reader-writer mutex support
+ *
+ * Readers announce themselves in a per-CPU counter and only touch shared state
+ * when a writer is pending. A writer closes the gate to new readers, then
+ * waits for the sum of the counters to drop to zero. On release, a writer
+ * admits all queued readers as a batch and passes the gate to the next queued
+ * writer, so neither side can starve the other.
+ */
+
+static int rwmutex_readers(rwmutex_t *m)
+{
+    int i, sum = 0;
+
+    for (i = 0; i < USED_CPUS; i++) sum += ACCESS_ONCE(m->percpu[i].readers);
+    return sum;
+}
+
+static void rwmutex_wake_drainer(rwmutex_t *m)
+{
+    struct task *drainer = NULL;
+
+    spin_lock_np(&m->waiter_lock);
+    if (m->drainer && rwmutex_readers(m) == 0) {
+        drainer = m->drainer;
+        m->drainer = NULL;
+    }
+    spin_unlock_np(&m->waiter_lock);
+
+    if (drainer)
+        task_wakeup(drainer);
+}
+
+/* must be called with the waiter lock held and the gate closed, releases it */
+static void rwmutex_drain_readers(rwmutex_t *m)
+{
+    while (rwmutex_readers(m) != 0) {
+        m->drainer = task_self();
+        task_block(&m->waiter_lock);
+        spin_lock_np(&m->waiter_lock);
+    }
+    m->write_held = true;
+    spin_unlock_np(&m->waiter_lock);
+}
+
+/**
+ * rwmutex_try_rdlock - attempts to acquire a reader-writer mutex for reading
+ * @m: the mutex to acquire
+ *
+ * Returns true if the acquire was successful.
+ */
+bool rwmutex_try_rdlock(rwmutex_t *m)
+{
+    int *readers;
+
+    preempt_disable();
+    readers = &m->percpu[current_cpu_id()].readers;
+    __atomic_fetch_add(readers, 1, __ATOMIC_SEQ_CST);
+    if (likely(!ACCESS_ONCE(m->write_pending))) {
+        preempt_enable();
+        return true;
+    }
+
+    /* back out on the same CPU so a writer never sees an unmatched decrement */
+    __atomic_fetch_sub(readers, 1, __ATOMIC_SEQ_CST);
+    preempt_enable();
+    rwmutex_wake_drainer(m);
+    return false;
+}
+
+/**
+ * rwmutex_try_wrlock - attempts to acquire a reader-writer mutex for writing
+ * @m: the mutex to acquire
+ *
+ * Returns true if the acquire was successful.
+ */
+bool rwmutex_try_wrlock(rwmutex_t *m)
+{
+    spin_lock_np(&m->waiter_lock);
+    if (m->write_pending) {
+        spin_unlock_np(&m->waiter_lock);
+        return false;
+    }
+
+    __atomic_store_n(&m->write_pending, true, __ATOMIC_SEQ_CST);
+    if (rwmutex_readers(m) != 0) {
+        atomic_store_rel(&m->write_pending, false);
+        spin_unlock_np(&m->waiter_lock);
+        return false;
+    }
+    m->write_held = true;
+    spin_unlock_np(&m->waiter_lock);
+    return true;
+}
+
+/**
+ * rwmutex_rdlock - acquires a reader-writer mutex for reading
+ * @m: the mutex to acquire
+ */
+void rwmutex_rdlock(rwmutex_t *m)
+{
+    if (likely(rwmutex_try_rdlock(m)))
+        return;
+
+    spin_lock_np(&m->waiter_lock);
+    if (!m->write_pending) {
+        /* writers close the gate under the waiter lock */
+        __atomic_fetch_add(&m->percpu[current_cpu_id()].readers, 1, __ATOMIC_SEQ_CST);
+        spin_unlock_np(&m->waiter_lock);
+        return;
+    }
+
+    /* the releasing writer counts us in before waking us */
+    list_add_tail(&m->read_waiters, &task_self()->link);
+    task_block(&m->waiter_lock);
+}
+
+/**
+ * rwmutex_wrlock - acquires a reader-writer mutex for writing
+ * @m: the mutex to acquire
+ */
+void rwmutex_wrlock(rwmutex_t *m)
+{
+    spin_lock_np(&m->waiter_lock);
+    if (m->write_pending) {
+        /* the releasing writer passes the closed gate to us */
+        list_add_tail(&m->write_waiters, &task_self()->link);
+        task_block(&m->waiter_lock);
+        spin_lock_np(&m->waiter_lock);
+    } else {
+        __atomic_store_n(&m->write_pending, true, __ATOMIC_SEQ_CST);
+    }
+    rwmutex_drain_readers(m);
+}
+
+static void rwmutex_write_unlock(rwmutex_t *m)
+{
+    struct task *task, *writer;
+    struct list_head tmp;
+    int nr_readers = 0;
+
+    list_head_init(&tmp);
+
+    spin_lock_np(&m->waiter_lock);
+    m->write_held = false;
+    list_append_list(&tmp, &m->read_waiters);
+    list_for_each(&tmp, task, link) nr_readers++;
+    if (nr_readers)
+        __atomic_fetch_add(&m->percpu[current_cpu_id()].readers, nr_readers, __ATOMIC_SEQ_CST);
+    writer = list_pop(&m->write_waiters, struct task, link);
+    if (!writer)
+        atomic_store_rel(&m->write_pending, false);
+    spin_unlock_np(&m->waiter_lock);
+
+    while (true) {
+        task = list_pop(&tmp, struct task, link);
+        if (!task)
+            break;
+        task_wakeup(task);
+    }
+    if (writer)
+        task_wakeup(writer);
+}
+
+/**
+ * rwmutex_unlock - releases a reader-writer mutex
+ * @m: the mutex to release
+ */
+void rwmutex_unlock(rwmutex_t *m)
+{
+    if (m->write_held) {
+        rwmutex_write_unlock(m);
+        return;
+    }
+
+    preempt_disable();
+    __atomic_fetch_sub(&m->percpu[current_cpu_id()].readers, 1, __ATOMIC_SEQ_CST);
+    preempt_enable();
+    if (unlikely(ACCESS_ONCE(m->write_pending)))
+        rwmutex_wake_drainer(m);
+}
+
+/**
+ * rwmutex_alloc_percpu - allocates the per-CPU reader counts of a mutex
+ *
+ * Returns the zeroed counts, or NULL if out of memory.
+ */
+struct rwmutex_percpu *rwmutex_alloc_percpu(void)
+{
+    size_t size = sizeof(struct rwmutex_percpu) * USED_CPUS;
+    struct rwmutex_percpu *percpu;
+
+    percpu = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (percpu)
+        memset(percpu, 0, size);
+    return percpu;
+}
+
+/**
+ * __rwmutex_init - initializes a reader-writer mutex with its reader counts
+ * @m: the mutex to initialize
+ * @percpu: the counts from rwmutex_alloc_percpu()
+ *
+ * @m->percpu is published last, so whoever sees it set sees the whole mutex.
+ */
+void __rwmutex_init(rwmutex_t *m, struct rwmutex_percpu *percpu)
+{
+    spin_lock_init(&m->waiter_lock);
+    m->write_pending = false;
+    m->write_held = false;
+    m->drainer = NULL;
+    list_head_init(&m->read_waiters);
+    list_head_init(&m->write_waiters);
+    atomic_store_rel(&m->percpu, percpu);
+}
+
+/**
+ * rwmutex_init - initializes a reader-writer mutex
+ * @m: the mutex to initialize
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+int rwmutex_init(rwmutex_t *m)
+{
+    struct rwmutex_percpu *percpu = rwmutex_alloc_percpu();
+
+    if (!percpu)
+        return -ENOMEM;
+    __rwmutex_init(m, percpu);
+    return 0;
+}
+
+/**
+ * rwmutex_destroy - frees the resources of a reader-writer mutex
+ * @m: the mutex to destroy
+ */
+void rwmutex_destroy(rwmutex_t *m)
+{
+    free(m->percpu);
+    m->percpu = NULL;
+}
+
 /*
  * Barrier support
  */
@@ -261,46 +596,353 @@ void waitgroup_init(waitgroup_t *wg)
     wg->cnt = 0;
 }
 
-struct futex {
+/*
+ * Futex support
+ *
+ * Waiters are kept in a fixed-size table of buckets hashed by address, so
+ * unrelated futexes rarely contend on the same lock and a wake only scans the
+ * waiters that collide with its address.
+ */
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+#define FUTEX_HASH_MASK (FUTEX_HASH_SIZE - 1)
+
+struct futex_bucket {
+    spinlock_t lock;
+    struct list_head waiters;
+} __aligned_cacheline;
+
+struct futex_waiter {
     int *uaddr;
+    struct futex_bucket *bucket;
     struct list_node link;
     struct task *task;
+    bool queued;
+    bool timed_out;
+    bool timer_done;
 };
 
-DEFINE_LIST_HEAD(futex_list);
-DEFINE_SPINLOCK(futex_lock);
+static struct futex_bucket futex_table[FUTEX_HASH_SIZE];
 
-int futex_wait(int *uaddr, int val)
+static inline struct futex_bucket *futex_bucket_of(int *uaddr)
 {
-    struct futex futex = {.uaddr = uaddr, .task = task_self()};
+    return &futex_table[hash_crc32c_one(0, (uintptr_t)uaddr) & FUTEX_HASH_MASK];
+}
 
-    spin_lock_np(&futex_lock);
-    if (*uaddr != val) {
-        spin_unlock_np(&futex_lock);
-        return -EAGAIN;
+static void futex_double_lock(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+    struct futex_bucket *tmp;
+
+    /* always lock in address order to avoid ABBA deadlocks */
+    if (b1 > b2) {
+        tmp = b1;
+        b1 = b2;
+        b2 = tmp;
     }
 
-    list_add_tail(&futex_list, &futex.link);
-    task_block(&futex_lock);
-    return 0;
+    spin_lock_np(&b1->lock);
+    if (b1 != b2)
+        spin_lock(&b2->lock);
 }
 
-int futex_wake(int *uaddr, int val)
+static void futex_double_unlock(struct futex_bucket *b1, struct futex_bucket *b2)
 {
+    if (b1 != b2)
+        spin_unlock(&b2->lock);
+    spin_unlock(&b1->lock);
+    preempt_enable();
+}
+
+/* moves up to @nr waiters on @uaddr to @tasks, the caller must wake them */
+static int __futex_dequeue(struct futex_bucket *b, int *uaddr, int nr, struct list_head *tasks)
+{
+    struct futex_waiter *w, *next;
     int count = 0;
-    struct futex *f;
 
-    spin_lock_np(&futex_lock);
-    list_for_each(&futex_list, f, link)
+    assert_spin_lock_held(&b->lock);
+
+    if (nr <= 0)
+        return 0;
+
+    list_for_each_safe(&b->waiters, w, next, link)
     {
-        if (f->uaddr == uaddr) {
-            list_del(&f->link);
-            task_wakeup(f->task);
-            if (++count == val)
-                break;
+        if (w->uaddr != uaddr)
+            continue;
+        list_del(&w->link);
+        w->queued = false;
+        list_add_tail(tasks, &w->task->link);
+        if (++count >= nr)
+            break;
+    }
+
+    return count;
+}
+
+static void futex_wake_list(struct list_head *tasks)
+{
+    struct task *task;
+
+    while (true) {
+        task = list_pop(tasks, struct task, link);
+        if (!task)
+            break;
+        task_wakeup(task);
+    }
+}
+
+static void futex_timeout(unsigned long arg)
+{
+    struct futex_waiter *w = (struct futex_waiter *)arg;
+    struct futex_bucket *b;
+    struct task *task = NULL;
+
+again:
+    /* the waiter may be requeued onto another bucket concurrently */
+    b = atomic_load_acq(&w->bucket);
+    spin_lock_np(&b->lock);
+    if (unlikely(w->bucket != b)) {
+        spin_unlock_np(&b->lock);
+        goto again;
+    }
+
+    if (w->queued) {
+        list_del(&w->link);
+        w->queued = false;
+        w->timed_out = true;
+        task = w->task;
+    }
+
+    /* @w lives on the waiter's stack, don't touch it after this point */
+    atomic_store_rel(&w->timer_done, true);
+    spin_unlock_np(&b->lock);
+
+    if (task)
+        task_wakeup(task);
+}
+
+/**
+ * futex_wait_until - waits on a futex word until woken or a deadline expires
+ * @uaddr: the futex word
+ * @val: the expected value of the futex word
+ * @deadline_us: the deadline in microseconds (or 0 to wait forever)
+ *
+ * Returns 0 if woken, -EAGAIN if *@uaddr != @val, or -ETIMEDOUT if the deadline
+ * passed before a wakeup.
+ */
+int futex_wait_until(int *uaddr, int val, uint64_t deadline_us)
+{
+    struct futex_bucket *b = futex_bucket_of(uaddr);
+    struct futex_waiter w = {.uaddr = uaddr, .bucket = b, .task = task_self()};
+    struct timer_entry e;
+
+    spin_lock_np(&b->lock);
+    if (ACCESS_ONCE(*uaddr) != val) {
+        spin_unlock_np(&b->lock);
+        return -EAGAIN;
+    }
+
+    if (deadline_us && now_us() >= deadline_us) {
+        spin_unlock_np(&b->lock);
+        return -ETIMEDOUT;
+    }
+
+    w.queued = true;
+    list_add_tail(&b->waiters, &w.link);
+
+    /* arm the timer with the bucket held so it can't fire before we queue */
+    if (deadline_us) {
+        timer_init(&e, futex_timeout, (unsigned long)&w);
+        timer_start(&e, deadline_us);
+    }
+
+    task_block(&b->lock);
+
+    if (deadline_us && !timer_cancel(&e)) {
+        /* the timer already fired, wait for its handler to let go of @w */
+        while (!atomic_load_acq(&w.timer_done)) cpu_relax();
+    }
+
+    return w.timed_out ? -ETIMEDOUT : 0;
+}
+
+/**
+ * futex_wake - wakes waiters on a futex word
+ * @uaddr: the futex word
+ * @nr: the maximum number of waiters to wake
+ *
+ * Returns the number of waiters woken.
+ */
+int futex_wake(int *uaddr, int nr)
+{
+    struct futex_bucket *b = futex_bucket_of(uaddr);
+    struct list_head tasks;
+    int count;
+
+    list_head_init(&tasks);
+
+    spin_lock_np(&b->lock);
+    count = __futex_dequeue(b, uaddr, nr, &tasks);
+    spin_unlock_np(&b->lock);
+
+    futex_wake_list(&tasks);
+    return count;
+}
+
+/**
+ * futex_requeue - wakes some waiters and moves the rest to another futex word
+ * @uaddr: the source futex word
+ * @nr_wake: the maximum number of waiters to wake
+ * @uaddr2: the target futex word
+ * @nr_requeue: the maximum number of waiters to move to @uaddr2
+ * @cmpval: if non-NULL, fail with -EAGAIN unless *@uaddr == *@cmpval
+ *
+ * This lets a condition variable broadcast wake one waiter and park the
+ * others on the mutex, instead of waking them all to fight over it.
+ *
+ * Returns the number of waiters woken or requeued, or -EAGAIN.
+ */
+int futex_requeue(int *uaddr, int nr_wake, int *uaddr2, int nr_requeue, const int *cmpval)
+{
+    struct futex_bucket *b1 = futex_bucket_of(uaddr), *b2 = futex_bucket_of(uaddr2);
+    struct futex_waiter *w, *next;
+    struct list_head tasks;
+    int woken, requeued = 0;
+
+    list_head_init(&tasks);
+
+    futex_double_lock(b1, b2);
+    if (cmpval && ACCESS_ONCE(*uaddr) != *cmpval) {
+        futex_double_unlock(b1, b2);
+        return -EAGAIN;
+    }
+
+    woken = __futex_dequeue(b1, uaddr, nr_wake, &tasks);
+
+    list_for_each_safe(&b1->waiters, w, next, link)
+    {
+        if (requeued >= nr_requeue)
+            break;
+        if (w->uaddr != uaddr)
+            continue;
+        if (b1 != b2) {
+            list_del(&w->link);
+            list_add_tail(&b2->waiters, &w->link);
+            atomic_store_rel(&w->bucket, b2);
         }
+        w->uaddr = uaddr2;
+        requeued++;
+    }
+    futex_double_unlock(b1, b2);
+
+    futex_wake_list(&tasks);
+    return woken + requeued;
+}
+
+#define FUTEX_OP_SET  0 /* uaddr2 = oparg */
+#define FUTEX_OP_ADD  1 /* uaddr2 += oparg */
+#define FUTEX_OP_OR   2 /* uaddr2 |= oparg */
+#define FUTEX_OP_ANDN 3 /* uaddr2 &= ~oparg */
+#define FUTEX_OP_XOR  4 /* uaddr2 ^= oparg */
+
+#define FUTEX_OP_OPARG_SHIFT 8 /* use (1 << oparg) as operand */
+
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP_CMP_NE 1
+#define FUTEX_OP_CMP_LT 2
+#define FUTEX_OP_CMP_LE 3
+#define FUTEX_OP_CMP_GT 4
+#define FUTEX_OP_CMP_GE 5
+
+static int futex_atomic_op(int encoded_op, int *uaddr, int *oldval)
+{
+    int op = (encoded_op >> 28) & 0xf;
+    int oparg = (int)((unsigned int)encoded_op << 8) >> 20;
+
+    if (op & FUTEX_OP_OPARG_SHIFT) {
+        if (oparg < 0 || oparg > 31)
+            return -EINVAL;
+        oparg = 1 << oparg;
+        op &= ~FUTEX_OP_OPARG_SHIFT;
+    }
+
+    switch (op) {
+    case FUTEX_OP_SET:
+        *oldval = __atomic_exchange_n(uaddr, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_ADD:
+        *oldval = __atomic_fetch_add(uaddr, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_OR:
+        *oldval = __atomic_fetch_or(uaddr, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_ANDN:
+        *oldval = __atomic_fetch_and(uaddr, ~oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_XOR:
+        *oldval = __atomic_fetch_xor(uaddr, oparg, __ATOMIC_SEQ_CST);
+        break;
+    default:
+        return -ENOSYS;
+    }
+
+    return 0;
+}
+
+static bool futex_op_cmp(int encoded_op, int oldval)
+{
+    int cmp = (encoded_op >> 24) & 0xf;
+    int cmparg = (int)((unsigned int)encoded_op << 20) >> 20;
+
+    switch (cmp) {
+    case FUTEX_OP_CMP_EQ:
+        return oldval == cmparg;
+    case FUTEX_OP_CMP_NE:
+        return oldval != cmparg;
+    case FUTEX_OP_CMP_LT:
+        return oldval < cmparg;
+    case FUTEX_OP_CMP_LE:
+        return oldval <= cmparg;
+    case FUTEX_OP_CMP_GT:
+        return oldval > cmparg;
+    case FUTEX_OP_CMP_GE:
+        return oldval >= cmparg;
+    default:
+        return false;
+    }
+}
+
+/**
+ * futex_wake_op - atomically updates a second futex word and wakes waiters
+ * @uaddr: the first futex word
+ * @nr_wake: the maximum number of waiters to wake on @uaddr
+ * @uaddr2: the futex word to update
+ * @nr_wake2: the maximum number of waiters to wake on @uaddr2
+ * @encoded_op: the operation and comparison (see FUTEX_WAKE_OP in futex(2))
+ *
+ * Returns the number of waiters woken, or a negative error code.
+ */
+int futex_wake_op(int *uaddr, int nr_wake, int *uaddr2, int nr_wake2, int encoded_op)
+{
+    struct futex_bucket *b1 = futex_bucket_of(uaddr), *b2 = futex_bucket_of(uaddr2);
+    struct list_head tasks;
+    int ret, oldval, count;
+
+    list_head_init(&tasks);
+
+    futex_double_lock(b1, b2);
+    ret = futex_atomic_op(encoded_op, uaddr2, &oldval);
+    if (unlikely(ret)) {
+        futex_double_unlock(b1, b2);
+        return ret;
     }
-    spin_unlock_np(&futex_lock);
+
+    count = __futex_dequeue(b1, uaddr, nr_wake, &tasks);
+    if (futex_op_cmp(encoded_op, oldval))
+        count += __futex_dequeue(b2, uaddr2, nr_wake2, &tasks);
+    futex_double_unlock(b1, b2);
+
+    futex_wake_list(&tasks);
     return count;
 }
 
@@ -308,22 +950,41 @@ int __api sl_futex(int *uaddr, int op, int val, const struct timespec *timeout,
                    int val3)
 {
     int cmd = op & FUTEX_CMD_MASK;
+    uint64_t deadline_us = 0;
+
+    /* for the requeue and wake-op commands, @timeout carries a count */
     switch (cmd) {
     case FUTEX_WAIT:
         if (timeout) {
-            log_warn("FUTEX_WAIT with timeout is not supported");
+            deadline_us = now_us() + timeout->tv_sec * USEC_PER_SEC +
+                          div_up(timeout->tv_nsec, NSEC_PER_USEC);
         }
-        int ret = futex_wait(uaddr, val);
-        return ret;
+        return futex_wait_until(uaddr, val, deadline_us);
     case FUTEX_WAKE:
         return futex_wake(uaddr, val);
+    case FUTEX_REQUEUE:
+        return futex_requeue(uaddr, val, uaddr2, (int)(uintptr_t)timeout, NULL);
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue(uaddr, val, uaddr2, (int)(uintptr_t)timeout, &val3);
+    case FUTEX_WAKE_OP:
+        return futex_wake_op(uaddr, val, uaddr2, (int)(uintptr_t)timeout, val3);
     default:
-        return -1;
+        log_warn_once("futex: unsupported command %d", cmd);
+        return -ENOSYS;
     }
 }
 
-void init_sync()
+/**
+ * sync_init - initializes the futex table
+ */
+int sync_init(void)
 {
-    spin_lock_init(&futex_lock);
-    list_head_init(&futex_list);
+    int i;
+
+    for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spin_lock_init(&futex_table[i].lock);
+        list_head_init(&futex_table[i].waiters);
+    }
+
+    return 0;
 }
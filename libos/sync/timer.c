@@ -188,7 +188,7 @@ static void timer_start_locked(struct timer_entry *e, uint64_t deadline_us)
  */
 void timer_start(struct timer_entry *e, uint64_t deadline_us)
 {
-    struct kthread *k = thisk();
+    struct kthread *k = getk();
 
     spin_lock_np(&k->timer_lock);
     timer_start_locked(e, deadline_us);
@@ -209,7 +209,6 @@ bool timer_cancel(struct timer_entry *e)
     uint32_t last;
 
 try_again:
-    preempt_disable();
     k = atomic_load_acq(&e->k);
 
     spin_lock_np(&k->timer_lock);
@@ -294,6 +293,35 @@ void __api sl_usleep(int usecs)
     return timer_sleep(usecs);
 }
 
+BUILD_ASSERT(sizeof(struct timer_entry) <= sizeof(struct sl_timer));
+
+/**
+ * sl_timer_start - arms a one-shot timer
+ * @t: the timer storage, must stay valid until @fn runs or the timer is cancelled
+ * @fn: called from softirq context when the timer fires, must not block
+ * @arg: passed to @fn
+ * @deadline_us: the deadline in microseconds
+ */
+void __api sl_timer_start(struct sl_timer *t, sl_timer_fn_t fn, unsigned long arg,
+                          unsigned long deadline_us)
+{
+    struct timer_entry *e = (struct timer_entry *)t;
+
+    timer_init(e, fn, arg);
+    timer_start(e, deadline_us);
+}
+
+/**
+ * sl_timer_cancel - cancels a timer armed by sl_timer_start()
+ * @t: the timer
+ *
+ * Returns true if cancelled, or false if it has fired already.
+ */
+bool __api sl_timer_cancel(struct sl_timer *t)
+{
+    return timer_cancel((struct timer_entry *)t);
+}
+
 /**
  * timer_softirq - handles expired timers
  * @k: the kthread to check
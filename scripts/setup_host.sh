@@ -12,4 +12,9 @@ mkdir -p /mnt/huge || true
 mount -t hugetlbfs -opagesize=2M nodev /mnt/huge
 chmod 777 /mnt/huge
 
+# 1GB pages for the I/O region, skyloft falls back to 2MB pages without them
+if [ -d /sys/kernel/mm/hugepages/hugepages-1048576kB ]; then
+    echo 1 | tee /sys/devices/system/node/node*/hugepages/hugepages-1048576kB/nr_hugepages
+fi
+
 modprobe uio_pci_generic